@@ -0,0 +1,50 @@
+// Global operator new replacement counting heap allocations for
+// --count_allocations. Replacing operator new is the only way to see
+// allocations from std containers, and it changes the allocator of the
+// whole program, so this file is linked into the label_image tool only,
+// never into the libraries. It costs one relaxed load when counting is off.
+
+#include <cstdlib>
+#include <new>
+
+#include "arena.hpp"
+
+static bool enable_heap_counting() {
+    g_heap_allocations = 0;
+    return true;
+}
+static const bool g_heap_counting_linked = enable_heap_counting();
+
+static void* counted_malloc(size_t size) {
+    if (g_count_heap_allocations.load(std::memory_order_relaxed))
+        g_heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    void* ptr = std::malloc(size ? size : 1);
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new(size_t size) { return counted_malloc(size); }
+void* operator new[](size_t size) { return counted_malloc(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return counted_malloc(size);
+    }
+    catch (...) {
+        return nullptr;
+    }
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return counted_malloc(size);
+    }
+    catch (...) {
+        return nullptr;
+    }
+}
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete[](void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { std::free(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
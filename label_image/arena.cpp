@@ -0,0 +1,137 @@
+#include "arena.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "tensorflow/core/framework/allocator.h"
+#include "tensorflow/core/platform/logging.h"
+#include "tensorflow/core/platform/mem.h"
+
+#include "cv_process.hpp"
+
+using tensorflow::Tensor;
+using tensorflow::string;
+
+TensorPoolAllocator::~TensorPoolAllocator() {
+    for (auto& list : free_) {
+        for (void* ptr : list.second)
+            tensorflow::port::AlignedFree(ptr);
+    }
+}
+
+void* TensorPoolAllocator::AllocateRaw(size_t alignment, size_t num_bytes) {
+    {
+        std::unique_lock<std::mutex> lock(mu_);
+        auto it = free_.find(num_bytes);
+        if (it != free_.end() && !it->second.empty()) {
+            void* ptr = it->second.back();
+            it->second.pop_back();
+            cached_bytes_ -= num_bytes;
+            ++hits_;
+            return ptr;
+        }
+    }
+    ++misses_;
+    void* ptr = tensorflow::port::AlignedMalloc(num_bytes, std::max<size_t>(alignment, 64));
+    if (ptr != nullptr) {
+        std::unique_lock<std::mutex> lock(mu_);
+        sizes_[ptr] = num_bytes;
+    }
+    return ptr;
+}
+
+void TensorPoolAllocator::DeallocateRaw(void* ptr) {
+    std::unique_lock<std::mutex> lock(mu_);
+    auto it = sizes_.find(ptr);
+    if (it == sizes_.end())
+        return;
+    const size_t num_bytes = it->second;
+    if (cached_bytes_ + num_bytes > max_cached_bytes_) {
+        sizes_.erase(it);
+        lock.unlock();
+        tensorflow::port::AlignedFree(ptr);
+        return;
+    }
+    free_[num_bytes].push_back(ptr);
+    cached_bytes_ += num_bytes;
+}
+
+TensorPoolAllocator* input_tensor_allocator() {
+    static TensorPoolAllocator* allocator = new TensorPoolAllocator;
+    return allocator;
+}
+
+Tensor* WorkerArena::Input(int batch) {
+    return Input(batch, input_height_, input_width_);
+}
+
+Tensor* WorkerArena::Input(int batch, int height, int width) {
+    const long long key = ((long long)batch << 40) | ((long long)height << 20) | width;
+    auto it = inputs_.find(key);
+    if (it == inputs_.end()) {
+        it = inputs_.emplace(key, Tensor(input_tensor_allocator(), tensorflow::DT_FLOAT,
+            tensorflow::TensorShape({ batch, height, width, 3 }))).first;
+    }
+    return &it->second;
+}
+
+cv::Mat* WorkerArena::Image(size_t i) {
+    if (images_.size() <= i)
+        images_.resize(i + 1);
+    return &images_[i];
+}
+
+bool read_file_into(const string& path, std::vector<unsigned char>* file_buffer) {
+    // stdio rather than Env: RandomAccessFile would be one more heap object
+    // per image.
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr)
+        return false;
+    bool ok = fseek(file, 0, SEEK_END) == 0;
+    const long size = ok ? ftell(file) : -1;
+    ok = size > 0 && fseek(file, 0, SEEK_SET) == 0;
+    if (ok) {
+        file_buffer->resize(size);
+        ok = fread(file_buffer->data(), 1, size, file) == (size_t)size;
+    }
+    fclose(file);
+    return ok;
+}
+
+bool read_image_into(const string& path, std::vector<unsigned char>* file_buffer, cv::Mat* dst,
+    int reduce_width, int reduce_height, cv::Size* original) {
+    if (!read_file_into(path, file_buffer))
+        return false;
+    return cvprocess::decodeForInput(*file_buffer, reduce_width, reduce_height, *dst, original);
+}
+
+std::atomic<bool> g_count_heap_allocations{ false };
+std::atomic<long long> g_heap_allocations{ -1 };
+
+void EnableAllocationCounting() {
+    tensorflow::EnableCPUAllocatorStats(true);
+    g_count_heap_allocations = true;
+}
+
+c_alloc_snapshot AllocationSnapshot() {
+    c_alloc_snapshot snapshot;
+    snapshot.heap_allocs = g_heap_allocations.load();
+    tensorflow::AllocatorStats stats;
+    tensorflow::cpu_allocator()->GetStats(&stats);
+    snapshot.tf_allocs = stats.num_allocs;
+    snapshot.pool_misses = input_tensor_allocator()->misses();
+    return snapshot;
+}
+
+void log_allocations(const char* what, const c_alloc_snapshot& begin, const c_alloc_snapshot& end,
+    long long inferences) {
+    if (inferences <= 0)
+        return;
+    LOG(INFO) << what << " allocations per inference over " << inferences << " steady state runs: heap "
+        << (begin.heap_allocs >= 0 ? std::to_string((double)(end.heap_allocs - begin.heap_allocs) / inferences) :
+            string("n/a")) << ", tf cpu allocator "
+        << (double)(end.tf_allocs - begin.tf_allocs) / inferences << ", input pool misses "
+        << (double)(end.pool_misses - begin.pool_misses) / inferences;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "tensorflow/core/framework/allocator.h"
+#include "tensorflow/core/framework/tensor.h"
+
+#include <opencv2/core/core.hpp>
+
+// Allocator keeping freed blocks on per-size free lists. Input tensors come
+// back to it when their last reference goes, so after the first few images
+// every input of a known shape is a free list pop, even when tensors cross
+// threads as in the pipeline. Cached bytes are capped; beyond the cap blocks
+// are released to the system.
+class TensorPoolAllocator : public tensorflow::Allocator {
+public:
+    explicit TensorPoolAllocator(size_t max_cached_bytes = (size_t)1 << 30)
+        : max_cached_bytes_(max_cached_bytes) {}
+    ~TensorPoolAllocator() override;
+
+    tensorflow::string Name() override { return "label_image_tensor_pool"; }
+    void* AllocateRaw(size_t alignment, size_t num_bytes) override;
+    void DeallocateRaw(void* ptr) override;
+
+    long long hits() const { return hits_; }
+    long long misses() const { return misses_; }
+
+private:
+    const size_t max_cached_bytes_;
+    std::mutex mu_;
+    std::unordered_map<size_t, std::vector<void*> > free_;
+    // Every block handed out and still owned by the pool, with its size.
+    std::unordered_map<void*, size_t> sizes_;
+    size_t cached_bytes_ = 0;
+    std::atomic<long long> hits_{ 0 };
+    std::atomic<long long> misses_{ 0 };
+};
+
+// Process wide pool used for network input tensors.
+TensorPoolAllocator* input_tensor_allocator();
+
+// Per worker buffers reused from request to request: the batched input
+// tensor for each batch size and shape seen, the output vector, decoded images, the
+// encoded file bytes and preprocessing scratch. Not thread safe; keep one per
+// worker.
+class WorkerArena {
+public:
+    WorkerArena(int input_height, int input_width)
+        : input_height_(input_height), input_width_(input_width) {}
+
+    // {batch,H,W,3} float, allocated from input_tensor_allocator() the first
+    // time a batch size is asked for. Its contents are whatever the last
+    // user left.
+    tensorflow::Tensor* Input(int batch);
+    // The same for a shape bucket other than the default input size.
+    tensorflow::Tensor* Input(int batch, int height, int width);
+    std::vector<tensorflow::Tensor>* Outputs() { return &outputs_; }
+    // Decode targets; slot i keeps its buffer between images of equal size.
+    cv::Mat* Image(size_t i);
+    std::vector<unsigned char>* FileBuffer() { return &file_buffer_; }
+    cv::Mat* Scratch() { return &scratch_; }
+
+private:
+    const int input_height_;
+    const int input_width_;
+    std::unordered_map<long long, tensorflow::Tensor> inputs_;  // by batch, height, width
+    std::vector<tensorflow::Tensor> outputs_;
+    std::vector<cv::Mat> images_;
+    std::vector<unsigned char> file_buffer_;
+    cv::Mat scratch_;
+};
+
+// Reads path into *file_buffer, reusing its storage.
+bool read_file_into(const tensorflow::string& path, std::vector<unsigned char>* file_buffer);
+
+// Reads path into *file_buffer and decodes it into *dst, reusing both
+// buffers when the sizes allow. With reduce_width/height set, JPEGs may be
+// decoded at a reduced size covering them (cvprocess::decodeForInput) and
+// original receives the full size.
+bool read_image_into(const tensorflow::string& path, std::vector<unsigned char>* file_buffer, cv::Mat* dst,
+    int reduce_width = 0, int reduce_height = 0, cv::Size* original = nullptr);
+
+// Allocation accounting. Counting covers the TF cpu allocator (which also
+// serves the session's intermediate and output tensors), misses of the input
+// tensor pool and, in binaries linking alloc_counting.cpp, C++ operator new.
+// The library itself never replaces the global allocator; heap_allocs is -1
+// without it.
+extern std::atomic<bool> g_count_heap_allocations;
+extern std::atomic<long long> g_heap_allocations;
+
+struct c_alloc_snapshot {
+    long long heap_allocs = 0;
+    long long tf_allocs = 0;
+    long long pool_misses = 0;
+};
+
+void EnableAllocationCounting();
+c_alloc_snapshot AllocationSnapshot();
+// Logs allocations per inference between two snapshots.
+void log_allocations(const char* what, const c_alloc_snapshot& begin, const c_alloc_snapshot& end,
+    long long inferences);
@@ -0,0 +1,672 @@
+// Per-stage benchmarks for label_image on synthetic inputs.
+//
+// Microbenchmarks cover preprocessing (legacy resizeImage against the fused
+// path, 640x480 up to 4K, and the TensorFlow decode graph per image against
+// a cached TfPreprocessor), NMS over 16848 boxes at several overlap densities
+// (nms/nms2/nms_plus and the engine modes) and output decoding
+// (prepare_tf_detect_result against DetectionDecoder). With --graph, an end to
+// end harness runs session->Run from several threads at several batch sizes,
+// and as many clients submit single images to a dynamically batching Detector.
+// Every case reports mean/p50/p95/p99 latency and items per second; --json
+// writes the same as a JSON array for regression tracking.
+//
+//   label_image_bench --json=bench.json
+//   label_image_bench --graph=model.pb --threads=1,2,4 --batch_sizes=1,4,8
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <thread>
+
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/strings/numbers.h"
+#include "tensorflow/core/lib/strings/str_util.h"
+#include "tensorflow/core/lib/strings/strcat.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/init_main.h"
+#include "tensorflow/core/platform/logging.h"
+#include "tensorflow/core/util/command_line_flags.h"
+
+#include "cv_process.hpp"
+#include "detector.hpp"
+#include "nms.h"
+#include "nms_engine.hpp"
+#include "preprocess_simd.hpp"
+#include "tf_detect.hpp"
+#include "tf_preprocess.hpp"
+#include "tiling.hpp"
+
+using tensorflow::Flag;
+using tensorflow::Status;
+using tensorflow::Tensor;
+using tensorflow::string;
+
+namespace {
+
+const int kAnchors = 16848;
+
+struct c_bench_result {
+    string name;
+    string params;
+    int iterations = 0;
+    double items_per_iteration = 1;
+    double mean_us = 0, p50_us = 0, p95_us = 0, p99_us = 0;
+    double items_per_sec = 0;
+};
+
+struct c_bench_config {
+    int min_iterations = 20;
+    double min_time_ms = 500;
+    string filter;
+};
+
+double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    const size_t index = std::min(sorted.size() - 1, (size_t)(p * (sorted.size() - 1) + 0.5));
+    return sorted[index];
+}
+
+void summarize(std::vector<double>* latencies_us, double wall_us, double items, c_bench_result* result) {
+    std::sort(latencies_us->begin(), latencies_us->end());
+    double sum = 0;
+    for (double v : *latencies_us)
+        sum += v;
+    result->iterations = latencies_us->size();
+    result->mean_us = latencies_us->empty() ? 0 : sum / latencies_us->size();
+    result->p50_us = percentile(*latencies_us, 0.50);
+    result->p95_us = percentile(*latencies_us, 0.95);
+    result->p99_us = percentile(*latencies_us, 0.99);
+    result->items_per_sec = wall_us > 0 ? items * 1e6 / wall_us : 0;
+}
+
+class Bench {
+public:
+    explicit Bench(const c_bench_config& config) : config_(config) {}
+
+    bool Enabled(const string& name) const {
+        return config_.filter.empty() || name.find(config_.filter) != string::npos;
+    }
+
+    // Times fn once per iteration, after one untimed warmup call, until both
+    // the iteration and time minimums are met.
+    void Run(const string& name, const string& params, double items, const std::function<void()>& fn) {
+        if (!Enabled(name))
+            return;
+        fn();
+        std::vector<double> latencies;
+        const auto start = std::chrono::steady_clock::now();
+        double elapsed_us = 0;
+        while ((int)latencies.size() < config_.min_iterations || elapsed_us < config_.min_time_ms * 1000) {
+            const auto t0 = std::chrono::steady_clock::now();
+            fn();
+            const auto t1 = std::chrono::steady_clock::now();
+            latencies.push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+            elapsed_us = std::chrono::duration<double, std::micro>(t1 - start).count();
+        }
+        c_bench_result result;
+        result.name = name;
+        result.params = params;
+        result.items_per_iteration = items;
+        summarize(&latencies, elapsed_us, items * latencies.size(), &result);
+        Add(result);
+    }
+
+    void Add(const c_bench_result& result) {
+        printf("%-28s %-34s %7d it  mean %10.1fus  p50 %10.1fus  p95 %10.1fus  p99 %10.1fus  %10.1f/s\n",
+            result.name.c_str(), result.params.c_str(), result.iterations, result.mean_us, result.p50_us,
+            result.p95_us, result.p99_us, result.items_per_sec);
+        fflush(stdout);
+        results_.push_back(result);
+    }
+
+    string Json() const {
+        string out = "[\n";
+        for (size_t i = 0; i < results_.size(); ++i) {
+            const c_bench_result& r = results_[i];
+            char line[512];
+            snprintf(line, sizeof(line),
+                "  {\"name\":\"%s\",\"params\":\"%s\",\"iterations\":%d,\"items_per_iteration\":%g,"
+                "\"mean_us\":%.3f,\"p50_us\":%.3f,\"p95_us\":%.3f,\"p99_us\":%.3f,\"items_per_sec\":%.3f}%s\n",
+                r.name.c_str(), r.params.c_str(), r.iterations, r.items_per_iteration, r.mean_us, r.p50_us,
+                r.p95_us, r.p99_us, r.items_per_sec, i + 1 < results_.size() ? "," : "");
+            out += line;
+        }
+        out += "]\n";
+        return out;
+    }
+
+private:
+    const c_bench_config config_;
+    std::vector<c_bench_result> results_;
+};
+
+cv::Mat random_image(int width, int height, std::mt19937* rng) {
+    cv::Mat mat(height, width, CV_8UC3);
+    std::uniform_int_distribution<int> byte(0, 255);
+    for (int y = 0; y < height; ++y) {
+        unsigned char* row = mat.ptr<unsigned char>(y);
+        for (int x = 0; x < width * 3; ++x)
+            row[x] = byte(*rng);
+    }
+    return mat;
+}
+
+void bench_preprocess(Bench* bench, int input_width, int input_height, std::mt19937* rng) {
+    const int sizes[][2] = { { 640, 480 }, { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 } };
+    c_preprocess_options options;
+    options.input_width = input_width;
+    options.input_height = input_height;
+    Tensor input(tensorflow::DT_FLOAT, { 1, input_height, input_width, 3 });
+    cv::Mat scratch;
+    c_image_transform transform;
+
+    for (auto& size : sizes) {
+        const string params = tensorflow::strings::StrCat(size[0], "x", size[1], "->", input_width, "x", input_height);
+        cv::Mat image = random_image(size[0], size[1], rng);
+
+        options.fused = false;
+        bench->Run("preprocess/resizeImage", params, 1, [&]() {
+            preprocess_into_tensor(image, options, 0, &input, &scratch, &transform);
+        });
+        options.fused = true;
+        bench->Run("preprocess/fused", params, 1, [&]() {
+            preprocess_into_tensor(image, options, 0, &input, &scratch, &transform);
+        });
+        options.letterbox = true;
+        bench->Run("preprocess/fused_letterbox", params, 1, [&]() {
+            preprocess_into_tensor(image, options, 0, &input, &scratch, &transform);
+        });
+        options.letterbox = false;
+    }
+
+    // The normalize kernel alone, on a network sized image.
+    cv::Mat small = random_image(input_width, input_height, rng);
+    const int pixels = input_width * input_height;
+    const float means[3] = { 103.939f, 116.779f, 123.68f };
+    const float inv_std[3] = { 1.f, 1.f, 1.f };
+    float* dst = input.flat<float>().data();
+    const string params = tensorflow::strings::StrCat(input_width, "x", input_height);
+    bench->Run(tensorflow::strings::StrCat("normalize_u8c3/", normalize_u8c3_isa()), params, pixels, [&]() {
+        normalize_u8c3(small.data, pixels, means, inv_std, false, dst);
+    });
+    bench->Run("normalize_u8c3/scalar", params, pixels, [&]() {
+        normalize_u8c3_ref(small.data, pixels, means, inv_std, false, dst);
+    });
+}
+
+// JPEG decode at full size against the reduced decode sized to the network
+// input, on camera sized frames. Noise on a gradient keeps the encoded size
+// close to a real photo.
+void bench_image_decode(Bench* bench, int input_width, int input_height, std::mt19937* rng) {
+    const int sizes[][2] = { { 1920, 1080 }, { 4000, 3000 } };
+    std::normal_distribution<float> noise(0.f, 8.f);
+    cv::Mat decoded;
+    cv::Size original;
+
+    for (auto& size : sizes) {
+        cv::Mat image(size[1], size[0], CV_8UC3);
+        for (int y = 0; y < size[1]; ++y) {
+            unsigned char* row = image.ptr<unsigned char>(y);
+            for (int x = 0; x < size[0] * 3; ++x)
+                row[x] = cv::saturate_cast<unsigned char>((x / 3 + y) * 255.f / (size[0] + size[1]) + noise(*rng));
+        }
+        std::vector<unsigned char> jpeg;
+        cv::imencode(".jpg", image, jpeg, { IMWRITE_JPEG_QUALITY, 90 });
+
+        const string params = tensorflow::strings::StrCat(size[0], "x", size[1], "->", input_width, "x", input_height);
+        bench->Run("image_decode/full", params, 1, [&]() {
+            cvprocess::decodeForInput(jpeg, 0, 0, decoded, &original);
+        });
+        bench->Run("image_decode/reduced", params, 1, [&]() {
+            cvprocess::decodeForInput(jpeg, input_width, input_height, decoded, &original);
+        });
+    }
+}
+
+// Encoded JPEG to input tensor through TensorFlow ops, with the graph and
+// session built per image (as ReadTensorFromImageFile1 does) and cached in a
+// TfPreprocessor, against OpenCV decode + resizeImage and the fused path.
+void bench_tf_preprocess(Bench* bench, int input_width, int input_height, std::mt19937* rng) {
+    std::normal_distribution<float> noise(0.f, 8.f);
+    cv::Mat image(1080, 1920, CV_8UC3);
+    for (int y = 0; y < image.rows; ++y) {
+        unsigned char* row = image.ptr<unsigned char>(y);
+        for (int x = 0; x < image.cols * 3; ++x)
+            row[x] = cv::saturate_cast<unsigned char>((x / 3 + y) * 255.f / (image.cols + image.rows) + noise(*rng));
+    }
+    std::vector<unsigned char> jpeg;
+    cv::imencode(".jpg", image, jpeg, { IMWRITE_JPEG_QUALITY, 90 });
+    const string encoded(jpeg.begin(), jpeg.end());
+    const string params = tensorflow::strings::StrCat("1920x1080 jpeg->", input_width, "x", input_height);
+
+    c_preprocess_options options;
+    options.input_width = input_width;
+    options.input_height = input_height;
+    Tensor out;
+    c_image_transform transform;
+    bench->Run("preprocess/tf_graph_per_image", params, 1, [&]() {
+        TfPreprocessor preprocessor(options);
+        preprocessor.Preprocess(encoded, &out, &transform);
+    });
+    TfPreprocessor cached(options);
+    bench->Run("preprocess/tf_cached_session", params, 1, [&]() {
+        cached.Preprocess(encoded, &out, &transform);
+    });
+
+    Tensor input(tensorflow::DT_FLOAT, { 1, input_height, input_width, 3 });
+    cv::Mat decoded, scratch;
+    cv::Size original;
+    bench->Run("preprocess/cv_resizeImage", params, 1, [&]() {
+        cvprocess::decodeForInput(jpeg, 0, 0, decoded, &original);
+        options.fused = false;
+        preprocess_into_tensor(decoded, options, 0, &input, &scratch, &transform);
+    });
+    bench->Run("preprocess/cv_fused", params, 1, [&]() {
+        cvprocess::decodeForInput(jpeg, 0, 0, decoded, &original);
+        options.fused = true;
+        preprocess_into_tensor(decoded, options, 0, &input, &scratch, &transform);
+    });
+}
+
+// Boxes clustered around `clusters` centres; fewer clusters means more
+// overlap and more suppression work per kept box.
+void random_boxes(int count, int clusters, int classes, std::mt19937* rng, std::vector<cv::Rect>* rects,
+    std::vector<float>* scores, std::vector<int>* labels) {
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+    std::normal_distribution<float> jitter(0.f, 12.f);
+    std::vector<cv::Point2f> centres(clusters);
+    for (auto& c : centres)
+        c = cv::Point2f(unit(*rng) * 1800 + 60, unit(*rng) * 1000 + 40);
+    rects->clear();
+    scores->clear();
+    labels->clear();
+    for (int i = 0; i < count; ++i) {
+        const cv::Point2f& c = centres[i % clusters];
+        const int w = 40 + (int)(unit(*rng) * 80);
+        const int h = 40 + (int)(unit(*rng) * 80);
+        rects->push_back(cv::Rect((int)(c.x + jitter(*rng)) - w / 2, (int)(c.y + jitter(*rng)) - h / 2, w, h));
+        scores->push_back(unit(*rng));
+        labels->push_back(i % classes);
+    }
+}
+
+void bench_nms(Bench* bench, std::mt19937* rng) {
+    const struct { const char* name; int clusters; } densities[] = {
+        { "sparse", 4000 }, { "medium", 400 }, { "dense", 40 } };
+    std::vector<cv::Rect> rects, kept;
+    std::vector<float> scores;
+    std::vector<int> labels;
+
+    for (auto& density : densities) {
+        random_boxes(kAnchors, density.clusters, 3, rng, &rects, &scores, &labels);
+        const string params = tensorflow::strings::StrCat(kAnchors, " boxes ", density.name);
+
+        bench->Run("nms/nms", params, kAnchors, [&]() { nms(rects, kept, 0.4f); });
+        bench->Run("nms/nms2", params, kAnchors, [&]() { nms2(rects, scores, kept, 0.4f); });
+
+        std::map<int, std::vector<c_tf_detect_result> > by_class, suppressed;
+        for (int i = 0; i < kAnchors; ++i) {
+            c_tf_detect_result det;
+            det.nclass = labels[i];
+            det.score = scores[i];
+            det.r = rects[i];
+            by_class[det.nclass].push_back(det);
+        }
+        bench->Run("nms/nms_plus", params, kAnchors, [&]() { nms_plus(by_class, suppressed, 0.4f); });
+
+        NmsBoxes boxes;
+        for (int i = 0; i < kAnchors; ++i) {
+            const cv::Rect& r = rects[i];
+            boxes.push_back(r.x, r.y, r.x + r.width, r.y + r.height, scores[i], labels[i]);
+        }
+        NmsEngine engine;
+        std::vector<c_nms_keep> keep;
+        const struct { const char* name; NmsMode mode; } modes[] = {
+            { "hard", NmsMode::Hard }, { "weighted", NmsMode::ScoreWeighted },
+            { "soft_linear", NmsMode::SoftLinear }, { "soft", NmsMode::SoftGaussian } };
+        for (auto& mode : modes) {
+            c_nms_options options;
+            options.mode = mode.mode;
+            bench->Run(tensorflow::strings::StrCat("nms/engine_", mode.name), params, kAnchors, [&]() {
+                engine.Run(boxes, options, &keep);
+            });
+        }
+    }
+}
+
+// Outputs shaped like the detector's: boxes {1,A,4} as cx,cy,w,h in network
+// pixels, classes {1,A} int64 and scores {1,A}, with `hit_rate` of the
+// anchors above the threshold.
+void random_outputs(float hit_rate, std::mt19937* rng, std::vector<Tensor>* outputs) {
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+    Tensor boxes(tensorflow::DT_FLOAT, { 1, kAnchors, 4 });
+    Tensor classes(tensorflow::DT_INT64, { 1, kAnchors });
+    Tensor scores(tensorflow::DT_FLOAT, { 1, kAnchors });
+    auto b = boxes.flat<float>();
+    auto c = classes.flat<tensorflow::int64>();
+    auto s = scores.flat<float>();
+    for (int i = 0; i < kAnchors; ++i) {
+        b(i * 4 + 0) = unit(*rng) * 624;
+        b(i * 4 + 1) = unit(*rng) * 384;
+        b(i * 4 + 2) = 20 + unit(*rng) * 60;
+        b(i * 4 + 3) = 20 + unit(*rng) * 60;
+        c(i) = i % 3;
+        s(i) = unit(*rng) < hit_rate ? 0.6f + 0.4f * unit(*rng) : 0.6f * unit(*rng);
+    }
+    *outputs = { boxes, classes, scores };
+}
+
+void bench_decode(Bench* bench, std::mt19937* rng) {
+    const float hit_rates[] = { 0.001f, 0.01f, 0.1f };
+    c_image_transform transform;
+    transform.scale_factor_w = 624.f / 1920;
+    transform.scale_factor_h = 384.f / 1080;
+    c_nms_options nms_options;
+    nms_options.inclusive = true;
+
+    for (float hit_rate : hit_rates) {
+        std::vector<Tensor> outputs;
+        random_outputs(hit_rate, rng, &outputs);
+        const string params = tensorflow::strings::StrCat(kAnchors, " anchors ", hit_rate * 100, "% hits");
+
+        std::map<int, std::vector<c_tf_detect_result> > candidates, suppressed;
+        bench->Run("decode/prepare_tf_detect_result", params, 1, [&]() {
+            candidates.clear();
+            prepare_tf_detect_result(outputs[0], outputs[1], outputs[2], 0, transform, 0.6f, candidates);
+        });
+        bench->Run("decode/prepare+nms_plus", params, 1, [&]() {
+            candidates.clear();
+            prepare_tf_detect_result(outputs[0], outputs[1], outputs[2], 0, transform, 0.6f, candidates);
+            nms_plus(candidates, suppressed, nms_options);
+        });
+
+        for (int top_k : { 0, 1000 }) {
+            DetectionDecoder decoder(top_k);
+            std::vector<c_tf_detect_result> dets;
+            bench->Run(tensorflow::strings::StrCat("decode/decoder_top", top_k), params, 1, [&]() {
+                decoder.Decode(outputs[0], outputs[1], outputs[2], 0, transform, 0.6f);
+                decoder.Suppress(nms_options, &dets);
+            });
+        }
+    }
+}
+
+// `threads` callers each run batches of `batch_size` back to back for
+// duration_ms; latency is per Run, throughput counts images. Reported as name,
+// so differently loaded sessions can be told apart.
+void bench_end_to_end(Bench* bench, const string& name, tensorflow::Session* session, const string& input_layer,
+    const std::vector<string>& output_layers, int input_width, int input_height,
+    const std::vector<int>& threads, const std::vector<int>& batch_sizes, double duration_ms, std::mt19937* rng) {
+    if (!bench->Enabled(name))
+        return;
+    std::uniform_real_distribution<float> pixel(-128.f, 128.f);
+    for (int batch_size : batch_sizes) {
+        Tensor input(tensorflow::DT_FLOAT, { batch_size, input_height, input_width, 3 });
+        auto flat = input.flat<float>();
+        for (int i = 0; i < flat.size(); ++i)
+            flat(i) = pixel(*rng);
+
+        for (int thread_count : threads) {
+            const string params = tensorflow::strings::StrCat("batch ", batch_size, " threads ", thread_count);
+            // Warm every thread's first run outside the measurement; under
+            // the XLA JIT this is also where the shape is compiled.
+            std::vector<Tensor> warm;
+            Status warm_status = session->Run({ { input_layer, input } }, output_layers, {}, &warm);
+            if (!warm_status.ok()) {
+                LOG(ERROR) << "session->Run failed: " << warm_status;
+                return;
+            }
+
+            std::vector<std::vector<double> > latencies(thread_count);
+            std::atomic<bool> failed{ false };
+            const auto start = std::chrono::steady_clock::now();
+            const auto stop = start + std::chrono::microseconds((long long)(duration_ms * 1000));
+            std::vector<std::thread> workers;
+            for (int t = 0; t < thread_count; ++t) {
+                workers.emplace_back([&, t]() {
+                    std::vector<Tensor> outputs;
+                    while (!failed && std::chrono::steady_clock::now() < stop) {
+                        const auto t0 = std::chrono::steady_clock::now();
+                        Status status = session->Run({ { input_layer, input } }, output_layers, {}, &outputs);
+                        const auto t1 = std::chrono::steady_clock::now();
+                        if (!status.ok()) {
+                            failed = true;
+                            break;
+                        }
+                        latencies[t].push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+                    }
+                });
+            }
+            for (auto& worker : workers)
+                worker.join();
+            const double wall_us = std::chrono::duration<double, std::micro>(
+                std::chrono::steady_clock::now() - start).count();
+
+            std::vector<double> all;
+            for (auto& l : latencies)
+                all.insert(all.end(), l.begin(), l.end());
+            c_bench_result result;
+            result.name = name;
+            result.params = params;
+            result.items_per_iteration = batch_size;
+            summarize(&all, wall_us, (double)all.size() * batch_size, &result);
+            bench->Add(result);
+        }
+    }
+}
+
+// One 4K image through the whole detector: downscaled to the input against
+// tiled at full resolution. Throughput is in images.
+void bench_tiled(Bench* bench, tensorflow::Session* session, const string& input_layer,
+    const std::vector<string>& output_layers, int input_width, int input_height, std::mt19937* rng) {
+    const cv::Mat image = random_image(3840, 2160, rng);
+    const string params = tensorflow::strings::StrCat("3840x2160 on ", input_width, "x", input_height);
+    c_preprocess_options preprocess;
+    preprocess.input_width = input_width;
+    preprocess.input_height = input_height;
+    preprocess.fused = true;
+    c_nms_options nms;
+    std::vector<c_tf_detect_result> dst;
+
+    Tensor input(tensorflow::DT_FLOAT, { 1, input_height, input_width, 3 });
+    std::vector<Tensor> outputs;
+    cv::Mat scratch;
+    DetectionDecoder decoder;
+    bench->Run("e2e/downscale", params, 1, [&]() {
+        c_image_transform transform;
+        if (!preprocess_into_tensor(image, preprocess, 0, &input, &scratch, &transform))
+            return;
+        Status status = session->Run({ { input_layer, input } }, output_layers, {}, &outputs);
+        if (!status.ok())
+            return;
+        decoder.Decode(outputs[0], outputs[1], outputs[2], 0, transform, 0.6f);
+        decoder.Suppress(nms, &dst);
+    });
+
+    const c_tile_options tile;
+    std::vector<cv::Rect> tiles;
+    plan_tiles(image.size(), input_width, input_height, tile.overlap, &tiles);
+    TiledDetector detector(session, tile, preprocess, 0.6f, nms, 0, input_layer, output_layers);
+    bench->Run("e2e/tiled", tensorflow::strings::StrCat(params, ", ", tiles.size(), "+1 tiles"), 1, [&]() {
+        detector.Detect(image, &dst);
+    });
+}
+
+// Closed loop clients, each submitting one 1280x720 image to a shared
+// Detector and waiting for it, so concurrent requests are merged by the
+// dynamic batcher. Latency is Submit to result.
+void bench_detector(Bench* bench, tensorflow::Session* session, const string& input_layer,
+    const std::vector<string>& output_layers, int input_width, int input_height,
+    const std::vector<int>& threads, int max_batch, double duration_ms, std::mt19937* rng) {
+    if (!bench->Enabled("e2e/detector_submit"))
+        return;
+    const cv::Mat image = random_image(1280, 720, rng);
+    for (int max_delay_us : { 0, 1000, 5000 }) {
+        c_detector_options options;
+        options.preprocess.input_width = input_width;
+        options.preprocess.input_height = input_height;
+        options.preprocess.fused = true;
+        options.input_layer = input_layer;
+        options.output_layers = output_layers;
+        options.max_batch = max_batch;
+        options.max_delay_us = max_delay_us;
+        std::unique_ptr<Detector> detector;
+        Status status = Detector::New(session, options, &detector);
+        if (!status.ok()) {
+            LOG(ERROR) << status;
+            return;
+        }
+        for (int thread_count : threads) {
+            std::vector<std::vector<double> > latencies(thread_count);
+            std::atomic<bool> failed{ false };
+            const auto start = std::chrono::steady_clock::now();
+            const auto stop = start + std::chrono::microseconds((long long)(duration_ms * 1000));
+            std::vector<std::thread> clients;
+            for (int t = 0; t < thread_count; ++t) {
+                clients.emplace_back([&, t]() {
+                    while (!failed && std::chrono::steady_clock::now() < stop) {
+                        const auto t0 = std::chrono::steady_clock::now();
+                        const c_detection_result result = detector->Submit(image).get();
+                        const auto t1 = std::chrono::steady_clock::now();
+                        if (!result.status.ok()) {
+                            failed = true;
+                            break;
+                        }
+                        latencies[t].push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+                    }
+                });
+            }
+            for (auto& client : clients)
+                client.join();
+            const double wall_us = std::chrono::duration<double, std::micro>(
+                std::chrono::steady_clock::now() - start).count();
+
+            std::vector<double> all;
+            for (auto& l : latencies)
+                all.insert(all.end(), l.begin(), l.end());
+            c_bench_result result;
+            result.name = "e2e/detector_submit";
+            result.params = tensorflow::strings::StrCat("max_batch ", max_batch, " max_delay_us ", max_delay_us,
+                " clients ", thread_count);
+            result.items_per_iteration = 1;
+            summarize(&all, wall_us, (double)all.size(), &result);
+            bench->Add(result);
+        }
+        detector->LogStats();
+    }
+}
+
+bool parse_int_list(const string& text, std::vector<int>* values) {
+    values->clear();
+    for (const string& item : tensorflow::str_util::Split(text, ',', tensorflow::str_util::SkipEmpty())) {
+        tensorflow::int32 v;
+        if (!tensorflow::strings::safe_strto32(item, &v) || v < 1)
+            return false;
+        values->push_back(v);
+    }
+    return !values->empty();
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    string graph = "";
+    string input_layer = "image_input";
+    tensorflow::int32 input_width = 624;
+    tensorflow::int32 input_height = 384;
+    string threads = "1,2,4";
+    string batch_sizes = "1,4,8";
+    tensorflow::int32 min_iterations = 20;
+    float min_time_ms = 500;
+    float e2e_time_ms = 5000;
+    string filter = "";
+    bool xla_jit = false;
+    string json = "";
+    tensorflow::int32 seed = 1;
+
+    std::vector<Flag> flag_list = {
+        Flag("graph", &graph, "frozen graph for the end to end runs, empty to skip them"),
+        Flag("input_layer", &input_layer, "name of input layer"),
+        Flag("input_width", &input_width, "network input width"),
+        Flag("input_height", &input_height, "network input height"),
+        Flag("threads", &threads, "comma separated concurrent Run callers for end to end runs"),
+        Flag("batch_sizes", &batch_sizes, "comma separated batch sizes for end to end runs"),
+        Flag("min_iterations", &min_iterations, "minimum timed iterations per microbenchmark"),
+        Flag("min_time_ms", &min_time_ms, "minimum time per microbenchmark"),
+        Flag("e2e_time_ms", &e2e_time_ms, "time per end to end configuration"),
+        Flag("filter", &filter, "only run benchmarks whose name contains this"),
+        Flag("xla_jit", &xla_jit, "also run the end to end benchmark on an XLA JIT compiled session"),
+        Flag("json", &json, "write results to this file as JSON"),
+        Flag("seed", &seed, "random seed for the synthetic inputs"),
+    };
+    string usage = tensorflow::Flags::Usage(argv[0], flag_list);
+    if (!tensorflow::Flags::Parse(&argc, argv, flag_list)) {
+        LOG(ERROR) << usage;
+        return -1;
+    }
+    tensorflow::port::InitMain(argv[0], &argc, &argv);
+    std::vector<int> thread_counts, batches;
+    if (argc > 1 || !parse_int_list(threads, &thread_counts) || !parse_int_list(batch_sizes, &batches)) {
+        LOG(ERROR) << usage;
+        return -1;
+    }
+
+    c_bench_config config;
+    config.min_iterations = min_iterations;
+    config.min_time_ms = min_time_ms;
+    config.filter = filter;
+    Bench bench(config);
+    std::mt19937 rng(seed);
+    printf("isa: normalize %s, nms %s\n", normalize_u8c3_isa(), nms_engine_isa());
+
+    bench_preprocess(&bench, input_width, input_height, &rng);
+    bench_image_decode(&bench, input_width, input_height, &rng);
+    bench_tf_preprocess(&bench, input_width, input_height, &rng);
+    bench_nms(&bench, &rng);
+    bench_decode(&bench, &rng);
+
+    if (!graph.empty()) {
+        const std::vector<string> output_layers = { "bbox/trimming/bbox", "probability/class_idx",
+            "probability/score" };
+        if (xla_jit) {
+            // Loaded first: TF reads its XLA flags when the first session is
+            // created, and the interpreted session ignores them.
+            std::unique_ptr<tensorflow::Session> session;
+            tensorflow::GraphDef graph_def;
+            c_load_options load_options;
+            load_options.xla_jit = true;
+            Status load_status = LoadGraph(graph, "", &session, graph_def, load_options);
+            if (!load_status.ok()) {
+                LOG(ERROR) << load_status;
+                return -1;
+            }
+            bench_end_to_end(&bench, "e2e/xla_jit_run", session.get(), input_layer, output_layers,
+                input_width, input_height, thread_counts, batches, e2e_time_ms, &rng);
+        }
+        std::unique_ptr<tensorflow::Session> session;
+        tensorflow::GraphDef graph_def;
+        Status load_status = LoadGraph(graph, "", &session, graph_def);
+        if (!load_status.ok()) {
+            LOG(ERROR) << load_status;
+            return -1;
+        }
+        bench_end_to_end(&bench, "e2e/session_run", session.get(), input_layer, output_layers,
+            input_width, input_height, thread_counts, batches, e2e_time_ms, &rng);
+        bench_tiled(&bench, session.get(), input_layer, output_layers, input_width, input_height, &rng);
+        bench_detector(&bench, session.get(), input_layer, output_layers, input_width, input_height,
+            thread_counts, *std::max_element(batches.begin(), batches.end()), e2e_time_ms, &rng);
+    }
+
+    if (!json.empty()) {
+        Status write_status = tensorflow::WriteStringToFile(tensorflow::Env::Default(), json, bench.Json());
+        if (!write_status.ok()) {
+            LOG(ERROR) << write_status;
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,80 @@
+#include "cascade.hpp"
+
+#include <algorithm>
+#include <fstream>
+
+#include "tensorflow/core/lib/core/errors.h"
+
+#include "trace.hpp"
+
+using tensorflow::Status;
+using tensorflow::Tensor;
+using tensorflow::string;
+
+Status ReadLabelsFile(const string& file_name, std::vector<string>* labels) {
+    std::ifstream file(file_name);
+    if (!file)
+        return tensorflow::errors::NotFound("Labels file ", file_name, " not found.");
+    labels->clear();
+    string line;
+    while (std::getline(file, line))
+        labels->push_back(line);
+    return Status::OK();
+}
+
+CropClassifier::CropClassifier(ModelRegistry* registry, const c_cascade_options& options)
+    : registry_(registry), options_(options),
+    arena_(options.preprocess.input_height, options.preprocess.input_width) {}
+
+Status CropClassifier::Classify(const cv::Mat& image, const std::vector<c_tf_detect_result>& dets, float scale,
+    std::vector<c_crop_label>* labels) {
+    labels->assign(dets.size(), c_crop_label());
+    order_.resize(dets.size());
+    for (size_t i = 0; i < dets.size(); ++i)
+        order_[i] = i;
+    const size_t n = std::min(dets.size(), (size_t)std::max(0, options_.max_crops));
+    last_crops_ = n;
+    if (n == 0)
+        return Status::OK();
+    std::partial_sort(order_.begin(), order_.begin() + n, order_.end(),
+        [&dets](size_t a, size_t b) { return dets[a].score > dets[b].score; });
+
+    Tensor* input = arena_.Input(n);
+    {
+        TRACE_SCOPE("crop");
+        const cv::Rect bounds(0, 0, image.cols, image.rows);
+        for (size_t k = 0; k < n; ++k) {
+            const cv::Rect& r = dets[order_[k]].r;
+            const float pad_x = r.width * options_.padding;
+            const float pad_y = r.height * options_.padding;
+            cv::Rect crop = cv::Rect(cvRound((r.x - pad_x) * scale), cvRound((r.y - pad_y) * scale),
+                cvRound((r.width + 2 * pad_x) * scale), cvRound((r.height + 2 * pad_y) * scale)) & bounds;
+            if (crop.area() == 0)
+                crop = bounds;
+            // A ROI is a view into image; only the resize copies.
+            c_image_transform transform;
+            if (!preprocess_into_tensor(image(crop), options_.preprocess, k, input, arena_.Scratch(), &transform))
+                return tensorflow::errors::InvalidArgument("cannot preprocess crop ", k);
+        }
+    }
+
+    std::vector<Tensor>* outputs = arena_.Outputs();
+    TF_RETURN_IF_ERROR(registry_->Run(options_.model, { { options_.input_layer, *input } },
+        { options_.output_layer }, outputs));
+    const Tensor& probabilities = (*outputs)[0];
+    if (probabilities.dims() != 2 || probabilities.dim_size(0) != (tensorflow::int64)n)
+        return tensorflow::errors::InvalidArgument("classifier output ", probabilities.shape().DebugString(),
+            " is not {", n, ",classes}");
+    auto flat = probabilities.matrix<float>();
+    const int classes = probabilities.dim_size(1);
+    for (size_t k = 0; k < n; ++k) {
+        c_crop_label& label = (*labels)[order_[k]];
+        for (int c = 0; c < classes; ++c) {
+            if (label.label < 0 || flat(k, c) > label.score) {
+                label.label = c;
+                label.score = flat(k, c);
+            }
+        }
+    }
+    return Status::OK();
+}
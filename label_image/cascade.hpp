@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "tensorflow/core/lib/core/status.h"
+
+#include "arena.hpp"
+#include "model_registry.hpp"
+#include "tf_detect.hpp"
+
+// Second stage of a detector -> classifier cascade: the boxes left after
+// suppression are cropped out of the image, resized into one batched
+// tensor and classified with a single Run of a registry model, such as the
+// inception_v4 graph of generate_inception_v4_pb.txt.
+struct c_cascade_options {
+    tensorflow::string model = "classifier";  // registry name
+    tensorflow::string input_layer = "input";
+    tensorflow::string output_layer = "InceptionV4/Logits/Predictions";
+    // Crop size and normalization, as the classifier was trained.
+    c_preprocess_options preprocess;
+    // Crops grow by this fraction of the box on every side, for context.
+    float padding = 0.1f;
+    // Highest scoring boxes classified per image; the rest get no label.
+    int max_crops = 64;
+};
+
+struct c_crop_label {
+    int label = -1;
+    float score = 0.f;
+};
+
+// Reads one label per line.
+tensorflow::Status ReadLabelsFile(const tensorflow::string& file_name, std::vector<tensorflow::string>* labels);
+
+// Buffers are kept between images; use one per thread.
+class CropClassifier {
+public:
+    CropClassifier(ModelRegistry* registry, const c_cascade_options& options);
+
+    // Sets (*labels)[i] to the top class of dets[i]. Boxes are in source
+    // coordinates; image may be decoded smaller, by scale as for
+    // render_detections.
+    tensorflow::Status Classify(const cv::Mat& image, const std::vector<c_tf_detect_result>& dets, float scale,
+        std::vector<c_crop_label>* labels);
+
+    int last_crops() const { return last_crops_; }
+
+private:
+    ModelRegistry* registry_;
+    const c_cascade_options options_;
+    WorkerArena arena_;
+    std::vector<size_t> order_;
+    int last_crops_ = 0;
+};
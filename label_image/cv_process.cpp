@@ -1,73 +1,175 @@
 
 #include "cv_process.hpp"
+#include "preprocess_simd.hpp"
 #include <fstream>
 
+// The single op entry points are one step pipelines.
 bool cvprocess::flip(std::vector<unsigned char>& idata, std::vector<unsigned char>& odata) {
-    Mat src;
-    cv::Mat dst;
-
-    if (!readImage(idata, src))
-        return false;
-
-    cv::flip(src, dst, 0);
-
-    return writeImage(dst, odata);
+    return process(idata, { { ImageOp::Flip, 0 } }, odata);
 }
 
 bool cvprocess::medianBlur(std::vector<unsigned char>& idata, std::vector<unsigned char>& odata) {
-    Mat src;
-    cv::Mat dst;
-
-    if (!readImage(idata, src))
-        return false;
-
-    cv::medianBlur(src, dst, 3);
-
-    return writeImage(dst, odata);
+    return process(idata, { { ImageOp::MedianBlur, 3 } }, odata);
 }
 
 bool cvprocess::applyColorMap(std::vector<unsigned char>& idata, std::vector<unsigned char>& odata) {
-    Mat src;
-    cv::Mat dst;
-
-    if (!readImage(idata, src))
-        return false;
-
-    //cv::applyColorMap(src, dst, 0);
-
-    return writeImage(dst, odata);
+    return process(idata, { { ImageOp::ColorMap, 0 } }, odata);
 }
 
 bool cvprocess::cvtColor(std::vector<unsigned char>& idata, std::vector<unsigned char>& odata) {
-    Mat src;
-    cv::Mat dst;
+    return process(idata, { { ImageOp::Gray, 0 } }, odata);
+}
 
-    if (!readImage(idata, src))
-        return false;
+bool cvprocess::parseOps(const std::string& spec, std::vector<c_image_op>* ops) {
+    ops->clear();
+    size_t begin = 0;
+    while (begin < spec.size()) {
+        size_t end = spec.find(',', begin);
+        if (end == std::string::npos)
+            end = spec.size();
+        const std::string item = spec.substr(begin, end - begin);
+        begin = end + 1;
+        if (item.empty())
+            continue;
+        const size_t colon = item.find(':');
+        const std::string name = item.substr(0, colon);
+        c_image_op op;
+        bool has_param = colon != std::string::npos;
+        if (has_param) {
+            char* rest = nullptr;
+            op.param = strtol(item.c_str() + colon + 1, &rest, 10);
+            if (rest == item.c_str() + colon + 1 || *rest != 0)
+                return false;
+        }
+        if (name == "flip") {
+            op.op = ImageOp::Flip;
+            if (op.param < -1 || op.param > 1)
+                return false;
+        }
+        else if (name == "median_blur") {
+            op.op = ImageOp::MedianBlur;
+            if (!has_param)
+                op.param = 3;
+            if (op.param < 3 || op.param % 2 == 0)
+                return false;
+        }
+        else if (name == "gray") {
+            op.op = ImageOp::Gray;
+        }
+        else if (name == "color_map") {
+#if CV_MAJOR_VERSION >= 3
+            op.op = ImageOp::ColorMap;
+            if (op.param < 0 || op.param > 11)
+                return false;
+#else
+            // applyColorMap lives in the 2.x contrib module, which is not
+            // linked.
+            return false;
+#endif
+        }
+        else {
+            return false;
+        }
+        ops->push_back(op);
+    }
+    return true;
+}
 
-    cv::cvtColor(src, dst, CV_BGR2GRAY);
+void cvprocess::fuseOps(std::vector<c_image_op>* ops) {
+    // flip code as (around x, around y) bits: 0 -> x, 1 -> y, -1 -> both.
+    auto flip_bits = [](int code) { return code == 0 ? 1 : code > 0 ? 2 : 3; };
+    std::vector<c_image_op> fused;
+    for (size_t i = 0; i < ops->size(); ++i) {
+        const c_image_op& op = (*ops)[i];
+        if (op.op == ImageOp::Gray) {
+            // Grey twice is grey once, and applyColorMap greys colour input
+            // itself.
+            const bool next_needs_no_gray = i + 1 < ops->size() &&
+                ((*ops)[i + 1].op == ImageOp::Gray || (*ops)[i + 1].op == ImageOp::ColorMap);
+            if (next_needs_no_gray)
+                continue;
+        }
+        if (op.op == ImageOp::Flip && !fused.empty() && fused.back().op == ImageOp::Flip) {
+            const int bits = flip_bits(fused.back().param) ^ flip_bits(op.param);
+            if (bits == 0)
+                fused.pop_back();
+            else
+                fused.back().param = bits == 1 ? 0 : bits == 2 ? 1 : -1;
+            continue;
+        }
+        fused.push_back(op);
+    }
+    ops->swap(fused);
+}
 
-    return writeImage(dst, odata);
+bool cvprocess::applyOps(cv::Mat& mat, const std::vector<c_image_op>& ops, cv::Mat& scratch) {
+    if (mat.data == nullptr)
+        return false;
+    for (const c_image_op& op : ops) {
+        switch (op.op) {
+        case ImageOp::Flip:
+            cv::flip(mat, mat, op.param);
+            break;
+        case ImageOp::MedianBlur:
+            cv::medianBlur(mat, scratch, op.param);
+            std::swap(mat, scratch);
+            break;
+        case ImageOp::Gray:
+            if (mat.channels() == 1)
+                break;
+            cv::cvtColor(mat, scratch, mat.channels() == 4 ? CV_BGRA2GRAY : CV_BGR2GRAY);
+            std::swap(mat, scratch);
+            break;
+        case ImageOp::ColorMap:
+#if CV_MAJOR_VERSION >= 3
+            if (mat.depth() != CV_8U)
+                return false;
+            if (mat.channels() == 4) {
+                cv::cvtColor(mat, scratch, CV_BGRA2BGR);
+                std::swap(mat, scratch);
+            }
+            cv::applyColorMap(mat, scratch, op.param);
+            std::swap(mat, scratch);
+            break;
+#else
+            return false;
+#endif
+        }
+    }
+    return true;
 }
 
+bool cvprocess::process(const std::vector<unsigned char>& idata, std::vector<c_image_op> ops,
+    std::vector<unsigned char>& odata, int png_level) {
+    if (idata.empty())
+        return false;
+    fuseOps(&ops);
+    // A leading grey conversion is done by the decoder.
+    int flags = CV_LOAD_IMAGE_UNCHANGED;
+    if (!ops.empty() && ops.front().op == ImageOp::Gray) {
+        flags = CV_LOAD_IMAGE_GRAYSCALE;
+        ops.erase(ops.begin());
+    }
+    thread_local cv::Mat mat;
+    thread_local cv::Mat scratch;
+    if (cv::imdecode(idata, flags, &mat).data == nullptr)
+        return false;
+    return applyOps(mat, ops, scratch) && writeImage(mat, odata, png_level);
+}
 
 bool cvprocess::readImage(std::vector<unsigned char>& idata, cv::Mat& dst) {
     if (idata.size() == 0)
         return false;
 
-    dst = cv::imdecode(idata, CV_LOAD_IMAGE_UNCHANGED);
-    //dst = cv::imdecode(idata, IMREAD_UNCHANGED);
-
-    return dst.data != nullptr;
+    // Decoding into dst reuses its buffer when the size repeats.
+    return cv::imdecode(idata, CV_LOAD_IMAGE_UNCHANGED, &dst).data != nullptr;
 }
 
-bool cvprocess::writeImage(cv::Mat& src, std::vector<unsigned char>& odata) {
+bool cvprocess::writeImage(cv::Mat& src, std::vector<unsigned char>& odata, int png_level) {
     if (src.data == nullptr)
         return false;
 
-    vector<int> param;
-    param.push_back(IMWRITE_PNG_COMPRESSION);
-    param.push_back(3); //default(3) 0-9.
+    const vector<int> param = { IMWRITE_PNG_COMPRESSION, png_level };
     return cv::imencode(".png", src, odata, param);
 }
 
@@ -78,20 +180,137 @@ bool cvprocess::resizeImage(cv::Mat& input, float bmeans, float gmeans, float rm
 //cv::Mat img;
         const int height = input.rows;
         const int width = input.cols;
-        input.convertTo(img, CV_32FC3);
-        for (int r = 0; r < img.rows; r++) {
-            for (int c = 0; c < img.cols; c++) {
-                int offset = (r * img.cols + c) * 3;
-                reinterpret_cast<float *>(img.data)[offset + 0] -= bmeans; // B
-                reinterpret_cast<float *>(img.data)[offset + 1] -= gmeans;
-                reinterpret_cast<float *>(img.data)[offset + 2] -= rmeans;
+        // Full resolution float copy kept per thread, so the resize writes
+        // straight into img and neither allocates once sizes repeat.
+        thread_local cv::Mat full;
+        input.convertTo(full, CV_32FC3);
+        for (int r = 0; r < full.rows; r++) {
+            for (int c = 0; c < full.cols; c++) {
+                int offset = (r * full.cols + c) * 3;
+                reinterpret_cast<float *>(full.data)[offset + 0] -= bmeans; // B
+                reinterpret_cast<float *>(full.data)[offset + 1] -= gmeans;
+                reinterpret_cast<float *>(full.data)[offset + 2] -= rmeans;
             }
         }
 
 float scale_factor_w = (float)ewidth / width;
 float scale_factor_h = (float)eheight / height;
-        cv::resize(img, img, cv::Size(), scale_factor_w, scale_factor_h);
+        cv::resize(full, img, cv::Size(), scale_factor_w, scale_factor_h);
+
+        return true;
+}
+
+bool cvprocess::preprocessInto(const cv::Mat& src, const float means[3], const float stds[3], int width, int height,
+    bool swap_rb, bool letterbox, float* dst, cv::Mat& scratch, cv::Rect* content) {
+    if (src.data == nullptr || src.type() != CV_8UC3)
+        return false;
+
+    cv::Rect roi(0, 0, width, height);
+    if (letterbox) {
+        const float scale = std::min((float)width / src.cols, (float)height / src.rows);
+        roi.width = std::max(1, cvRound(src.cols * scale));
+        roi.height = std::max(1, cvRound(src.rows * scale));
+        roi.x = (width - roi.width) / 2;
+        roi.y = (height - roi.height) / 2;
+    }
+    if (content)
+        *content = roi;
+
+    // Only the network-sized image is ever touched in float.
+    const cv::Mat* resized = &src;
+    if (src.cols != roi.width || src.rows != roi.height) {
+        cv::resize(src, scratch, roi.size(), 0, 0, INTER_LINEAR);
+        resized = &scratch;
+    }
+
+    const float inv_std[3] = { 1.f / stds[0], 1.f / stds[1], 1.f / stds[2] };
+    const size_t row_floats = (size_t)width * 3;
+    for (int y = 0; y < height; ++y) {
+        float* out = dst + y * row_floats;
+        if (y < roi.y || y >= roi.y + roi.height) {
+            memset(out, 0, row_floats * sizeof(float));
+            continue;
+        }
+        memset(out, 0, roi.x * 3 * sizeof(float));
+        normalize_u8c3(resized->ptr<unsigned char>(y - roi.y), roi.width, means, inv_std, swap_rb, out + roi.x * 3);
+        const int right = width - roi.x - roi.width;
+        memset(out + (roi.x + roi.width) * 3, 0, right * 3 * sizeof(float));
+    }
+    return true;
+}
+
+bool cvprocess::jpegSize(const unsigned char* data, size_t size, int* width, int* height) {
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+        return false;
+    size_t pos = 2;
+    while (pos + 4 <= size) {
+        if (data[pos] != 0xFF)
+            return false;
+        const unsigned char marker = data[pos + 1];
+        if (marker == 0xFF) {  // fill byte
+            ++pos;
+            continue;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD9)) {  // no payload
+            pos += 2;
+            continue;
+        }
+        const size_t length = (data[pos + 2] << 8) | data[pos + 3];
+        // SOF0..SOF15 carry the frame size; C4, C8 and CC are other tables.
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            if (pos + 9 > size)
+                return false;
+            *height = (data[pos + 5] << 8) | data[pos + 6];
+            *width = (data[pos + 7] << 8) | data[pos + 8];
+            return *width > 0 && *height > 0;
+        }
+        pos += 2 + length;
+    }
+    return false;
+}
 
+bool cvprocess::decodeForInput(const std::vector<unsigned char>& data, int width, int height, cv::Mat& dst,
+    cv::Size* original) {
+    int jpeg_width = 0, jpeg_height = 0;
+    int factor = 1;
+#if CV_MAJOR_VERSION >= 3
+    // IMREAD_REDUCED_* is new in OpenCV 3; 2.x always decodes at full size.
+    if (width > 0 && height > 0 && jpegSize(data.data(), data.size(), &jpeg_width, &jpeg_height)) {
+        // libjpeg scales in the DCT by 1/2, 1/4 or 1/8. Take the largest step
+        // that still leaves at least the network size to resize from. EXIF
+        // rotation may swap the decoded sides, so both orientations must fit.
+        for (int f : { 8, 4, 2 }) {
+            const int w = (jpeg_width + f - 1) / f;
+            const int h = (jpeg_height + f - 1) / f;
+            if (std::min(w, h) >= std::max(width, height)) {
+                factor = f;
+                break;
+            }
+        }
+    }
+    int flags = CV_LOAD_IMAGE_COLOR;
+    if (factor == 8)
+        flags = IMREAD_REDUCED_COLOR_8;
+    else if (factor == 4)
+        flags = IMREAD_REDUCED_COLOR_4;
+    else if (factor == 2)
+        flags = IMREAD_REDUCED_COLOR_2;
+#else
+    const int flags = CV_LOAD_IMAGE_COLOR;
+#endif
+    // On failure imdecode returns an empty Mat but may leave dst as it was.
+    if (cv::imdecode(data, flags, &dst).data == nullptr)
+        return false;
+
+    if (original) {
+        *original = dst.size();
+        if (factor > 1) {
+            // Full size in the decoded orientation.
+            const bool swapped = dst.cols != (jpeg_width + factor - 1) / factor;
+            *original = swapped ? cv::Size(jpeg_height, jpeg_width) : cv::Size(jpeg_width, jpeg_height);
+        }
+    }
+    return true;
 }
 
 
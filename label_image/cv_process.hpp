@@ -18,6 +18,8 @@
 #include <opencv2/core/core.hpp>
 #include <opencv/cv.hpp>
 
+#include "image_ops.hpp"
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -51,9 +53,38 @@ public:
     static bool medianBlur(std::vector<unsigned char>& idata, std::vector<unsigned char>& odata);
     static bool applyColorMap(std::vector<unsigned char>& idata, std::vector<unsigned char>& odata);
     static bool cvtColor(std::vector<unsigned char>& idata, std::vector<unsigned char>& odata);
+    // Parses a comma separated op list such as "flip:1,gray,median_blur:5,
+    // color_map:2". Defaults: flip 0, median_blur 3, color_map 0 (autumn).
+    // color_map needs OpenCV 3 and fails to parse on 2.x.
+    static bool parseOps(const std::string& spec, std::vector<c_image_op>* ops);
+    // Merges adjacent flips and drops grey conversions that the next op
+    // makes redundant.
+    static void fuseOps(std::vector<c_image_op>* ops);
+    // Applies ops in order, in place where OpenCV allows, else through
+    // scratch. The result can go straight to preprocessing.
+    static bool applyOps(cv::Mat& mat, const std::vector<c_image_op>& ops, cv::Mat& scratch);
+    // Decodes idata once, applies the fused ops and PNG encodes once. A
+    // leading grey conversion is left to the decoder.
+    static bool process(const std::vector<unsigned char>& idata, std::vector<c_image_op> ops,
+        std::vector<unsigned char>& odata, int png_level = 3);
     static bool readImage(std::vector<unsigned char>& idata, cv::Mat& dst);
-    static bool writeImage(cv::Mat& src, std::vector<unsigned char>& odata);
+    // PNG encode; png_level 0 (fastest) .. 9.
+    static bool writeImage(cv::Mat& src, std::vector<unsigned char>& odata, int png_level = 3);
     static bool resizeImage(cv::Mat& src, float bmeans, float gmeans, float rmeans, int width, int height, cv::Mat& img);
+    // Fused replacement for resizeImage: resizes the CV_8UC3 source at uint8 and
+    // normalizes straight into dst (height*width*3 floats, e.g. a Tensor slot).
+    // means/stds are in BGR order; swap_rb emits RGB. letterbox keeps the aspect
+    // ratio and zero-fills the border. content receives where the image landed.
+    static bool preprocessInto(const cv::Mat& src, const float means[3], const float stds[3], int width, int height,
+        bool swap_rb, bool letterbox, float* dst, cv::Mat& scratch, cv::Rect* content);
+    // Frame size from the SOF marker of a JPEG stream, without decoding it.
+    static bool jpegSize(const unsigned char* data, size_t size, int* width, int* height);
+    // Decodes to CV_8UC3 like imdecode(CV_LOAD_IMAGE_COLOR), but lets libjpeg
+    // downscale by 2, 4 or 8 when the result still covers width x height.
+    // original receives the full resolution size. width or height <= 0, or
+    // OpenCV 2.x, always decodes at full size. dst's buffer is reused when the size repeats.
+    static bool decodeForInput(const std::vector<unsigned char>& data, int width, int height, cv::Mat& dst,
+        cv::Size* original);
     //static bool process_tf_detect_result(std::vector<deep_server::Tf_detect_result> results, cv::Mat& cv_image);
 };
 
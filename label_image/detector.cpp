@@ -0,0 +1,252 @@
+#include "detector.hpp"
+
+#include <algorithm>
+
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/platform/logging.h"
+
+#include "cv_process.hpp"
+#include "shape_buckets.hpp"
+#include "trace.hpp"
+
+using tensorflow::Status;
+using tensorflow::Tensor;
+using tensorflow::string;
+
+typedef std::chrono::steady_clock Clock;
+
+static const double kQueueDelayBoundsUs[] = { 100, 250, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000 };
+
+Status Detector::New(const c_detector_options& options, std::unique_ptr<Detector>* detector) {
+    // The workers already run batches side by side on the one session.
+    if (options.load.pool.sessions != 1 || !options.load.pool.dev_list.empty())
+        return tensorflow::errors::InvalidArgument("the detector does not load session pools");
+    std::unique_ptr<Detector> d(new Detector(options));
+    tensorflow::GraphDef graph_def;
+    TF_RETURN_IF_ERROR(LoadGraph(options.graph, "", &d->owned_session_, graph_def,
+        options.load, &d->mmap_env_));
+    d->session_ = d->owned_session_.get();
+    TF_RETURN_IF_ERROR(d->Start());
+    *detector = std::move(d);
+    return Status::OK();
+}
+
+Status Detector::New(tensorflow::Session* session, const c_detector_options& options,
+    std::unique_ptr<Detector>* detector) {
+    std::unique_ptr<Detector> d(new Detector(options));
+    d->session_ = session;
+    TF_RETURN_IF_ERROR(d->Start());
+    *detector = std::move(d);
+    return Status::OK();
+}
+
+Detector::Detector(const c_detector_options& options)
+    : session_(nullptr), options_(options), queue_(options.queue_capacity) {
+    stats_.batch_sizes.assign(std::max(1, options.max_batch) + 1, 0);
+    stats_.queue_delay_bounds_us.assign(std::begin(kQueueDelayBoundsUs), std::end(kQueueDelayBoundsUs));
+    stats_.queue_delay.assign(stats_.queue_delay_bounds_us.size() + 1, 0);
+}
+
+Status Detector::Start() {
+    if (options_.max_batch < 1 || options_.workers < 1 || options_.max_delay_us < 0)
+        return tensorflow::errors::InvalidArgument("max_batch and workers must be positive, max_delay_us not negative");
+    if (options_.warmup) {
+        std::vector<int> batch_sizes = { 1 };
+        if (options_.max_batch > 1)
+            batch_sizes.push_back(options_.max_batch);
+        TF_RETURN_IF_ERROR(WarmupShapes(session_, options_.preprocess, batch_sizes, options_.input_layer,
+            options_.output_layers, 1));
+    }
+    for (int t = 0; t < options_.workers; ++t)
+        workers_.emplace_back([this] { Work(); });
+    return Status::OK();
+}
+
+Detector::~Detector() {
+    queue_.Close();
+    for (std::thread& worker : workers_)
+        worker.join();
+}
+
+std::future<c_detection_result> Detector::Submit(const cv::Mat& image) {
+    c_request request;
+    request.image = image;
+    return Enqueue(std::move(request));
+}
+
+std::future<c_detection_result> Detector::Submit(std::vector<unsigned char> encoded) {
+    c_request request;
+    request.encoded = std::move(encoded);
+    return Enqueue(std::move(request));
+}
+
+std::future<c_detection_result> Detector::Enqueue(c_request request) {
+    request.submitted = Clock::now();
+    std::promise<c_detection_result> rejected;
+    std::future<c_detection_result> future = request.promise.get_future();
+    // Push only fails once the detector is shutting down; the request, and
+    // its promise, are gone by then, so answer through a fresh one.
+    if (!queue_.Push(std::move(request))) {
+        c_detection_result result;
+        result.status = tensorflow::errors::Cancelled("detector is shutting down");
+        future = rejected.get_future();
+        rejected.set_value(result);
+    }
+    return future;
+}
+
+void Detector::Work() {
+    WorkerArena arena(options_.preprocess.input_height, options_.preprocess.input_width);
+    DetectionDecoder decoder(options_.top_k);
+    std::vector<c_request> batch;
+    c_request request;
+    while (queue_.Pop(&request)) {
+        // The oldest request sets the deadline: wait for company only as
+        // long as it can afford.
+        batch.clear();
+        batch.push_back(std::move(request));
+        const Clock::time_point deadline = batch[0].submitted + std::chrono::microseconds(options_.max_delay_us);
+        while ((int)batch.size() < options_.max_batch && queue_.PopUntil(&request, deadline))
+            batch.push_back(std::move(request));
+        RunBatch(&batch, &arena, &decoder);
+    }
+}
+
+void Detector::RunBatch(std::vector<c_request>* batch, WorkerArena* arena, DetectionDecoder* decoder) {
+    const c_preprocess_options& pre = options_.preprocess;
+    const Clock::time_point start = Clock::now();
+    {
+        std::lock_guard<std::mutex> lock(stats_mu_);
+        for (const c_request& request : *batch) {
+            const double waited_us = std::chrono::duration<double, std::micro>(start - request.submitted).count();
+            const size_t bucket = std::upper_bound(stats_.queue_delay_bounds_us.begin(),
+                stats_.queue_delay_bounds_us.end(), waited_us) - stats_.queue_delay_bounds_us.begin();
+            ++stats_.queue_delay[bucket];
+            ++stats_.requests;
+        }
+    }
+
+    const cv::Size reduce = reduced_decode_size(pre);
+    std::vector<int> ok;
+    std::vector<cv::Size> originals(batch->size()), shapes(batch->size());
+    for (size_t i = 0; i < batch->size(); ++i) {
+        TRACE_SCOPE("decode");
+        c_request& request = (*batch)[i];
+        cv::Mat* mat = arena->Image(i);
+        bool read;
+        if (request.encoded.empty()) {
+            *mat = request.image;
+            originals[i] = mat->size();
+            read = mat->data != nullptr;
+            // Ops work in place; keep the caller's pixels untouched.
+            if (read && !pre.ops.empty())
+                *mat = mat->clone();
+        }
+        else {
+            read = cvprocess::decodeForInput(request.encoded, reduce.width, reduce.height, *mat, &originals[i]);
+        }
+        Status status;
+        if (!read || !apply_image_ops(pre, mat, arena->Scratch()))
+            status = tensorflow::errors::InvalidArgument("cannot decode image");
+        else if (mat->type() != CV_8UC3)
+            status = tensorflow::errors::InvalidArgument("image is not 8-bit BGR");
+        if (!status.ok()) {
+            c_detection_result result;
+            result.status = status;
+            request.promise.set_value(result);
+            std::lock_guard<std::mutex> lock(stats_mu_);
+            ++stats_.failed;
+            continue;
+        }
+        shapes[i] = pick_input_shape(pre, originals[i]);
+        ok.push_back(i);
+    }
+
+    // One run per shape bucket present in the batch.
+    std::vector<int> group;
+    std::vector<c_image_transform> transforms;
+    std::vector<char> prepared;
+    while (!ok.empty()) {
+        const cv::Size shape = shapes[ok[0]];
+        group.clear();
+        size_t kept = 0;
+        for (int i : ok) {
+            if (shapes[i] == shape)
+                group.push_back(i);
+            else
+                ok[kept++] = i;
+        }
+        ok.resize(kept);
+
+        const int m = group.size();
+        Tensor* input = arena->Input(m, shape.height, shape.width);
+        transforms.resize(m);
+        prepared.resize(m);
+        int unprepared = 0;
+        {
+            TRACE_SCOPE("preprocess");
+            for (int g = 0; g < m; ++g) {
+                prepared[g] = preprocess_into_tensor(*arena->Image(group[g]), pre, g, input, arena->Scratch(),
+                    &transforms[g], originals[group[g]]);
+                unprepared += !prepared[g];
+            }
+        }
+        std::vector<Tensor>& outputs = *arena->Outputs();
+        Status run_status = TracedRun(session_, { {options_.input_layer, *input} }, options_.output_layers,
+            &outputs);
+        note_inference_done();
+        {
+            std::lock_guard<std::mutex> lock(stats_mu_);
+            ++stats_.batch_sizes[m];
+            stats_.failed += run_status.ok() ? unprepared : m;
+        }
+        for (int g = 0; g < m; ++g) {
+            c_detection_result result;
+            result.status = run_status;
+            if (run_status.ok() && !prepared[g])
+                result.status = tensorflow::errors::InvalidArgument("cannot preprocess image");
+            if (result.status.ok()) {
+                TRACE_SCOPE("postprocess");
+                decoder->Decode(outputs[0], outputs[1], outputs[2], g, transforms[g], options_.threshold);
+                decoder->Suppress(options_.nms, &result.detections);
+                trace_count("images", 1);
+            }
+            (*batch)[group[g]].promise.set_value(std::move(result));
+        }
+    }
+
+    // Slots holding a caller's image share its pixels; a later decode into
+    // a slot of the same size would write straight into them.
+    for (size_t i = 0; i < batch->size(); ++i) {
+        if ((*batch)[i].encoded.empty())
+            arena->Image(i)->release();
+    }
+}
+
+c_detector_stats Detector::Stats() const {
+    std::lock_guard<std::mutex> lock(stats_mu_);
+    return stats_;
+}
+
+void Detector::LogStats() const {
+    const c_detector_stats stats = Stats();
+    string sizes, delays;
+    long long runs = 0, images = 0;
+    for (size_t n = 1; n < stats.batch_sizes.size(); ++n) {
+        runs += stats.batch_sizes[n];
+        images += n * stats.batch_sizes[n];
+        if (stats.batch_sizes[n] > 0)
+            sizes += " " + std::to_string(n) + ":" + std::to_string(stats.batch_sizes[n]);
+    }
+    for (size_t i = 0; i < stats.queue_delay.size(); ++i) {
+        if (stats.queue_delay[i] == 0)
+            continue;
+        delays += i < stats.queue_delay_bounds_us.size() ?
+            " <=" + std::to_string((int)stats.queue_delay_bounds_us[i]) + "us:" :
+            " >" + std::to_string((int)stats.queue_delay_bounds_us.back()) + "us:";
+        delays += std::to_string(stats.queue_delay[i]);
+    }
+    LOG(INFO) << "Detector: " << stats.requests << " requests, " << stats.failed << " failed, " << runs
+        << " runs, mean batch " << (runs > 0 ? (double)images / runs : 0) << "; batch sizes" << sizes
+        << "; queue delay" << delays;
+}
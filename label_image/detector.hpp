@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/public/session.h"
+
+#include "arena.hpp"
+#include "nms_engine.hpp"
+#include "pipeline.hpp"
+#include "tf_detect.hpp"
+
+// Embeddable detector: LoadGraph, preprocessing, batched Run and decoding
+// behind Submit, for services that cannot go through main(). Built as the
+// label_image_detector library.
+//
+//   std::unique_ptr<Detector> detector;
+//   TF_CHECK_OK(Detector::New(options, &detector));
+//   std::future<c_detection_result> f = detector->Submit(image);
+//   ... f.get().detections
+//
+// Concurrent submissions are merged into batches. A batch closes when it
+// reaches max_batch or when its oldest request has waited max_delay_us,
+// whichever comes first, so batching never adds more than max_delay_us to
+// a request's latency.
+struct c_detector_options {
+    // Loaded with load when Detector::New is given no session.
+    tensorflow::string graph;
+    c_load_options load;
+    c_preprocess_options preprocess;
+    float threshold = 0.6f;
+    c_nms_options nms;
+    int top_k = 1000;
+    tensorflow::string input_layer = "image_input";
+    std::vector<tensorflow::string> output_layers = { "bbox/trimming/bbox", "probability/class_idx",
+        "probability/score" };
+    int max_batch = 8;
+    int max_delay_us = 2000;
+    // Batches in flight at once; each worker runs one.
+    int workers = 1;
+    // Submissions waiting for a worker. Submit blocks while it is full.
+    int queue_capacity = 256;
+    // Run every input shape at batch 1 and max_batch before accepting work.
+    bool warmup = true;
+};
+
+struct c_detection_result {
+    tensorflow::Status status;
+    // In source image coordinates.
+    std::vector<c_tf_detect_result> detections;
+};
+
+// Histograms since the detector started.
+struct c_detector_stats {
+    long long requests = 0;
+    long long failed = 0;
+    // batch_sizes[n] session runs of n images, n = 1..max_batch.
+    std::vector<long long> batch_sizes;
+    // queue_delay[i] requests that waited, Submit to batch start, at most
+    // queue_delay_bounds_us[i]; the last bucket is open ended.
+    std::vector<double> queue_delay_bounds_us;
+    std::vector<long long> queue_delay;
+};
+
+class Detector {
+public:
+    // Loads options.graph and starts the workers.
+    static tensorflow::Status New(const c_detector_options& options, std::unique_ptr<Detector>* detector);
+    // Runs on a session loaded elsewhere, which must outlive the detector.
+    static tensorflow::Status New(tensorflow::Session* session, const c_detector_options& options,
+        std::unique_ptr<Detector>* detector);
+    // Finishes everything submitted, then stops.
+    ~Detector();
+
+    // A decoded BGR image. The Mat is referenced, not copied; leave its
+    // pixels alone until the future is ready.
+    std::future<c_detection_result> Submit(const cv::Mat& image);
+    // An encoded image, decoded on a worker.
+    std::future<c_detection_result> Submit(std::vector<unsigned char> encoded);
+
+    c_detector_stats Stats() const;
+    void LogStats() const;
+
+private:
+    struct c_request {
+        cv::Mat image;
+        std::vector<unsigned char> encoded;
+        std::chrono::steady_clock::time_point submitted;
+        std::promise<c_detection_result> promise;
+    };
+
+    explicit Detector(const c_detector_options& options);
+    // Warms up session_ and starts the workers.
+    tensorflow::Status Start();
+    std::future<c_detection_result> Enqueue(c_request request);
+    void Work();
+    void RunBatch(std::vector<c_request>* batch, WorkerArena* arena, DetectionDecoder* decoder);
+
+    // The mapping of a memmapped graph has to outlive the session.
+    std::unique_ptr<tensorflow::MemmappedEnv> mmap_env_;
+    std::unique_ptr<tensorflow::Session> owned_session_;
+    tensorflow::Session* session_;
+    const c_detector_options options_;
+    BoundedQueue<c_request> queue_;
+    std::vector<std::thread> workers_;
+
+    mutable std::mutex stats_mu_;
+    c_detector_stats stats_;
+};
@@ -0,0 +1,238 @@
+#include "graph_optimize.hpp"
+
+#include <map>
+
+#include "tensorflow/core/framework/attr_value_util.h"
+#include "tensorflow/core/framework/tensor.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/hash/hash.h"
+#include "tensorflow/core/lib/io/path.h"
+#include "tensorflow/core/lib/strings/str_util.h"
+#include "tensorflow/core/lib/strings/strcat.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/logging.h"
+#include "tensorflow/core/platform/protobuf.h"
+#include "tensorflow/tools/graph_transforms/transform_graph.h"
+
+using tensorflow::GraphDef;
+using tensorflow::NodeDef;
+using tensorflow::Status;
+using tensorflow::Tensor;
+using tensorflow::string;
+
+const char* const kDefaultGraphTransforms =
+    "strip_unused_nodes(type=float) "
+    "remove_nodes(op=Identity, op=CheckNumerics) "
+    "fold_constants(ignore_errors=true) "
+    "fold_batch_norms "
+    "fold_old_batch_norms "
+    "strip_unused_nodes(type=float) "
+    "sort_by_execution_order";
+
+// "^name" and "name:1" both refer to node "name".
+static string node_name(const string& input) {
+    string name = input;
+    if (!name.empty() && name[0] == '^')
+        name = name.substr(1);
+    const size_t colon = name.rfind(':');
+    if (colon != string::npos)
+        name = name.substr(0, colon);
+    return name;
+}
+
+static bool const_float(const NodeDef* node, Tensor* value) {
+    if (node == nullptr || node->op() != "Const")
+        return false;
+    auto it = node->attr().find("value");
+    return it != node->attr().end() && value->FromProto(it->second.tensor()) &&
+        value->dtype() == tensorflow::DT_FLOAT;
+}
+
+Status FoldInputNormalization(const string& input_name, const float means[3], const float stds[3],
+    GraphDef* graph_def) {
+    std::map<string, NodeDef*> nodes;
+    std::map<string, std::vector<NodeDef*> > consumers;
+    for (NodeDef& node : *graph_def->mutable_node())
+        nodes[node.name()] = &node;
+    for (NodeDef& node : *graph_def->mutable_node()) {
+        for (const string& input : node.input())
+            consumers[node_name(input)].push_back(&node);
+    }
+
+    const std::vector<NodeDef*>& input_consumers = consumers[input_name];
+    if (input_consumers.size() != 1 || input_consumers[0]->op() != "Conv2D" ||
+        node_name(input_consumers[0]->input(0)) != input_name) {
+        return tensorflow::errors::FailedPrecondition("input ", input_name,
+            " does not feed a single Conv2D, cannot fold its normalization");
+    }
+    NodeDef* conv = input_consumers[0];
+    auto format = conv->attr().find("data_format");
+    if (format != conv->attr().end() && format->second.s() != "NHWC")
+        return tensorflow::errors::FailedPrecondition(conv->name(), " is not NHWC");
+    // Under SAME padding the border taps would read raw zeros where the
+    // original graph saw normalized zeros, so the fold is only exact for VALID.
+    if (conv->attr().at("padding").s() != "VALID")
+        return tensorflow::errors::FailedPrecondition(conv->name(), " uses ", conv->attr().at("padding").s(),
+            " padding, folding the input normalization would change the border outputs");
+
+    NodeDef* weights = nodes[node_name(conv->input(1))];
+    while (weights != nullptr && weights->op() == "Identity")
+        weights = nodes[node_name(weights->input(0))];
+    Tensor w;
+    if (!const_float(weights, &w) || w.dims() != 4 || w.dim_size(2) != 3)
+        return tensorflow::errors::FailedPrecondition(conv->name(), " weights are not a constant [kh,kw,3,cout]");
+
+    // conv((x - m) / s, W) + b == conv(x, W / s) + (b - sum(W / s * m))
+    const int taps = w.dim_size(0) * w.dim_size(1);
+    const int cout = w.dim_size(3);
+    Tensor folded(tensorflow::DT_FLOAT, w.shape());
+    Tensor delta(tensorflow::DT_FLOAT, { cout });
+    auto src = w.flat<float>();
+    auto dst = folded.flat<float>();
+    auto bias = delta.flat<float>();
+    bias.setZero();
+    for (int t = 0; t < taps; ++t) {
+        for (int ci = 0; ci < 3; ++ci) {
+            for (int co = 0; co < cout; ++co) {
+                const int index = (t * 3 + ci) * cout + co;
+                const float v = src(index) / stds[ci];
+                dst(index) = v;
+                bias(co) -= v * means[ci];
+            }
+        }
+    }
+
+    // Rewrite the weights in place when nothing else reads them.
+    if (consumers[weights->name()].size() == 1 && node_name(conv->input(1)) == weights->name()) {
+        folded.AsProtoTensorContent((*weights->mutable_attr())["value"].mutable_tensor());
+    }
+    else {
+        NodeDef* copy = graph_def->add_node();
+        copy->set_name(conv->name() + "/folded_weights");
+        copy->set_op("Const");
+        tensorflow::SetAttrValue(tensorflow::DT_FLOAT, &(*copy->mutable_attr())["dtype"]);
+        folded.AsProtoTensorContent((*copy->mutable_attr())["value"].mutable_tensor());
+        conv->set_input(1, copy->name());
+    }
+
+    // Add the correction to an existing constant bias, or insert a BiasAdd.
+    const std::vector<NodeDef*> conv_consumers = consumers[conv->name()];
+    if (conv_consumers.size() == 1 &&
+        (conv_consumers[0]->op() == "BiasAdd" || conv_consumers[0]->op() == "Add") &&
+        node_name(conv_consumers[0]->input(0)) == conv->name()) {
+        NodeDef* bias_node = nodes[node_name(conv_consumers[0]->input(1))];
+        Tensor b;
+        if (const_float(bias_node, &b) && b.NumElements() == cout &&
+            consumers[bias_node->name()].size() == 1) {
+            auto values = b.flat<float>();
+            for (int co = 0; co < cout; ++co)
+                values(co) += bias(co);
+            b.AsProtoTensorContent((*bias_node->mutable_attr())["value"].mutable_tensor());
+            return Status::OK();
+        }
+    }
+
+    NodeDef* bias_const = graph_def->add_node();
+    bias_const->set_name(conv->name() + "/folded_bias");
+    bias_const->set_op("Const");
+    tensorflow::SetAttrValue(tensorflow::DT_FLOAT, &(*bias_const->mutable_attr())["dtype"]);
+    delta.AsProtoTensorContent((*bias_const->mutable_attr())["value"].mutable_tensor());
+
+    NodeDef* bias_add = graph_def->add_node();
+    bias_add->set_name(conv->name() + "/folded_bias_add");
+    bias_add->set_op("BiasAdd");
+    bias_add->add_input(conv->name());
+    bias_add->add_input(bias_const->name());
+    tensorflow::SetAttrValue(tensorflow::DT_FLOAT, &(*bias_add->mutable_attr())["T"]);
+    tensorflow::SetAttrValue("NHWC", &(*bias_add->mutable_attr())["data_format"]);
+    if (conv->has_device())
+        bias_add->set_device(conv->device());
+
+    for (NodeDef* node : conv_consumers) {
+        for (int i = 0; i < node->input_size(); ++i) {
+            if (node->input(i) == conv->name() || node->input(i) == conv->name() + ":0")
+                node->set_input(i, bias_add->name());
+        }
+    }
+    return Status::OK();
+}
+
+Status LoadOptimizedGraph(const string& graph_file_name, const c_graph_optimize_options& options,
+    GraphDef* graph_def) {
+    tensorflow::Env* env = tensorflow::Env::Default();
+    const tensorflow::uint64 start_us = env->NowMicros();
+
+    string source;
+    TF_RETURN_IF_ERROR(tensorflow::ReadFileToString(env, graph_file_name, &source));
+
+    string cache_path;
+    if (!options.cache_dir.empty()) {
+        string params = tensorflow::strings::StrCat(
+            tensorflow::str_util::Join(options.inputs, ","), "|",
+            tensorflow::str_util::Join(options.outputs, ","), "|", options.transforms);
+        if (options.fold_input_normalization) {
+            for (int c = 0; c < 3; ++c)
+                tensorflow::strings::StrAppend(&params, "|", options.means[c], "/", options.stds[c]);
+        }
+        const tensorflow::uint64 key =
+            tensorflow::Hash64Combine(tensorflow::Hash64(source), tensorflow::Hash64(params));
+        cache_path = tensorflow::io::JoinPath(options.cache_dir, tensorflow::strings::StrCat(
+            tensorflow::io::Basename(graph_file_name), ".",
+            tensorflow::strings::Hex(key, tensorflow::strings::kZeroPad16), ".pb"));
+
+        if (env->FileExists(cache_path).ok()) {
+            Status cache_status = ReadBinaryProto(env, cache_path, graph_def);
+            if (cache_status.ok()) {
+                LOG(INFO) << "optimized graph from cache " << cache_path << " in "
+                    << (env->NowMicros() - start_us) / 1000.0 << "ms";
+                return Status::OK();
+            }
+            LOG(WARNING) << "ignoring cache entry " << cache_path << ": " << cache_status;
+        }
+    }
+
+    if (!tensorflow::ParseProtoUnlimited(graph_def, source))
+        return tensorflow::errors::DataLoss("cannot parse graph ", graph_file_name);
+    source.clear();
+    const int nodes_before = graph_def->node_size();
+
+    tensorflow::graph_transforms::TransformParameters transforms;
+    TF_RETURN_IF_ERROR(tensorflow::graph_transforms::ParseTransformParameters(options.transforms, &transforms));
+    TF_RETURN_IF_ERROR(tensorflow::graph_transforms::TransformGraph(
+        options.inputs, options.outputs, transforms, graph_def));
+    if (options.fold_input_normalization) {
+        if (options.inputs.size() != 1)
+            return tensorflow::errors::InvalidArgument("input normalization fold needs exactly one input");
+        TF_RETURN_IF_ERROR(FoldInputNormalization(options.inputs[0], options.means, options.stds, graph_def));
+    }
+    LOG(INFO) << "optimized graph: " << nodes_before << " -> " << graph_def->node_size() << " nodes in "
+        << (env->NowMicros() - start_us) / 1000.0 << "ms";
+
+    if (!cache_path.empty()) {
+        // Write to a temporary name first so a concurrent loader never sees a
+        // partial entry.
+        const string tmp_path = cache_path + ".tmp" + std::to_string(env->NowMicros());
+        Status cache_status = env->RecursivelyCreateDir(options.cache_dir);
+        if (cache_status.ok())
+            cache_status = WriteBinaryProto(env, tmp_path, *graph_def);
+        if (cache_status.ok())
+            cache_status = env->RenameFile(tmp_path, cache_path);
+        if (!cache_status.ok())
+            LOG(WARNING) << "cannot cache optimized graph: " << cache_status;
+    }
+    return Status::OK();
+}
+
+Status WriteTfcompileConfig(const string& path, const string& input_name, int batch, int height, int width,
+    const std::vector<string>& outputs) {
+    string config = tensorflow::strings::StrCat("feed {\n  id { node_name: \"", node_name(input_name),
+        "\" }\n  shape {\n    dim { size: ", batch, " }\n    dim { size: ", height, " }\n    dim { size: ", width,
+        " }\n    dim { size: 3 }\n  }\n}\n");
+    for (const string& output : outputs) {
+        const size_t colon = output.rfind(':');
+        const string index = colon == string::npos ? "0" : output.substr(colon + 1);
+        tensorflow::strings::StrAppend(&config, "fetch {\n  id { node_name: \"", node_name(output),
+            "\" output_index: ", index, " }\n}\n");
+    }
+    return tensorflow::WriteStringToFile(tensorflow::Env::Default(), path, config);
+}
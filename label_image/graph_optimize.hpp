@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "tensorflow/core/framework/graph.pb.h"
+#include "tensorflow/core/lib/core/status.h"
+
+// graph_transforms pipeline applied at load time. Drops everything the
+// fetched outputs do not depend on (training inputs, summaries), folds
+// constant subgraphs and batch norms into the convolutions.
+extern const char* const kDefaultGraphTransforms;
+
+struct c_graph_optimize_options {
+    bool enabled = false;
+    std::vector<tensorflow::string> inputs;
+    std::vector<tensorflow::string> outputs;
+    tensorflow::string transforms = kDefaultGraphTransforms;
+    // Fold (x - mean) / std on the input into the first convolution, so the
+    // network can be fed raw pixel values. Means and stds are in the channel
+    // order of the input tensor. Only exact for a VALID padded NHWC Conv2D
+    // that is the sole consumer of the input; anything else is an error.
+    bool fold_input_normalization = false;
+    float means[3] = { 0.f, 0.f, 0.f };
+    float stds[3] = { 1.f, 1.f, 1.f };
+    // Optimized graphs are cached here, keyed by a hash of the source file
+    // and these options. Empty disables the cache.
+    tensorflow::string cache_dir;
+};
+
+// Reads graph_file_name and returns it optimized, from the cache when an
+// entry for the same input exists.
+tensorflow::Status LoadOptimizedGraph(const tensorflow::string& graph_file_name,
+    const c_graph_optimize_options& options, tensorflow::GraphDef* graph_def);
+
+// The input normalization fold on its own; see c_graph_optimize_options.
+tensorflow::Status FoldInputNormalization(const tensorflow::string& input_name, const float means[3],
+    const float stds[3], tensorflow::GraphDef* graph_def);
+
+// Writes the tf2xla config tfcompile needs to compile the frozen graph ahead
+// of time: one {batch,height,width,3} float feed and the given fetches. AOT
+// code is specialized to exactly this shape.
+tensorflow::Status WriteTfcompileConfig(const tensorflow::string& path, const tensorflow::string& input_name,
+    int batch, int height, int width, const std::vector<tensorflow::string>& outputs);
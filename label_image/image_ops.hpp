@@ -0,0 +1,10 @@
+#pragma once
+
+// Steps of a cvprocess::process pipeline; param is the flip code, the
+// median kernel size or the colormap id.
+enum class ImageOp { Flip, MedianBlur, Gray, ColorMap };
+
+struct c_image_op {
+    ImageOp op = ImageOp::Flip;
+    int param = 0;
+};
@@ -34,7 +34,12 @@ limitations under the License.
 // Note that, for GIF inputs, to reuse existing code, only single-frame ones
 // are supported.
 
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
 #include <fstream>
+#include <map>
+#include <random>
 #include <utility>
 #include <vector>
 
@@ -58,7 +63,22 @@ limitations under the License.
 #include "tensorflow/core/public/session.h"
 #include "tensorflow/core/util/command_line_flags.h"
 
+#include "arena.hpp"
+#include "cascade.hpp"
 #include "cv_process.hpp" 
+#include "nms_engine.hpp"
+#include "pipeline.hpp"
+#include "preprocess_simd.hpp"
+#include "quantize.hpp"
+#include "result_cache.hpp"
+#include "output_sink.hpp"
+#include "server.hpp"
+#include "shape_buckets.hpp"
+#include "stream.hpp"
+#include "tensor_dataset.hpp"
+#include "tiling.hpp"
+#include "trace.hpp"
+#include "tf_detect.hpp"
 
 // These are all common classes it's handy to reference with no namespace.
 using tensorflow::Flag;
@@ -69,130 +89,139 @@ using tensorflow::int32;
 using namespace tensorflow;
 using namespace std;
 
-// Reads a model graph definition from disk, and creates a session object you
-// can use to run it.
-Status LoadGraph(const string& graph_file_name,const tensorflow::string& gpu_list,
-    std::unique_ptr<tensorflow::Session>* session, tensorflow::GraphDef& graph_def) {
-    //  tensorflow::GraphDef graph_def;
-    Status load_graph_status =
-        ReadBinaryProto(tensorflow::Env::Default(), graph_file_name, &graph_def);
-    if (!load_graph_status.ok()) {
-        return tensorflow::errors::NotFound("Failed to load compute graph at '",
-            graph_file_name, "'");
-    }
-
-    WriteTextProto(tensorflow::Env::Default(), "/tmp/test_inception_v4.pbtxt", graph_def);
-
-        tensorflow::SessionOptions options_;
-    //   tensorflow::GPUOptions g_option;
-  //      g_option.set_visible_device_list(gpu_list);
-        options_.config.set_allow_soft_placement(true);
-    //    options_.config.set_allocated_gpu_options(&g_option);
-
-
-    session->reset(tensorflow::NewSession(options_));
-    Status session_create_status = (*session)->Create(graph_def);
-    if (!session_create_status.ok()) {
-        return session_create_status;
-    }
-    return Status::OK();
-}
-
-struct c_tf_detect_result {
-    int nclass;
-    float score;
-    cv::Rect r;
-};
-
-void prepare_tf_detect_result(tensorflow::Tensor& boxes, tensorflow::Tensor& classes, tensorflow::Tensor& scores, 
-    float scale_factor_w, float scale_factor_h, float threshold,
-    std::map<int, std::vector<c_tf_detect_result> > & dst) {
-    tensorflow::TTypes<float>::Flat scores_flat = scores.flat<float>();
-    tensorflow::TTypes<long long>::Flat classes_flat = classes.flat<long long>();
-    typename TTypes<float, 3>::Tensor obox = boxes.tensor<float, 3>();
-    dst.clear();
-    for (int i = 0; i < scores_flat.size(); ++i) {
-        if (scores_flat(i) >= threshold) {
-            c_tf_detect_result nr;
-            nr.nclass = classes_flat(i);
-            nr.score = scores_flat(i);
-            int cx = obox(0, i, 0);
-            int cy = obox(0, i, 1);
-            int w = obox(0, i, 2);
-            int h = obox(0, i, 3);
-            int x1 = cx - w / 2;
-            int y1 = cy - h / 2;
-            int x2 = cx + w / 2;
-            int y2 = cy + h / 2;
-            x1 /= scale_factor_w;
-            x2 /= scale_factor_w;
-            y1 /= scale_factor_h;
-            y2 /= scale_factor_h;
-            nr.r = cv::Rect(x1 < x2 ? x1 : x2, y1 < y2 ? y1 : y2, abs(x1 - x2), abs(y1 - y2));
-            
-            auto iter = dst.find(nr.nclass);
-            if (iter == dst.end()) {
-                std::vector<c_tf_detect_result> s;
-                s.push_back(nr);
-                dst.insert(std::make_pair(nr.nclass, s));
-            }
-            else {
-                iter->second.push_back(nr);
+// Runs nms_plus, which goes through NmsEngine, and the sort and erase
+// suppression it replaced on random boxes and compares what each keeps. The
+// boxes sit on a small grid with few distinct scores, so ties in score and
+// overlaps exactly at the threshold are common; both must match exactly.
+static bool check_nms_engine() {
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<int> coord(0, 16), side(1, 8), label(0, 2), score(0, 7);
+    auto same = [](const std::vector<c_tf_detect_result>& a, const std::vector<c_tf_detect_result>& b) {
+        if (a.size() != b.size())
+            return false;
+        for (size_t i = 0; i < a.size(); ++i) {
+            if (a[i].r != b[i].r || a[i].score != b[i].score)
+                return false;
+        }
+        return true;
+    };
+    int cases = 0, mismatches = 0;
+    for (int round = 0; round < 300; ++round) {
+        std::map<int, std::vector<c_tf_detect_result> > input, legacy, engine;
+        const int n = 1 + round % 60;
+        for (int i = 0; i < n; ++i) {
+            c_tf_detect_result det;
+            det.nclass = label(rng);
+            det.score = score(rng) / 8.f;
+            det.r = cv::Rect(coord(rng), coord(rng), side(rng), side(rng));
+            input[det.nclass].push_back(det);
+        }
+        for (float thresh : { 0.25f, 1.f / 3, 0.5f, 0.7f }) {
+            for (bool inclusive : { false, true }) {
+                c_nms_options options;
+                options.iou_threshold = thresh;
+                options.inclusive = inclusive;
+                nms_plus_ref(input, legacy, thresh, inclusive);
+                nms_plus(input, engine, options);
+                ++cases;
+                bool match = legacy.size() == engine.size();
+                for (auto it = legacy.begin(); match && it != legacy.end(); ++it)
+                    match = engine.count(it->first) && same(it->second, engine[it->first]);
+                if (!match)
+                    ++mismatches;
             }
         }
     }
+    LOG(INFO) << "nms self test (" << nms_engine_isa() << "): " << cases << " cases, " << mismatches
+        << " mismatches";
+    return mismatches == 0;
 }
 
-void nms_plus(std::map<int, std::vector<c_tf_detect_result> >& input, std::map<int, std::vector<c_tf_detect_result> >& output, float thresh) {
-    output.clear();
-
-    for (auto iter = input.begin(); iter != input.end(); ++iter) {
-        std::vector<c_tf_detect_result>& src = iter->second;
-        std::sort(src.begin(), src.end(), [](c_tf_detect_result c1, c_tf_detect_result c2) { return c1.score < c2.score; });
-
-        std::vector<c_tf_detect_result> dst;
-        while (src.size() > 0)
-        {
-            // grab the last rectangle
-            auto lastElem = --std::end(src);
-            const cv::Rect& rect1 = lastElem->r;
-
-            src.erase(lastElem);
-
-            for (auto pos = std::begin(src); pos != std::end(src); )
-            {
-                // grab the current rectangle
-                const cv::Rect& rect2 = pos->r;
+// Runs the fused preprocessing and the resizeImage path on the same image and
+// reports how far apart they are. The fused path resizes at uint8, so
+// differences up to the rounding of the resize are expected.
+static bool check_fused_preprocess(const cv::Mat& mat, const c_preprocess_options& preprocess) {
+    c_preprocess_options legacy = preprocess;
+    legacy.fused = false;
+    c_preprocess_options fused = legacy;
+    fused.fused = true;
 
-                float intArea = (rect1 & rect2).area();
-                float unionArea = rect1.area() + rect2.area() - intArea;
-                float overlap = intArea / unionArea;
-
-                // if there is sufficient overlap, suppress the current bounding box
-                if (overlap >= thresh)
-                {
-                    pos = src.erase(pos);
-                }
-                else
-                {
-                    ++pos;
-                }
-            }
+    Tensor a(tensorflow::DT_FLOAT, { 1, preprocess.input_height, preprocess.input_width, 3 });
+    Tensor b(tensorflow::DT_FLOAT, { 1, preprocess.input_height, preprocess.input_width, 3 });
+    cv::Mat scratch;
+    c_image_transform transform;
+    auto t0 = std::chrono::steady_clock::now();
+    const bool legacy_ok = preprocess_into_tensor(mat, legacy, 0, &a, &scratch, &transform);
+    auto t1 = std::chrono::steady_clock::now();
+    const bool fused_ok = preprocess_into_tensor(mat, fused, 0, &b, &scratch, &transform);
+    auto t2 = std::chrono::steady_clock::now();
+    if (!legacy_ok || !fused_ok) {
+        LOG(ERROR) << "preprocess self test: cannot preprocess the image";
+        return false;
+    }
 
-            dst.push_back(*lastElem);
-        }
+    const float* pa = a.flat<float>().data();
+    const float* pb = b.flat<float>().data();
+    double sum_diff = 0;
+    float max_diff = 0;
+    for (tensorflow::int64 i = 0; i < a.NumElements(); ++i) {
+        float d = std::fabs(pa[i] - pb[i]);
+        sum_diff += d;
+        max_diff = std::max(max_diff, d);
+    }
+    const double mean_diff = sum_diff / a.NumElements();
 
-        output.insert(std::make_pair(iter->first, dst));
+    // The vectorized kernel must match its scalar reference exactly.
+    cv::Mat src = mat.isContinuous() ? mat : mat.clone();
+    const int pixels = src.rows * src.cols;
+    std::vector<float> simd(pixels * 3), ref(pixels * 3);
+    const float inv_std[3] = { 1.f / preprocess.stds[0], 1.f / preprocess.stds[1], 1.f / preprocess.stds[2] };
+    float kernel_diff = 0;
+    for (bool swap : { false, true }) {
+        normalize_u8c3(src.data, pixels, preprocess.means, inv_std, swap, simd.data());
+        normalize_u8c3_ref(src.data, pixels, preprocess.means, inv_std, swap, ref.data());
+        for (int i = 0; i < pixels * 3; ++i)
+            kernel_diff = std::max(kernel_diff, std::fabs(simd[i] - ref[i]));
     }
+
+    LOG(INFO) << "preprocess self test (" << normalize_u8c3_isa() << "): resizeImage "
+        << std::chrono::duration<double, std::milli>(t1 - t0).count() << "ms, fused "
+        << std::chrono::duration<double, std::milli>(t2 - t1).count() << "ms, mean diff "
+        << mean_diff << ", max diff " << max_diff << ", kernel diff " << kernel_diff;
+    return mean_diff < 0.5 && max_diff < 2.f && kernel_diff < 1e-4f;
 }
 
 int main(int argc, char* argv[]) {
+    mark_startup();
     // These are the command-line flags the program can understand.
     // They define where the graph and input data is located, and what kind of
     // input the model expects. If you train your own model, or use something
     // other than inception_v3, then you'll need to update these.
     string image = "tensorflow/examples/label_image/data/grace_hopper.jpg";
     string out_image = "./test.png";
+    string image_dir = "";
+    string image_list = "";
+    string out_dir = "";
+    int32 batch_size = 1;
+    bool pipeline = false;
+    int32 decode_threads = 2;
+    int32 preprocess_threads = 2;
+    int32 infer_threads = 1;
+    int32 postprocess_threads = 2;
+    int32 queue_capacity = 16;
+    string server_socket = "";
+    int32 server_port = 0;
+    int32 server_workers = 1;
+    int32 server_connections = 16;
+    int32 server_timeout_ms = 30000;
+    int32 server_queue = 64;
+    string video = "";
+    string stream_out = "-";
+    int32 detect_every = 5;
+    bool drop_frames = false;
+    int32 track_width = 320;
+    float min_track_ratio = 0.5f;
+    float max_motion = 20.f;
     string ckpt = "";
     string graph =
         "tensorflow/examples/label_image/data/inception_v3_2016_08_28_frozen.pb";
@@ -203,19 +232,147 @@ int main(int argc, char* argv[]) {
     int32 input_mean = 0;
     int32 input_std = 255;
     float thres_hold = 0.6;
+    float nms_threshold = 0.4;
+    string nms_mode = "hard";
+    int32 top_k = 1000;
     string input_layer = "image_input";
     string output_layer = "InceptionV3/Predictions/Reshape_1";
     bool self_test = false;
+    bool fused_preprocess = false;
+    bool swap_rb = false;
+    bool letterbox = false;
+    bool reduced_decode = false;
+    string shape_buckets = "";
+    int32 warmup = -1;
+    string image_ops = "";
+    string records_format = "";
+    string records = "-";
+    int32 render_every = 1;
+    bool skip_renders = false;
+    string image_format = "";
+    int32 png_level = 3;
+    int32 jpeg_quality = 95;
+    bool tile = false;
+    int32 tile_width = 0;
+    int32 tile_height = 0;
+    int32 tile_overlap = 64;
+    int32 tile_batch = 0;
+    bool tile_full_image = true;
     string root_dir = "";
-        string dev_list = "";
+    string dev_list = "";
+    int32 sessions = 1;
+    int32 intra_op_threads = 0;
+    int32 inter_op_threads = 0;
+    bool pin_threads = true;
+    string session_dispatch = "round_robin";
+    bool memmapped_graph = false;
+    string dump_graph = "";
+    bool optimize_graph = false;
+    string graph_transforms = kDefaultGraphTransforms;
+    bool fold_input_mean = false;
+    string graph_cache_dir = "";
+    bool xla_jit = false;
+    string tfcompile_config = "";
+    string quantize_out = "";
+    int32 calibration_images = 100;
+    string compare_graph = "";
+    float match_iou = 0.5f;
+    string classifier_graph = "";
+    string classifier_input_layer = "input";
+    string classifier_output_layer = "InceptionV4/Logits/Predictions";
+    int32 classifier_width = 299;
+    int32 classifier_height = 299;
+    float classifier_mean = 127.5f;
+    float classifier_std = 127.5f;
+    float crop_padding = 0.1f;
+    int32 max_crops = 64;
+    int32 result_cache_mb = 0;
+    int32 result_cache_shards = 16;
+    string result_cache_dir = "";
+    string write_dataset = "";
+    string dataset = "";
+    string trace_file = "";
+    string metrics_file = "";
+    int32 metrics_interval = 10;
+    int32 full_trace_every = 0;
+    bool count_allocations = false;
 
     std::vector<Flag> flag_list = {
         Flag("image", &image, "image to be processed"),
         Flag("out_image", &out_image, "output image"),
+        Flag("image_dir", &image_dir, "directory of images to be processed in batches"),
+        Flag("image_list", &image_list, "file listing images to be processed in batches, one per line"),
+        Flag("out_dir", &out_dir, "directory for rendered images in batch mode, empty to skip rendering"),
+        Flag("batch_size", &batch_size, "number of images packed into one session run"),
+        Flag("pipeline", &pipeline, "run batch mode as a decode/preprocess/infer/postprocess pipeline"),
+        Flag("decode_threads", &decode_threads, "pipeline decode workers"),
+        Flag("preprocess_threads", &preprocess_threads, "pipeline preprocess workers"),
+        Flag("infer_threads", &infer_threads, "pipeline session->Run workers"),
+        Flag("postprocess_threads", &postprocess_threads, "pipeline nms/render workers"),
+        Flag("queue_capacity", &queue_capacity, "pipeline queue depth between stages"),
+        Flag("server_socket", &server_socket, "serve detections on this unix socket path"),
+        Flag("server_port", &server_port, "serve detections over http on 127.0.0.1 at this port"),
+        Flag("server_workers", &server_workers, "server session->Run workers"),
+        Flag("server_connections", &server_connections, "server clients handled concurrently, more get 503"),
+        Flag("server_timeout_ms", &server_timeout_ms, "server socket read/write timeout, 0 for none"),
+        Flag("server_queue", &server_queue, "server requests waiting for a worker before 503"),
+        Flag("video", &video, "detect on a video file, stream URL or capture device number"),
+        Flag("stream_out", &stream_out, "per frame JSON lines for --video, - for stdout, empty for none"),
+        Flag("detect_every", &detect_every, "run the detector on every Nth video frame, track in between"),
+        Flag("drop_frames", &drop_frames, "drop video frames when detection falls behind (always on for devices)"),
+        Flag("track_width", &track_width, "width of the grey frames used for tracking"),
+        Flag("min_track_ratio", &min_track_ratio, "re-detect when a box keeps fewer of its tracked points"),
+        Flag("max_motion", &max_motion, "re-detect when the mean grey level change between frames exceeds this"),
         Flag("graph", &graph, "graph to be executed"),
-            Flag("dev_list", &dev_list, "dev_list"),
+        Flag("dev_list", &dev_list, "cpu partitions for the session pool, e.g. 0-15;16-31"),
+        Flag("sessions", &sessions, "sessions in the pool, 0 for one per dev_list partition"),
+        Flag("intra_op_threads", &intra_op_threads, "intra-op threads per session, 0 for the partition size"),
+        Flag("inter_op_threads", &inter_op_threads, "inter-op threads per session, 0 for the default"),
+        Flag("pin_threads", &pin_threads, "pin each pooled session's threads to its partition"),
+        Flag("session_dispatch", &session_dispatch, "round_robin or least_loaded"),
+        Flag("memmapped_graph", &memmapped_graph, "graph was converted with convert_graphdef_memmapped_format"),
+        Flag("dump_graph", &dump_graph, "write the loaded graph as text to this file, for debugging"),
+        Flag("optimize_graph", &optimize_graph, "prune and fold the graph for the fetched outputs at load time"),
+        Flag("graph_transforms", &graph_transforms, "transform_graph pipeline used by optimize_graph"),
+        Flag("fold_input_mean", &fold_input_mean,
+                "fold the input mean subtraction into the first convolution (optimize_graph only)"),
+        Flag("graph_cache_dir", &graph_cache_dir, "cache optimized graphs here, keyed by input hash"),
+        Flag("xla_jit", &xla_jit, "compile the graph with the XLA JIT on CPU (TensorFlow built with XLA)"),
+        Flag("tfcompile_config", &tfcompile_config,
+                "write the tfcompile config for batch_size x input_height x input_width here and exit"),
+        Flag("quantize_out", &quantize_out,
+                "write an eight bit version of --graph here, calibrated on the input images, and exit"),
+        Flag("calibration_images", &calibration_images, "most input images used to calibrate quantize_out"),
+        Flag("compare_graph", &compare_graph,
+                "run the input images through --graph and this graph, report detection agreement and speed, and exit"),
+        Flag("match_iou", &match_iou, "iou at which compare_graph counts two boxes of a class as the same"),
+        Flag("classifier_graph", &classifier_graph,
+                "classify every detected box with this graph in one batched run per image, labels from --labels"),
+        Flag("classifier_input_layer", &classifier_input_layer, "input layer of classifier_graph"),
+        Flag("classifier_output_layer", &classifier_output_layer, "{N,classes} probabilities of classifier_graph"),
+        Flag("classifier_width", &classifier_width, "crop width fed to classifier_graph"),
+        Flag("classifier_height", &classifier_height, "crop height fed to classifier_graph"),
+        Flag("classifier_mean", &classifier_mean, "subtracted from crop pixels (RGB) for classifier_graph"),
+        Flag("classifier_std", &classifier_std, "crop pixels are divided by this for classifier_graph"),
+        Flag("crop_padding", &crop_padding, "crops grow by this fraction of their box on every side"),
+        Flag("max_crops", &max_crops, "most boxes per image classified, highest scores first"),
+        Flag("result_cache_mb", &result_cache_mb,
+                "cache detections by image content in this much memory, 0 for no cache; cached images are not rendered"),
+        Flag("result_cache_shards", &result_cache_shards, "independently locked parts of the result cache"),
+        Flag("result_cache_dir", &result_cache_dir, "also keep cached detections in files here, across runs"),
+        Flag("write_dataset", &write_dataset, "preprocess the images into this tensor dataset file and exit"),
+        Flag("dataset", &dataset, "detect on a tensor dataset from write_dataset instead of decoding images"),
+        Flag("trace_file", &trace_file, "write a chrome://tracing / Perfetto timeline of every stage here"),
+        Flag("metrics_file", &metrics_file, "rewrite counters in Prometheus text format here periodically"),
+        Flag("metrics_interval", &metrics_interval, "seconds between metrics_file updates"),
+        Flag("full_trace_every", &full_trace_every,
+                "collect TF step stats (per-op time, allocator peaks) on every Nth session run, 0 for never"),
+        Flag("count_allocations", &count_allocations, "log heap and tensor allocations per steady state inference"),
 
         Flag("thres_hold", &thres_hold, "probability thres_hold"),
+        Flag("nms_threshold", &nms_threshold, "iou at which overlapping boxes are suppressed"),
+        Flag("nms_mode", &nms_mode, "hard, weighted, soft_linear or soft"),
+        Flag("top_k", &top_k, "keep at most this many candidates per image before nms, 0 for all"),
         Flag("ckpt", &ckpt, "check point"),
         Flag("labels", &labels, "name of file containing labels"),
         Flag("input_width", &input_width, "resize image to this width in pixels"),
@@ -225,7 +382,30 @@ int main(int argc, char* argv[]) {
         Flag("input_std", &input_std, "scale pixel values to this std deviation"),
         Flag("input_layer", &input_layer, "name of input layer"),
         Flag("output_layer", &output_layer, "name of output layer"),
-        Flag("self_test", &self_test, "run a self test"),
+        Flag("self_test", &self_test, "check the fused preprocessing against resizeImage and NmsEngine against "
+            "the old suppression, then exit"),
+        Flag("fused_preprocess", &fused_preprocess, "resize at uint8 and normalize straight into the input tensor"),
+        Flag("swap_rb", &swap_rb, "feed RGB instead of BGR (fused_preprocess only)"),
+        Flag("letterbox", &letterbox, "keep aspect ratio and pad the border (fused_preprocess only)"),
+        Flag("reduced_decode", &reduced_decode, "decode JPEGs at 1/2, 1/4 or 1/8 size when that still covers the input"),
+        Flag("input_shapes", &shape_buckets,
+                "input shapes to pick from per image by aspect ratio, e.g. 624x384,384x624,320x320; empty for input_width x input_height"),
+        Flag("warmup", &warmup, "run every input shape once per session before the first image: 1 on, 0 off, "
+            "-1 only with input_shapes or xla_jit; costs one extra run per shape and batch size"),
+        Flag("records_format", &records_format, "write per image detections as jsonl or binary records"),
+        Flag("records", &records, "file for records_format output, - for stdout"),
+        Flag("render_every", &render_every, "render one image in N to out_image/out_dir, 0 to never render"),
+        Flag("skip_renders", &skip_renders, "skip renders instead of waiting when rendering falls behind"),
+        Flag("image_format", &image_format, "png, jpg or raw for rendered images, empty to follow the file name"),
+        Flag("png_level", &png_level, "png compression for rendered images, 0 fastest .. 9"),
+        Flag("jpeg_quality", &jpeg_quality, "jpeg quality for rendered images"),
+        Flag("image_ops", &image_ops, "ops applied to every image before detection, e.g. flip:1,median_blur:3"),
+        Flag("tile", &tile, "detect on overlapping full resolution tiles instead of the downscaled image"),
+        Flag("tile_width", &tile_width, "tile width in source pixels, 0 for input_width"),
+        Flag("tile_height", &tile_height, "tile height in source pixels, 0 for input_height"),
+        Flag("tile_overlap", &tile_overlap, "pixels shared by neighbouring tiles"),
+        Flag("tile_batch", &tile_batch, "most tiles per session run, 0 for all tiles of an image"),
+        Flag("tile_full_image", &tile_full_image, "also detect on the downscaled whole image when tiling"),
         Flag("root_dir", &root_dir,
                 "interpret image and graph file names relative to this directory"),
     };
@@ -242,120 +422,717 @@ int main(int argc, char* argv[]) {
         LOG(ERROR) << "Unknown argument " << argv[1] << "\n" << usage;
         return -1;
     }
+    if (batch_size < 1 || decode_threads < 1 || preprocess_threads < 1 ||
+        infer_threads < 1 || postprocess_threads < 1 || queue_capacity < 1 ||
+        server_workers < 1 || server_connections < 1 || server_queue < 1 || sessions < 0 ||
+        server_timeout_ms < 0 || detect_every < 1 || track_width < 1 || render_every < 0) {
+        LOG(ERROR) << "batch_size, thread counts, queue_capacity, detect_every and track_width must be positive\n" << usage;
+        return -1;
+    }
 
-    // First we load and initialize the model.
+    // Either a single --image, or a batch of images from --image_dir/--image_list.
+    const bool batch_mode = !image_dir.empty() || !image_list.empty();
+    std::vector<string> image_paths;
+    if (batch_mode) {
+        Status list_status = ListImages(image_dir, image_list, &image_paths);
+        if (!list_status.ok()) {
+            LOG(ERROR) << list_status;
+            return -1;
+        }
+        for (auto& path : image_paths)
+            path = tensorflow::io::JoinPath(root_dir, path);
+    }
+    else {
+        image_paths.push_back(tensorflow::io::JoinPath(root_dir, image));
+    }
+
+    c_nms_options nms_options;
+    nms_options.iou_threshold = nms_threshold;
+    nms_options.inclusive = true;
+    if (!ParseNmsMode(nms_mode, &nms_options.mode)) {
+        LOG(ERROR) << "Unknown nms_mode " << nms_mode << "\n" << usage;
+        return -1;
+    }
+
+    c_preprocess_options preprocess;
+    preprocess.input_width = input_width;
+    preprocess.input_height = input_height;
+    preprocess.fused = fused_preprocess;
+    preprocess.swap_rb = swap_rb;
+    preprocess.letterbox = letterbox;
+    preprocess.reduced_decode = reduced_decode;
+    if (!cvprocess::parseOps(image_ops, &preprocess.ops)) {
+        LOG(ERROR) << "Cannot parse image_ops " << image_ops << "\n" << usage;
+        return -1;
+    }
+    cvprocess::fuseOps(&preprocess.ops);
+    if (!parse_shape_buckets(shape_buckets, &preprocess.buckets)) {
+        LOG(ERROR) << "Cannot parse input_shapes " << shape_buckets << "\n" << usage;
+        return -1;
+    }
+
+    if (tile && (pipeline || !server_socket.empty() || server_port > 0 || !video.empty())) {
+        LOG(ERROR) << "tile works with --image, --image_dir and --image_list only";
+        return -1;
+    }
+    if (!classifier_graph.empty() &&
+        (tile || pipeline || !server_socket.empty() || server_port > 0 || !video.empty())) {
+        LOG(ERROR) << "classifier_graph works with --image, --image_dir and --image_list without tile only";
+        return -1;
+    }
+    if (tile && !preprocess.buckets.empty()) {
+        LOG(ERROR) << "tiles are cut to input_width x input_height; input_shapes does not apply";
+        return -1;
+    }
+    if (tile && (tile_width < 0 || tile_height < 0 || tile_overlap < 0 || tile_batch < 0)) {
+        LOG(ERROR) << "tile sizes, overlap and batch must not be negative";
+        return -1;
+    }
+
+    if (self_test) {
+        const bool nms_ok = check_nms_engine();
+        cv::Mat mat = cv::imread(image_paths.empty() ? "" : image_paths[0], CV_LOAD_IMAGE_COLOR);
+        if (mat.data == nullptr) {
+            LOG(ERROR) << "self_test needs a readable --image";
+            return -1;
+        }
+        return check_fused_preprocess(mat, preprocess) && nms_ok ? 0 : -1;
+    }
+    if (!write_dataset.empty()) {
+        // With the normalization folded into the graph, the batch loop feeds
+        // raw pixel values, so the records hold those.
+        c_preprocess_options records_preprocess = preprocess;
+        if (optimize_graph && fold_input_mean) {
+            if (letterbox) {
+                LOG(ERROR) << "fold_input_mean does not work with letterbox";
+                return -1;
+            }
+            for (int c = 0; c < 3; ++c) {
+                records_preprocess.means[c] = 0.f;
+                records_preprocess.stds[c] = 1.f;
+            }
+        }
+        size_t written = 0;
+        Status write_status = WriteTensorDataset(write_dataset, image_paths, records_preprocess, &written);
+        if (!write_status.ok()) {
+            LOG(ERROR) << write_status;
+            return -1;
+        }
+        LOG(INFO) << "wrote " << written << " of " << image_paths.size() << " images to " << write_dataset;
+        return 0;
+    }
+    if (!dataset.empty() && (tile || pipeline || !classifier_graph.empty() || !server_socket.empty() ||
+        server_port > 0 || !video.empty() || !preprocess.buckets.empty())) {
+        LOG(ERROR) << "dataset works with the plain batch loop only";
+        return -1;
+    }
+
+    // First we load and initialize the model. The session stays warm for all
+    // batches. mmap_env is declared first so it outlives the session, whose
+    // memmapped weights point into the mapping.
+    std::unique_ptr<tensorflow::MemmappedEnv> mmap_env;
     std::unique_ptr<tensorflow::Session> session;
     string graph_path = tensorflow::io::JoinPath(root_dir, graph);
     tensorflow::GraphDef graph_def;
+    c_load_options load_options;
+    load_options.memmapped = memmapped_graph;
+    load_options.dump_text_graph = dump_graph;
+    load_options.xla_jit = xla_jit;
+    load_options.pool.sessions = sessions;
+    load_options.pool.intra_op_threads = intra_op_threads;
+    load_options.pool.inter_op_threads = inter_op_threads;
+    load_options.pool.dev_list = dev_list;
+    load_options.pool.pin = pin_threads;
+#if defined(__linux__)
+    // Gives each pooled session its own intra-op pool; see SessionPool.
+    if (sessions != 1 || (!dev_list.empty() && pin_threads))
+        setenv("TF_OVERRIDE_GLOBAL_THREADPOOL", "1", 1);
+#endif
+    if (session_dispatch == "least_loaded") {
+        load_options.pool.least_loaded = true;
+    }
+    else if (session_dispatch != "round_robin") {
+        LOG(ERROR) << "Unknown session_dispatch " << session_dispatch << "\n" << usage;
+        return -1;
+    }
+    std::vector<string> olabels = { "bbox/trimming/bbox","probability/class_idx","probability/score" };
+    if (!tfcompile_config.empty()) {
+        Status config_status = WriteTfcompileConfig(tfcompile_config, input_layer, batch_size, input_height,
+            input_width, olabels);
+        if (!config_status.ok()) {
+            LOG(ERROR) << config_status;
+            return -1;
+        }
+        LOG(INFO) << "wrote " << tfcompile_config << ", see generate_inception_v4_pb.txt";
+        return 0;
+    }
+    if (!quantize_out.empty()) {
+        c_quantize_options quantize;
+        quantize.inputs = { input_layer };
+        quantize.outputs = olabels;
+        quantize.preprocess = preprocess;
+        quantize.calibration_images.assign(image_paths.begin(),
+            image_paths.begin() + std::min<size_t>(image_paths.size(), std::max(0, calibration_images)));
+        Status quantize_status = QuantizeGraph(graph_path, quantize, &graph_def);
+        if (quantize_status.ok())
+            quantize_status = WriteBinaryProto(tensorflow::Env::Default(), quantize_out, graph_def);
+        if (!quantize_status.ok()) {
+            LOG(ERROR) << quantize_status;
+            return -1;
+        }
+        LOG(INFO) << "wrote " << quantize_out;
+        return 0;
+    }
+    if (optimize_graph) {
+        c_graph_optimize_options& optimize = load_options.optimize;
+        optimize.enabled = true;
+        optimize.inputs = { input_layer };
+        optimize.outputs = olabels;
+        optimize.transforms = graph_transforms;
+        optimize.cache_dir = graph_cache_dir;
+        if (fold_input_mean) {
+            // Letterbox borders are zeros after normalization, which raw
+            // pixels cannot express.
+            if (letterbox) {
+                LOG(ERROR) << "fold_input_mean does not work with letterbox";
+                return -1;
+            }
+            optimize.fold_input_normalization = true;
+            for (int c = 0; c < 3; ++c) {
+                // Means are kept in BGR order; the tensor is RGB under swap_rb.
+                const int src = swap_rb && fused_preprocess ? 2 - c : c;
+                optimize.means[c] = preprocess.means[src];
+                optimize.stds[c] = preprocess.stds[src];
+            }
+        }
+    }
+
+    TracingScope tracing_scope;
+    if (!trace_file.empty() || !metrics_file.empty()) {
+        c_trace_options trace_options;
+        trace_options.chrome_trace = trace_file;
+        trace_options.metrics_file = metrics_file;
+        trace_options.metrics_interval_s = metrics_interval;
+        trace_options.full_trace_every = full_trace_every;
+        Status trace_status = StartTracing(trace_options);
+        if (!trace_status.ok()) {
+            LOG(ERROR) << trace_status;
+            return -1;
+        }
+    }
 
-    Status load_graph_status = LoadGraph(graph_path, dev_list, &session, graph_def);
+    Status load_graph_status;
+    {
+        TRACE_SCOPE("load_graph");
+        load_graph_status = LoadGraph(graph_path, dev_list, &session, graph_def, load_options, &mmap_env);
+    }
     if (!load_graph_status.ok()) {
         LOG(ERROR) << load_graph_status;
         return -1;
     }
-// Get the image from disk as a float array of numbers, resized and normalized
-// to the specifications the main graph expects.
-    std::vector<Tensor> resized_tensors;
-    string image_path = tensorflow::io::JoinPath(root_dir, image);
-
-    cv::Mat mat = cv::imread(image_path, CV_LOAD_IMAGE_COLOR);
-    std::vector<unsigned char> odata;
-    cv::Mat img;
-    cvprocess::resizeImage(mat, 103.939, 116.779, 123.68, input_width, input_height, img);
-
-    Tensor inputImg(tensorflow::DT_FLOAT, { 1,input_height,input_width,3 });
-    auto inputImageMapped = inputImg.tensor<float, 4>();
-    //Copy all the data over
-    for (int y = 0; y < input_height; ++y) {
-        const float* source_row = ((float*)img.data) + (y * input_width * 3);
-        for (int x = 0; x < input_width; ++x) {
-            const float* source_pixel = source_row + (x * 3);
-            inputImageMapped(0, y, x, 0) = source_pixel[0];
-            inputImageMapped(0, y, x, 1) = source_pixel[1];
-            inputImageMapped(0, y, x, 2) = source_pixel[2];
+    const bool server_mode = !server_socket.empty() || server_port > 0;
+    SessionPool* session_pool = dynamic_cast<SessionPool*>(session.get());
+    if (session_pool != nullptr) {
+        // Each concurrent Run occupies one pooled session.
+        const int runners = server_mode ? server_workers : (pipeline && batch_mode) ? infer_threads : 1;
+        if (runners < session_pool->size()) {
+            LOG(WARNING) << session_pool->size() << " sessions but only " << runners
+                << " concurrent runs; raise --infer_threads or --server_workers";
+        }
+    }
+    auto log_pool_balance = [session_pool]() {
+        if (session_pool == nullptr)
+            return;
+        string counts;
+        for (long long runs : session_pool->RunCounts())
+            counts += " " + std::to_string(runs);
+        LOG(INFO) << "runs per session:" << counts;
+    };
+    if (load_options.optimize.fold_input_normalization) {
+        // The graph normalizes now; feed it raw pixel values.
+        for (int c = 0; c < 3; ++c) {
+            preprocess.means[c] = 0.f;
+            preprocess.stds[c] = 1.f;
+        }
+    }
+    // Without buckets or XLA the first image costs no more than the
+    // warmup run would, so warming up only adds a run.
+    const bool run_warmup = warmup < 0 ? !preprocess.buckets.empty() || xla_jit : warmup > 0;
+    if (run_warmup && !tile) {
+        // Pooled sessions are picked per Run, so each shape is run once per
+        // session to reach all of them.
+        std::vector<int> batch_sizes = { 1 };
+        if (batch_size > 1 && video.empty())
+            batch_sizes.push_back(batch_size);
+        Status warmup_status = WarmupShapes(session.get(), preprocess, batch_sizes, input_layer, olabels,
+            session_pool != nullptr ? session_pool->size() : 1);
+        if (!warmup_status.ok()) {
+            LOG(ERROR) << warmup_status;
+            return -1;
+        }
+    }
+
+    if (!compare_graph.empty()) {
+        // The candidate is loaded as is, so it sees the same pixels as the
+        // reference only when the reference normalizes them the same way.
+        if (load_options.optimize.fold_input_normalization || memmapped_graph) {
+            LOG(ERROR) << "compare_graph does not work with fold_input_mean or memmapped_graph";
+            return -1;
+        }
+        c_load_options compare_options = load_options;
+        compare_options.optimize = c_graph_optimize_options();
+        compare_options.dump_text_graph.clear();
+        std::unique_ptr<tensorflow::Session> candidate;
+        tensorflow::GraphDef candidate_def;
+        c_graph_comparison comparison;
+        Status compare_status = LoadGraph(tensorflow::io::JoinPath(root_dir, compare_graph), dev_list, &candidate,
+            candidate_def, compare_options);
+        if (compare_status.ok())
+            compare_status = CompareGraphs(session.get(), candidate.get(), image_paths, preprocess, thres_hold,
+                nms_options, input_layer, olabels, match_iou, &comparison);
+        if (!compare_status.ok()) {
+            LOG(ERROR) << compare_status;
+            return -1;
         }
+        return 0;
     }
 
-    resized_tensors.push_back(inputImg);
+    // Detections by image content, for the batch loop, pipeline and server.
+    std::unique_ptr<ResultCache> result_cache;
+    if (result_cache_mb > 0) {
+        c_result_cache_options cache_options;
+        cache_options.memory_bytes = (size_t)result_cache_mb << 20;
+        cache_options.shards = result_cache_shards;
+        cache_options.disk_dir = result_cache_dir;
+        tensorflow::uint64 model;
+        Status hash_status = model_hash(graph_path, load_options, &model);
+        if (!hash_status.ok()) {
+            LOG(ERROR) << hash_status;
+            return -1;
+        }
+        result_cache.reset(new ResultCache(cache_options,
+            detection_params_hash(model, preprocess, thres_hold, nms_options, top_k)));
+    }
 
-    const Tensor& resized_tensor = resized_tensors[0];
+    if (server_mode) {
+        c_server_options options;
+        options.unix_socket = server_socket;
+        options.http_port = server_port;
+        options.workers = server_workers;
+        options.connections = server_connections;
+        options.io_timeout_ms = server_timeout_ms;
+        options.queue_capacity = server_queue;
+        options.batch_size = batch_size;
+        options.preprocess = preprocess;
+        options.threshold = thres_hold;
+        options.nms = nms_options;
+        options.top_k = top_k;
+        options.input_layer = input_layer;
+        options.output_layers = olabels;
+        options.cache = result_cache.get();
+        Status server_status = RunServer(session.get(), options);
+        log_pool_balance();
+        if (result_cache)
+            result_cache->LogStats();
+        if (!server_status.ok()) {
+            LOG(ERROR) << server_status;
+            return -1;
+        }
+        return 0;
+    }
 
-    std::vector<Tensor> outputs;
-    std::vector<string> olabels = { "bbox/trimming/bbox","probability/class_idx","probability/score" };
+    if (!video.empty()) {
+        c_stream_options options;
+        options.source = video;
+        options.out = stream_out;
+        options.detect_every = detect_every;
+        options.queue_capacity = queue_capacity;
+        options.drop_frames = drop_frames;
+        options.track_width = track_width;
+        options.min_track_ratio = min_track_ratio;
+        options.max_motion = max_motion;
+        options.preprocess = preprocess;
+        options.threshold = thres_hold;
+        options.nms = nms_options;
+        options.top_k = top_k;
+        options.input_layer = input_layer;
+        options.output_layers = olabels;
+        Status stream_status = RunStream(session.get(), options);
+        if (!stream_status.ok()) {
+            LOG(ERROR) << stream_status;
+            return -1;
+        }
+        return 0;
+    }
 
-    tensorflow::TensorShape image_input_shape;
-    image_input_shape.AddDim(1);
-    image_input_shape.AddDim(384);
-    image_input_shape.AddDim(624);
-    image_input_shape.AddDim(3);
-
-    tensorflow::TensorShape box_mask_shape;
-    box_mask_shape.AddDim(1);
-    box_mask_shape.AddDim(16848);
-    box_mask_shape.AddDim(1);
-    Tensor box_mask_tensor(tensorflow::DataType::DT_FLOAT, box_mask_shape);
-
-    tensorflow::TensorShape box_delta_input_shape;
-    box_delta_input_shape.AddDim(1);
-    box_delta_input_shape.AddDim(16848);
-    box_delta_input_shape.AddDim(4);
-    Tensor box_delta_input_tensor(tensorflow::DataType::DT_FLOAT, box_delta_input_shape);
-
-    tensorflow::TensorShape box_input_shape;
-    box_input_shape.AddDim(1);
-    box_input_shape.AddDim(16848);
-    box_input_shape.AddDim(4);
-    Tensor box_input_tensor(tensorflow::DataType::DT_FLOAT, box_input_shape);
-
-    tensorflow::TensorShape labels_shape;
-    labels_shape.AddDim(1);
-    labels_shape.AddDim(16848);
-    labels_shape.AddDim(3);
-    Tensor labels_tensor(tensorflow::DataType::DT_FLOAT, labels_shape);
-
-    std::cout << "-------------step 1 -------------" << std::endl;
-    Status run_status = session->Run({ {"image_input", resized_tensor} },
-        olabels, {}, &outputs);
-
-    if (!run_status.ok()) {
-        LOG(ERROR) << "Running model failed: " << run_status;
+    // Records and rendered images are written off the inference threads.
+    c_sink_options sink_options;
+    sink_options.records_format = records_format;
+    sink_options.records_path = records;
+    sink_options.render_every = render_every;
+    sink_options.skip_renders = skip_renders;
+    sink_options.encode.format = image_format;
+    sink_options.encode.png_level = png_level;
+    sink_options.encode.jpeg_quality = jpeg_quality;
+    std::unique_ptr<DetectionSink> sink;
+    Status sink_status = DetectionSink::New(sink_options, &sink);
+    if (!sink_status.ok()) {
+        LOG(ERROR) << sink_status;
         return -1;
     }
-    else {
-        LOG(ERROR) << "Running model success: " << run_status;
-    }
-
-
-    Tensor boxes = outputs[0];
-    Tensor oindices = outputs[1];
-    Tensor scores = outputs[2];
-
-    float scale_factor_w = (float)img.cols / mat.cols;
-    float scale_factor_h = (float)img.rows / mat.rows;
-
-        std::map<int, std::vector<c_tf_detect_result> >  src;
-        std::map<int, std::vector<c_tf_detect_result> >  dst;
-        prepare_tf_detect_result(boxes, oindices, scores, scale_factor_w, scale_factor_h, thres_hold, src);
-        nms_plus(src, dst, 0.4);
-
-        for (auto it = dst.begin(); it != dst.end(); ++it) {
-            std::vector<c_tf_detect_result>& cur = it->second;
-            for (auto iter = cur.begin(); iter != cur.end(); ++iter) {
-                int x1 = iter->r.x;
-                int y1 = iter->r.y;
-                int x2 = x1 + iter->r.width;
-                int y2 = y1 + iter->r.height;
-                cv::rectangle(mat, cv::Point(x1, y1), cv::Point(x2, y2), cv::Scalar(255, 0, 0), 2);
-                char text[64];
-                sprintf(text, "%lf", iter->score);
-                cv::putText(mat, text
-                    , cv::Point(x1, y1)
-                    , CV_FONT_HERSHEY_COMPLEX
-                    , 0.8
-                    , cv::Scalar(0, 0, 255));
+    // A single image renders to out_image, a batch to out_dir if given.
+    auto render_path = [&](const string& path) -> string {
+        if (!batch_mode)
+            return out_image;
+        if (out_dir.empty())
+            return string();
+        return tensorflow::io::JoinPath(out_dir, tensorflow::io::Basename(path));
+    };
+
+    if (pipeline && batch_mode) {
+        c_pipeline_options options;
+        options.decode_threads = decode_threads;
+        options.preprocess_threads = preprocess_threads;
+        options.infer_threads = infer_threads;
+        options.postprocess_threads = postprocess_threads;
+        options.queue_capacity = queue_capacity;
+        options.batch_size = batch_size;
+        options.preprocess = preprocess;
+        options.threshold = thres_hold;
+        options.nms = nms_options;
+        options.top_k = top_k;
+        options.input_layer = input_layer;
+        options.output_layers = olabels;
+        options.out_dir = out_dir;
+        options.sink = sink.get();
+        options.cache = result_cache.get();
+        Status pipeline_status = RunPipeline(session.get(), image_paths, options);
+        log_pool_balance();
+        if (result_cache)
+            result_cache->LogStats();
+        if (!pipeline_status.ok()) {
+            LOG(ERROR) << pipeline_status;
+            return -1;
+        }
+        return 0;
+    }
+
+    if (!classifier_graph.empty()) {
+        // The detector moves into a registry next to the classifier; both
+        // run on the process wide TF thread pools.
+        ModelRegistry registry;
+        registry.Adopt("detector", std::move(session), graph_def.ByteSizeLong());
+        c_load_options classifier_load;
+        classifier_load.xla_jit = xla_jit;
+        classifier_load.pool.intra_op_threads = intra_op_threads;
+        classifier_load.pool.inter_op_threads = inter_op_threads;
+        c_cascade_options cascade;
+        cascade.input_layer = classifier_input_layer;
+        cascade.output_layer = classifier_output_layer;
+        cascade.preprocess.input_width = classifier_width;
+        cascade.preprocess.input_height = classifier_height;
+        cascade.preprocess.fused = true;
+        cascade.preprocess.swap_rb = true;
+        for (int c = 0; c < 3; ++c) {
+            cascade.preprocess.means[c] = classifier_mean;
+            cascade.preprocess.stds[c] = classifier_std;
+        }
+        cascade.padding = crop_padding;
+        cascade.max_crops = max_crops;
+        std::vector<string> class_names;
+        Status cascade_status = registry.Load(cascade.model, tensorflow::io::JoinPath(root_dir, classifier_graph),
+            classifier_load);
+        if (cascade_status.ok() && !ReadLabelsFile(tensorflow::io::JoinPath(root_dir, labels), &class_names).ok())
+            LOG(WARNING) << "cannot read labels " << labels << ", reporting class indices";
+        if (!cascade_status.ok()) {
+            LOG(ERROR) << cascade_status;
+            return -1;
+        }
+
+        CropClassifier classifier(&registry, cascade);
+        WorkerArena arena(input_height, input_width);
+        DetectionDecoder decoder(top_k);
+        const cv::Size reduce = reduced_decode_size(preprocess);
+        std::vector<c_tf_detect_result> dst;
+        std::vector<c_crop_label> crop_labels;
+        cv::Size original;
+        int processed = 0;
+        long long crops = 0;
+        for (const string& path : image_paths) {
+            cv::Mat* mat = arena.Image(0);
+            {
+                TRACE_SCOPE("decode");
+                if (!read_image_into(path, arena.FileBuffer(), mat, reduce.width, reduce.height, &original) ||
+                    !apply_image_ops(preprocess, mat, arena.Scratch())) {
+                    LOG(ERROR) << "Failed to read image " << path;
+                    continue;
+                }
             }
+            const cv::Size shape = pick_input_shape(preprocess, original);
+            Tensor* input = arena.Input(1, shape.height, shape.width);
+            c_image_transform transform;
+            {
+                TRACE_SCOPE("preprocess");
+                if (!preprocess_into_tensor(*mat, preprocess, 0, input, arena.Scratch(), &transform, original)) {
+                    LOG(ERROR) << "Failed to preprocess image " << path;
+                    continue;
+                }
+            }
+            cascade_status = registry.Run("detector", { {input_layer, *input} }, olabels, arena.Outputs());
+            if (!cascade_status.ok())
+                break;
+            note_inference_done();
+            {
+                TRACE_SCOPE("postprocess");
+                const std::vector<Tensor>& outputs = *arena.Outputs();
+                decoder.Decode(outputs[0], outputs[1], outputs[2], 0, transform, thres_hold);
+                decoder.Suppress(nms_options, &dst);
+            }
+            const float render_scale = (float)mat->cols / original.width;
+            cascade_status = classifier.Classify(*mat, dst, render_scale, &crop_labels);
+            if (!cascade_status.ok())
+                break;
+            crops += classifier.last_crops();
+            for (size_t i = 0; i < dst.size(); ++i) {
+                const c_crop_label& label = crop_labels[i];
+                if (label.label < 0)
+                    continue;
+                const cv::Rect& r = dst[i].r;
+                LOG(INFO) << path << ": box " << r.x << "," << r.y << " " << r.width << "x" << r.height << " "
+                    << (label.label < (int)class_names.size() ? class_names[label.label] : std::to_string(label.label))
+                    << " " << label.score;
+            }
+            sink->Write(path, dst, mat, render_path(path), render_scale);
+            ++processed;
+            trace_count("images", 1);
         }
-    cv::imwrite(out_image, mat);
+        if (!cascade_status.ok()) {
+            LOG(ERROR) << "Running model failed: " << cascade_status;
+            return -1;
+        }
+        LOG(INFO) << "Cascade: " << processed << " images, " << (processed ? (double)crops / processed : 0)
+            << " crops per image";
+        registry.LogStats();
+        return 0;
+    }
+
+    if (tile) {
+        c_tile_options tile_options;
+        tile_options.tile_width = tile_width;
+        tile_options.tile_height = tile_height;
+        tile_options.overlap = tile_overlap;
+        tile_options.max_batch = tile_batch;
+        tile_options.full_image = tile_full_image;
+        TiledDetector detector(session.get(), tile_options, preprocess, thres_hold, nms_options, top_k,
+            input_layer, olabels);
+        std::vector<unsigned char> file_buffer;
+        cv::Mat mat, scratch;
+        std::vector<c_tf_detect_result> dst;
+        int processed = 0;
+        long long tiles = 0, runs = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (const string& path : image_paths) {
+            {
+                TRACE_SCOPE("decode");
+                // Tiles want every source pixel, so no reduced decode here.
+                if (!read_image_into(path, &file_buffer, &mat) || !apply_image_ops(preprocess, &mat, &scratch)) {
+                    LOG(ERROR) << "Failed to read image " << path;
+                    continue;
+                }
+            }
+            Status detect_status = detector.Detect(mat, &dst);
+            if (!detect_status.ok()) {
+                LOG(ERROR) << "Running model failed: " << detect_status;
+                return -1;
+            }
+            tiles += detector.last_tiles();
+            runs += detector.last_runs();
+            LOG(INFO) << path << ": " << dst.size() << " detections from " << detector.last_tiles() << " tiles";
+            sink->Write(path, dst, &mat, render_path(path));
+            ++processed;
+            trace_count("images", 1);
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        LOG(INFO) << "Tiled " << processed << " images in " << seconds << " s, "
+            << (seconds > 0 ? processed / seconds : 0) << " images/s, "
+            << (processed ? (double)tiles / processed : 0) << " tiles and "
+            << (processed ? (double)runs / processed : 0) << " runs per image";
+        return 0;
+    }
+
+    if (!dataset.empty()) {
+        // Records are fed as stored. A dataset for a graph with
+        // fold_input_mean must be written with optimize_graph and
+        // fold_input_mean too, so it holds raw pixel values.
+        std::unique_ptr<TensorDataset> tensor_dataset;
+        Status open_status = TensorDataset::Open(dataset, preprocess, &tensor_dataset);
+        if (!open_status.ok()) {
+            LOG(ERROR) << open_status;
+            return -1;
+        }
+        DetectionDecoder decoder(top_k);
+        std::vector<c_tf_detect_result> dst;
+        Tensor input;
+        std::vector<Tensor> outputs;
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t begin = 0; begin < tensor_dataset->size(); begin += batch_size) {
+            const int n = std::min<size_t>(batch_size, tensor_dataset->size() - begin);
+            Status run_status = tensor_dataset->Batch(begin, n, &input);
+            if (run_status.ok())
+                run_status = TracedRun(session.get(), { {input_layer, input} }, olabels, &outputs);
+            if (!run_status.ok()) {
+                LOG(ERROR) << "Running model failed: " << run_status;
+                return -1;
+            }
+            note_inference_done();
+            for (int b = 0; b < n; ++b) {
+                TRACE_SCOPE("postprocess");
+                decoder.Decode(outputs[0], outputs[1], outputs[2], b, tensor_dataset->transform(begin + b), thres_hold);
+                decoder.Suppress(nms_options, &dst);
+                const string path = tensor_dataset->name(begin + b);
+                LOG(INFO) << path << ": " << dst.size() << " detections";
+                sink->Write(path, dst, nullptr, string());
+            }
+            trace_count("images", n);
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        LOG(INFO) << "Processed " << tensor_dataset->size() << " dataset images in " << seconds << " s, "
+            << (seconds > 0 ? tensor_dataset->size() / seconds : 0) << " images/s; " << tensor_dataset->mapped_batches()
+            << " batches fed from the mapping, " << tensor_dataset->copied_batches() << " copied";
+        return 0;
+    }
+
+    // Everything the loop touches lives in the arena or outside the loop, so
+    // once the first batch has sized the buffers it does not allocate.
+    if (count_allocations)
+        EnableAllocationCounting();
+    c_alloc_snapshot steady_begin;
+    long long runs = 0;
+    int processed = 0;
+    WorkerArena arena(input_height, input_width);
+    const cv::Size reduce = reduced_decode_size(preprocess);
+    DetectionDecoder decoder(top_k);
+    std::vector<c_tf_detect_result> dst;
+    std::vector<size_t> batch_index;
+    std::vector<cv::Size> originals(batch_size), shapes(batch_size);
+    std::vector<tensorflow::uint64> cache_keys(batch_size);
+    std::vector<char> done(batch_size);
+    std::vector<int> group;
+    group.reserve(batch_size);
+    std::vector<c_image_transform> transforms;
+    std::vector<char> prepared;
+    for (size_t begin = 0; begin < image_paths.size(); begin += batch_size) {
+        const size_t end = std::min(image_paths.size(), begin + batch_size);
+
+        // Get the images from disk, then resize and normalize them into the
+        // batch to the specifications the main graph expects. Images that fail
+        // to decode are dropped from the batch.
+        batch_index.clear();
+        for (size_t k = begin; k < end; ++k) {
+            TRACE_SCOPE("decode");
+            const size_t slot = batch_index.size();
+            if (!read_file_into(image_paths[k], arena.FileBuffer())) {
+                LOG(ERROR) << "Failed to read image " << image_paths[k];
+                continue;
+            }
+            // Known images skip the rest; they are recorded but not rendered.
+            if (result_cache) {
+                cache_keys[slot] = result_cache->Key(*arena.FileBuffer());
+                if (result_cache->Lookup(cache_keys[slot], &dst)) {
+                    if (batch_mode)
+                        LOG(INFO) << image_paths[k] << ": " << dst.size() << " detections (cached)";
+                    sink->Write(image_paths[k], dst, nullptr, string());
+                    ++processed;
+                    continue;
+                }
+            }
+            if (!cvprocess::decodeForInput(*arena.FileBuffer(), reduce.width, reduce.height, *arena.Image(slot),
+                    &originals[slot]) ||
+                !apply_image_ops(preprocess, arena.Image(slot), arena.Scratch())) {
+                LOG(ERROR) << "Failed to read image " << image_paths[k];
+                continue;
+            }
+            batch_index.push_back(k);
+        }
+        if (batch_index.empty())
+            continue;
+
+        // Images go to their own shape bucket; each bucket present in the
+        // batch is one session run.
+        const int n = batch_index.size();
+        for (int b = 0; b < n; ++b)
+            shapes[b] = pick_input_shape(preprocess, originals[b]);
+        for (int b = 0; b < n; ++b)
+            done[b] = false;
+        for (int first = 0; first < n; ++first) {
+            if (done[first])
+                continue;
+            const cv::Size shape = shapes[first];
+            group.clear();
+            for (int b = first; b < n; ++b) {
+                if (!done[b] && shapes[b] == shape) {
+                    group.push_back(b);
+                    done[b] = true;
+                }
+            }
+
+            const int m = group.size();
+            Tensor* inputImg = arena.Input(m, shape.height, shape.width);
+            transforms.resize(m);
+            prepared.resize(m);
+            {
+                TRACE_SCOPE("preprocess");
+                for (int g = 0; g < m; ++g)
+                    prepared[g] = preprocess_into_tensor(*arena.Image(group[g]), preprocess, g, inputImg,
+                        arena.Scratch(), &transforms[g], originals[group[g]]);
+            }
+
+            std::vector<Tensor>* outputs = arena.Outputs();
+            Status run_status = TracedRun(session.get(), { {input_layer, *inputImg} }, olabels, outputs);
+
+            if (!run_status.ok()) {
+                LOG(ERROR) << "Running model failed: " << run_status;
+                return -1;
+            }
+            else {
+                LOG(ERROR) << "Running model success: " << run_status;
+            }
+            note_inference_done();
+
+            const Tensor& boxes = (*outputs)[0];
+            const Tensor& oindices = (*outputs)[1];
+            const Tensor& scores = (*outputs)[2];
+
+            for (int g = 0; g < m; ++g) {
+                TRACE_SCOPE("postprocess");
+                const int b = group[g];
+                if (!prepared[g]) {
+                    LOG(ERROR) << "Failed to preprocess image " << image_paths[batch_index[b]];
+                    continue;
+                }
+                decoder.Decode(boxes, oindices, scores, g, transforms[g], thres_hold);
+                decoder.Suppress(nms_options, &dst);
+                if (result_cache)
+                    result_cache->Insert(cache_keys[b], dst);
+
+                // Rendering happens at decoded size.
+                const float render_scale = (float)arena.Image(b)->cols / originals[b].width;
+                const string& path = image_paths[batch_index[b]];
+                if (batch_mode)
+                    LOG(INFO) << path << ": " << dst.size() << " detections";
+                sink->Write(path, dst, arena.Image(b), render_path(path), render_scale);
+            }
+        }
+        if (count_allocations && runs++ == 0)
+            steady_begin = AllocationSnapshot();
+        processed += n;
+        trace_count("images", n);
+    }
+    LOG(INFO) << "Processed " << processed << " of " << image_paths.size() << " images";
+    if (result_cache)
+        result_cache->LogStats();
+    if (count_allocations)
+        log_allocations("Batch loop", steady_begin, AllocationSnapshot(), runs - 1);
 
     return 0;
 }
@@ -0,0 +1,95 @@
+#include "model_registry.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/platform/logging.h"
+
+#include "trace.hpp"
+
+using tensorflow::Status;
+using tensorflow::Tensor;
+using tensorflow::string;
+
+long long resident_bytes() {
+#ifdef __linux__
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (file == nullptr)
+        return -1;
+    long long pages_total = 0, pages_resident = 0;
+    const bool ok = fscanf(file, "%lld %lld", &pages_total, &pages_resident) == 2;
+    fclose(file);
+    return ok ? pages_resident * sysconf(_SC_PAGESIZE) : -1;
+#else
+    return -1;
+#endif
+}
+
+Status ModelRegistry::Load(const string& name, const string& graph_file, const c_load_options& options) {
+    if (models_.count(name))
+        return tensorflow::errors::AlreadyExists("model ", name, " is already loaded");
+    if (options.pool.sessions != 1 || !options.pool.dev_list.empty())
+        return tensorflow::errors::InvalidArgument("model ", name, " would load a session pool");
+    std::unique_ptr<c_model> model(new c_model);
+    tensorflow::GraphDef graph_def;
+    const long long before = resident_bytes();
+    TF_RETURN_IF_ERROR(LoadGraph(graph_file, "", &model->session, graph_def, options));
+    const long long after = resident_bytes();
+    model->graph_bytes = graph_def.ByteSizeLong();
+    // The GraphDef is freed on return; the session keeps its own copy of
+    // the weights.
+    model->resident_bytes = before >= 0 && after >= 0 ? after - before : -1;
+    models_[name] = std::move(model);
+    return Status::OK();
+}
+
+void ModelRegistry::Adopt(const string& name, std::unique_ptr<tensorflow::Session> session, size_t graph_bytes) {
+    std::unique_ptr<c_model> model(new c_model);
+    model->session = std::move(session);
+    model->graph_bytes = graph_bytes;
+    model->resident_bytes = -1;
+    models_[name] = std::move(model);
+}
+
+tensorflow::Session* ModelRegistry::Get(const string& name) const {
+    auto it = models_.find(name);
+    return it == models_.end() ? nullptr : it->second->session.get();
+}
+
+Status ModelRegistry::Run(const string& name, const std::vector<std::pair<string, Tensor> >& inputs,
+    const std::vector<string>& output_names, std::vector<Tensor>* outputs) {
+    auto it = models_.find(name);
+    if (it == models_.end())
+        return tensorflow::errors::NotFound("no model ", name);
+    c_model* model = it->second.get();
+    const auto start = std::chrono::steady_clock::now();
+    Status status = TracedRun(model->session.get(), inputs, output_names, outputs);
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (status.ok()) {
+        std::lock_guard<std::mutex> lock(model->mu);
+        model->latency.Add(ms);
+    }
+    return status;
+}
+
+void ModelRegistry::LogStats() const {
+    for (const auto& it : models_) {
+        const c_model& model = *it.second;
+        LatencyHistogram latency;
+        {
+            std::lock_guard<std::mutex> lock(model.mu);
+            latency = model.latency;
+        }
+        LOG(INFO) << "model " << it.first << ": graph " << model.graph_bytes / 1048576.0 << " MB, resident "
+            << (model.resident_bytes >= 0 ? std::to_string(model.resident_bytes / 1048576) + " MB" : "n/a")
+            << " at load; " << latency.count() << " runs, mean " << latency.mean() << " ms, p50 "
+            << latency.Percentile(0.5) << " ms, p95 " << latency.Percentile(0.95) << " ms";
+    }
+}
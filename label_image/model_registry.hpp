@@ -0,0 +1,54 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/public/session.h"
+
+#include "tf_detect.hpp"
+#include "trace.hpp"
+
+// Several frozen graphs loaded into one process under names. Single
+// sessions use TF's process wide thread pools, so every model loaded here
+// shares one set of inter- and intra-op threads (sized by the first); no
+// model adds its own. Runs go through Run, which keeps per model latency,
+// and LogStats reports it with what each model added to memory at load.
+class ModelRegistry {
+public:
+    // Loads graph_file with LoadGraph as name. A SessionPool would bring its
+    // own threads, so options.pool must describe a single session.
+    tensorflow::Status Load(const tensorflow::string& name, const tensorflow::string& graph_file,
+        const c_load_options& options);
+
+    // Takes over an already loaded session, e.g. the detector main loaded.
+    // graph_bytes is the size of its GraphDef.
+    void Adopt(const tensorflow::string& name, std::unique_ptr<tensorflow::Session> session, size_t graph_bytes);
+
+    // nullptr for an unknown name.
+    tensorflow::Session* Get(const tensorflow::string& name) const;
+
+    // TracedRun on model name, timed. Thread safe.
+    tensorflow::Status Run(const tensorflow::string& name,
+        const std::vector<std::pair<tensorflow::string, tensorflow::Tensor> >& inputs,
+        const std::vector<tensorflow::string>& output_names, std::vector<tensorflow::Tensor>* outputs);
+
+    void LogStats() const;
+
+private:
+    struct c_model {
+        std::unique_ptr<tensorflow::Session> session;
+        size_t graph_bytes = 0;
+        long long resident_bytes = 0;  // process growth over the load, -1 unknown
+        mutable std::mutex mu;
+        LatencyHistogram latency;
+    };
+
+    std::map<tensorflow::string, std::unique_ptr<c_model> > models_;
+};
+
+// Resident set size of this process in bytes, -1 where not available.
+long long resident_bytes();
@@ -2,9 +2,12 @@
 #include <opencv2/opencv.hpp>
 #include <assert.h>
 
+#include "nms_engine.hpp"
+
 /**
  * @brief nms
  * Non maximum suppression
+ * Boxes are visited by their bottom-right y coordinate.
  * @param srcRects
  * @param resRects
  * @param thresh
@@ -25,47 +28,24 @@ inline void nms(
         return;
     }
 
-    // Sort the bounding boxes by the bottom - right y - coordinate of the bounding box
-    std::multimap<int, size_t> idxs;
+    thread_local NmsBoxes boxes;
+    thread_local NmsEngine engine;
+    thread_local std::vector<c_nms_keep> keep;
+    boxes.clear();
     for (size_t i = 0; i < size; ++i)
     {
-        idxs.insert(std::pair<int, size_t>(srcRects[i].br().y, i));
+        const cv::Rect& r = srcRects[i];
+        boxes.push_back(r.x, r.y, r.x + r.width, r.y + r.height, r.br().y);
     }
 
-    // keep looping while some indexes still remain in the indexes list
-    while (idxs.size() > 0)
+    c_nms_options options;
+    options.iou_threshold = thresh;
+    engine.Run(boxes, options, &keep);
+    for (const c_nms_keep& k : keep)
     {
-        // grab the last rectangle
-        auto lastElem = --std::end(idxs);
-        const cv::Rect& rect1 = srcRects[lastElem->second];
-
-        int neigborsCount = 0;
-
-        idxs.erase(lastElem);
-
-        for (auto pos = std::begin(idxs); pos != std::end(idxs); )
-        {
-            // grab the current rectangle
-            const cv::Rect& rect2 = srcRects[pos->second];
-
-            float intArea = (rect1 & rect2).area();
-            float unionArea = rect1.area() + rect2.area() - intArea;
-            float overlap = intArea / unionArea;
-
-            // if there is sufficient overlap, suppress the current bounding box
-            if (overlap > thresh)
-            {
-                pos = idxs.erase(pos);
-                ++neigborsCount;
-            }
-            else
-            {
-                ++pos;
-            }
-        }
-        if (neigborsCount >= neighbors)
+        if (k.neighbors >= neighbors)
         {
-            resRects.push_back(rect1);
+            resRects.push_back(srcRects[k.index]);
         }
     }
 }
@@ -98,51 +78,25 @@ inline void nms2(
 
     assert(srcRects.size() == scores.size());
 
-    // Sort the bounding boxes by the detection score
-    std::multimap<float, size_t> idxs;
+    thread_local NmsBoxes boxes;
+    thread_local NmsEngine engine;
+    thread_local std::vector<c_nms_keep> keep;
+    boxes.clear();
     for (size_t i = 0; i < size; ++i)
     {
-        idxs.insert(std::pair<float, size_t>(scores[i], i));
+        const cv::Rect& r = srcRects[i];
+        boxes.push_back(r.x, r.y, r.x + r.width, r.y + r.height, scores[i]);
     }
 
-    // keep looping while some indexes still remain in the indexes list
-    while (idxs.size() > 0)
+    c_nms_options options;
+    options.iou_threshold = thresh;
+    engine.Run(boxes, options, &keep);
+    for (const c_nms_keep& k : keep)
     {
-        // grab the last rectangle
-        auto lastElem = --std::end(idxs);
-        const cv::Rect& rect1 = srcRects[lastElem->second];
-
-        int neigborsCount = 0;
-        float scoresSum = lastElem->first;
-
-        idxs.erase(lastElem);
-
-        for (auto pos = std::begin(idxs); pos != std::end(idxs); )
-        {
-            // grab the current rectangle
-            const cv::Rect& rect2 = srcRects[pos->second];
-
-            float intArea = (rect1 & rect2).area();
-            float unionArea = rect1.area() + rect2.area() - intArea;
-            float overlap = intArea / unionArea;
-
-            // if there is sufficient overlap, suppress the current bounding box
-            if (overlap > thresh)
-            {
-                scoresSum += pos->first;
-                pos = idxs.erase(pos);
-                ++neigborsCount;
-            }
-            else
-            {
-                ++pos;
-            }
-        }
-        if (neigborsCount >= neighbors &&
-                scoresSum >= minScoresSum)
+        if (k.neighbors >= neighbors &&
+                k.score_sum >= minScoresSum)
         {
-            resRects.push_back(rect1);
+            resRects.push_back(srcRects[k.index]);
         }
     }
 }
-
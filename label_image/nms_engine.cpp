@@ -0,0 +1,313 @@
+#include "nms_engine.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+static inline int lowest_bit(uint32_t m) {
+#if defined(_MSC_VER)
+    unsigned long idx;
+    _BitScanForward(&idx, m);
+    return (int)idx;
+#else
+    return __builtin_ctz(m);
+#endif
+}
+
+bool ParseNmsMode(const std::string& name, NmsMode* mode) {
+    if (name == "hard")
+        *mode = NmsMode::Hard;
+    else if (name == "weighted")
+        *mode = NmsMode::ScoreWeighted;
+    else if (name == "soft_linear")
+        *mode = NmsMode::SoftLinear;
+    else if (name == "soft")
+        *mode = NmsMode::SoftGaussian;
+    else
+        return false;
+    return true;
+}
+
+void NmsBoxes::clear() {
+    x1.clear();
+    y1.clear();
+    x2.clear();
+    y2.clear();
+    area.clear();
+    score.clear();
+    label.clear();
+}
+
+void NmsBoxes::reserve(size_t n) {
+    x1.reserve(n);
+    y1.reserve(n);
+    x2.reserve(n);
+    y2.reserve(n);
+    area.reserve(n);
+    score.reserve(n);
+    label.reserve(n);
+}
+
+void NmsBoxes::push_back(float bx1, float by1, float bx2, float by2, float s, int l) {
+    x1.push_back(bx1);
+    y1.push_back(by1);
+    x2.push_back(bx2);
+    y2.push_back(by2);
+    area.push_back((bx2 - bx1) * (by2 - by1));
+    score.push_back(s);
+    label.push_back(l);
+}
+
+static inline float box_iou(float ax1, float ay1, float ax2, float ay2, float aarea,
+    float bx1, float by1, float bx2, float by2, float barea) {
+    float w = std::max(std::min(ax2, bx2) - std::max(ax1, bx1), 0.f);
+    float h = std::max(std::min(ay2, by2) - std::max(ay1, by1), 0.f);
+    float inter = w * h;
+    return inter / ((aarea + barea) - inter);
+}
+
+uint32_t nms_overlap_block8(const float* x1, const float* y1, const float* x2, const float* y2,
+    const float* area, int j, float bx1, float by1, float bx2, float by2, float barea,
+    float thresh, bool inclusive) {
+#if defined(__AVX__)
+    const __m256 zero = _mm256_setzero_ps();
+    __m256 w = _mm256_max_ps(_mm256_sub_ps(_mm256_min_ps(_mm256_loadu_ps(x2 + j), _mm256_set1_ps(bx2)),
+        _mm256_max_ps(_mm256_loadu_ps(x1 + j), _mm256_set1_ps(bx1))), zero);
+    __m256 h = _mm256_max_ps(_mm256_sub_ps(_mm256_min_ps(_mm256_loadu_ps(y2 + j), _mm256_set1_ps(by2)),
+        _mm256_max_ps(_mm256_loadu_ps(y1 + j), _mm256_set1_ps(by1))), zero);
+    __m256 inter = _mm256_mul_ps(w, h);
+    __m256 uni = _mm256_sub_ps(_mm256_add_ps(_mm256_set1_ps(barea), _mm256_loadu_ps(area + j)), inter);
+    __m256 iou = _mm256_div_ps(inter, uni);
+    __m256 hit = inclusive ? _mm256_cmp_ps(iou, _mm256_set1_ps(thresh), _CMP_GE_OQ)
+                           : _mm256_cmp_ps(iou, _mm256_set1_ps(thresh), _CMP_GT_OQ);
+    return (uint32_t)_mm256_movemask_ps(hit);
+#elif defined(__SSE2__)
+    const __m128 zero = _mm_setzero_ps();
+    uint32_t mask = 0;
+    for (int half = 0; half < 2; ++half) {
+        const int k = j + half * 4;
+        __m128 w = _mm_max_ps(_mm_sub_ps(_mm_min_ps(_mm_loadu_ps(x2 + k), _mm_set1_ps(bx2)),
+            _mm_max_ps(_mm_loadu_ps(x1 + k), _mm_set1_ps(bx1))), zero);
+        __m128 h = _mm_max_ps(_mm_sub_ps(_mm_min_ps(_mm_loadu_ps(y2 + k), _mm_set1_ps(by2)),
+            _mm_max_ps(_mm_loadu_ps(y1 + k), _mm_set1_ps(by1))), zero);
+        __m128 inter = _mm_mul_ps(w, h);
+        __m128 uni = _mm_sub_ps(_mm_add_ps(_mm_set1_ps(barea), _mm_loadu_ps(area + k)), inter);
+        __m128 iou = _mm_div_ps(inter, uni);
+        __m128 hit = inclusive ? _mm_cmpge_ps(iou, _mm_set1_ps(thresh))
+                               : _mm_cmpgt_ps(iou, _mm_set1_ps(thresh));
+        mask |= (uint32_t)_mm_movemask_ps(hit) << (half * 4);
+    }
+    return mask;
+#else
+    uint32_t mask = 0;
+    for (int k = 0; k < 8; ++k) {
+        float iou = box_iou(bx1, by1, bx2, by2, barea, x1[j + k], y1[j + k], x2[j + k], y2[j + k], area[j + k]);
+        if (inclusive ? iou >= thresh : iou > thresh)
+            mask |= 1u << k;
+    }
+    return mask;
+#endif
+}
+
+int nms_select_candidates(const float* scores, int n, float threshold, int* out) {
+    int count = 0;
+    int i = 0;
+#if defined(__AVX__)
+    const __m256 t = _mm256_set1_ps(threshold);
+    for (; i + 8 <= n; i += 8) {
+        uint32_t m = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(scores + i), t, _CMP_GE_OQ));
+        for (; m; m &= m - 1)
+            out[count++] = i + lowest_bit(m);
+    }
+#elif defined(__SSE2__)
+    const __m128 t = _mm_set1_ps(threshold);
+    for (; i + 4 <= n; i += 4) {
+        uint32_t m = _mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(scores + i), t));
+        for (; m; m &= m - 1)
+            out[count++] = i + lowest_bit(m);
+    }
+#endif
+    for (; i < n; ++i) {
+        if (scores[i] >= threshold)
+            out[count++] = i;
+    }
+    return count;
+}
+
+const char* nms_engine_isa() {
+#if defined(__AVX__)
+    return "avx";
+#elif defined(__SSE2__)
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+void NmsEngine::Run(const NmsBoxes& boxes, const c_nms_options& options, std::vector<c_nms_keep>* keep) {
+    keep->clear();
+    const int n = boxes.size();
+    if (!n)
+        return;
+
+    // Group by label, best score first. Equal scores go to the later input
+    // first, which is the order the old multimap based nms visited them in.
+    order_.resize(n);
+    std::iota(order_.begin(), order_.end(), 0);
+    std::sort(order_.begin(), order_.end(), [&boxes](int a, int b) {
+        if (boxes.label[a] != boxes.label[b])
+            return boxes.label[a] < boxes.label[b];
+        if (boxes.score[a] != boxes.score[b])
+            return boxes.score[a] > boxes.score[b];
+        return a > b;
+    });
+
+    // Sorted copies padded to whole 8-box blocks so the overlap kernel never
+    // needs a scalar tail.
+    const int padded = (n + 7) / 8 * 8;
+    x1_.assign(padded, 0.f);
+    y1_.assign(padded, 0.f);
+    x2_.assign(padded, 0.f);
+    y2_.assign(padded, 0.f);
+    area_.assign(padded, 0.f);
+    score_.assign(padded, 0.f);
+    label_.resize(n);
+    for (int i = 0; i < n; ++i) {
+        const int k = order_[i];
+        x1_[i] = boxes.x1[k];
+        y1_[i] = boxes.y1[k];
+        x2_[i] = boxes.x2[k];
+        y2_[i] = boxes.y2[k];
+        area_[i] = boxes.area[k];
+        score_[i] = boxes.score[k];
+        label_[i] = boxes.label[k];
+    }
+    removed_.assign((padded + 63) / 64, 0);
+
+    for (int begin = 0; begin < n; ) {
+        int end = begin + 1;
+        while (end < n && label_[end] == label_[begin])
+            ++end;
+        if (options.mode == NmsMode::SoftLinear || options.mode == NmsMode::SoftGaussian)
+            Soft(begin, end, options, keep);
+        else
+            Greedy(begin, end, options, keep);
+        begin = end;
+    }
+}
+
+void NmsEngine::Greedy(int begin, int end, const c_nms_options& options, std::vector<c_nms_keep>* keep) {
+    const bool weighted = options.mode == NmsMode::ScoreWeighted;
+    for (int i = begin; i < end; ++i) {
+        if (removed_[i >> 6] & (1ull << (i & 63)))
+            continue;
+
+        c_nms_keep k;
+        k.index = order_[i];
+        k.score = score_[i];
+
+        // Blocks start on a multiple of 8, so each block is one byte of a
+        // removed_ word.
+        cluster_.clear();
+        for (int j = (i + 1) & ~7; j < end; j += 8) {
+            uint32_t m = nms_overlap_block8(x1_.data(), y1_.data(), x2_.data(), y2_.data(), area_.data(), j,
+                x1_[i], y1_[i], x2_[i], y2_[i], area_[i], options.iou_threshold, options.inclusive);
+            if (j <= i)
+                m &= ~((1u << (i - j + 1)) - 1);
+            if (j + 8 > end)
+                m &= (1u << (end - j)) - 1;
+            m &= ~(uint32_t)((removed_[j >> 6] >> (j & 63)) & 0xff);
+            if (!m)
+                continue;
+            removed_[j >> 6] |= (uint64_t)m << (j & 63);
+            for (; m; m &= m - 1)
+                cluster_.push_back(j + lowest_bit(m));
+        }
+        k.neighbors = cluster_.size();
+
+        // Accumulate lowest score first, the order the multimap based nms2
+        // summed in, so score_sum thresholds behave identically.
+        k.score_sum = score_[i];
+        float wx1 = x1_[i] * score_[i], wy1 = y1_[i] * score_[i];
+        float wx2 = x2_[i] * score_[i], wy2 = y2_[i] * score_[i];
+        for (auto it = cluster_.rbegin(); it != cluster_.rend(); ++it) {
+            const int s = *it;
+            k.score_sum += score_[s];
+            if (weighted) {
+                wx1 += x1_[s] * score_[s];
+                wy1 += y1_[s] * score_[s];
+                wx2 += x2_[s] * score_[s];
+                wy2 += y2_[s] * score_[s];
+            }
+        }
+
+        if (weighted && k.score_sum > 0) {
+            k.x1 = wx1 / k.score_sum;
+            k.y1 = wy1 / k.score_sum;
+            k.x2 = wx2 / k.score_sum;
+            k.y2 = wy2 / k.score_sum;
+        }
+        else {
+            k.x1 = x1_[i];
+            k.y1 = y1_[i];
+            k.x2 = x2_[i];
+            k.y2 = y2_[i];
+        }
+        keep->push_back(k);
+    }
+}
+
+void NmsEngine::Soft(int begin, int end, const c_nms_options& options, std::vector<c_nms_keep>* keep) {
+    const bool gaussian = options.mode == NmsMode::SoftGaussian;
+    for (;;) {
+        // Scores change as boxes decay, so the next box is picked by argmax.
+        int best = -1;
+        for (int i = begin; i < end; ++i) {
+            if (removed_[i >> 6] & (1ull << (i & 63)))
+                continue;
+            if (best < 0 || score_[i] > score_[best])
+                best = i;
+        }
+        if (best < 0)
+            break;
+        removed_[best >> 6] |= 1ull << (best & 63);
+
+        c_nms_keep k;
+        k.index = order_[best];
+        k.neighbors = 0;
+        k.score = score_[best];
+        k.score_sum = score_[best];
+        k.x1 = x1_[best];
+        k.y1 = y1_[best];
+        k.x2 = x2_[best];
+        k.y2 = y2_[best];
+
+        for (int j = begin; j < end; ++j) {
+            if (removed_[j >> 6] & (1ull << (j & 63)))
+                continue;
+            float iou = box_iou(x1_[best], y1_[best], x2_[best], y2_[best], area_[best],
+                x1_[j], y1_[j], x2_[j], y2_[j], area_[j]);
+            if (!(iou > 0))
+                continue;
+            if (gaussian)
+                score_[j] *= std::exp(-iou * iou / options.soft_sigma);
+            else if (options.inclusive ? iou >= options.iou_threshold : iou > options.iou_threshold)
+                score_[j] *= 1.f - iou;
+            if (score_[j] < options.score_threshold) {
+                removed_[j >> 6] |= 1ull << (j & 63);
+                ++k.neighbors;
+                k.score_sum += score_[j];
+            }
+        }
+        keep->push_back(k);
+    }
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+enum class NmsMode {
+    Hard,           // classic greedy suppression
+    ScoreWeighted,  // greedy, kept box is the score-weighted mean of its cluster
+    SoftLinear,     // soft-NMS, overlapping scores scaled by (1 - iou)
+    SoftGaussian,   // soft-NMS, overlapping scores scaled by exp(-iou^2 / sigma)
+};
+
+// Parses "hard", "weighted", "soft_linear" or "soft" (gaussian).
+bool ParseNmsMode(const std::string& name, NmsMode* mode);
+
+struct c_nms_options {
+    NmsMode mode = NmsMode::Hard;
+    float iou_threshold = 0.4f;
+    // Suppress at iou >= threshold rather than iou > threshold.
+    bool inclusive = false;
+    float soft_sigma = 0.5f;
+    // Soft-NMS drops boxes whose decayed score falls below this.
+    float score_threshold = 0.001f;
+};
+
+// Boxes in structure-of-arrays form, corners as [x1,x2) x [y1,y2) like
+// cv::Rect. Keep one around and clear() it to reuse the storage.
+class NmsBoxes {
+public:
+    void clear();
+    void reserve(size_t n);
+    void push_back(float x1, float y1, float x2, float y2, float score, int label = 0);
+    size_t size() const { return score.size(); }
+
+    std::vector<float> x1, y1, x2, y2, area, score;
+    std::vector<int> label;
+};
+
+struct c_nms_keep {
+    int index;          // position in the input NmsBoxes
+    int neighbors;      // boxes this one suppressed
+    float score;        // final score (decayed under soft-NMS)
+    float score_sum;    // own score plus the scores it suppressed
+    float x1, y1, x2, y2;
+};
+
+// Greedy non maximum suppression over an NmsBoxes set. Boxes only suppress
+// boxes with the same label, so every class is handled in one call. The
+// result is ordered by label, then by descending score. Scratch buffers are
+// kept between calls; use one engine per thread.
+class NmsEngine {
+public:
+    void Run(const NmsBoxes& boxes, const c_nms_options& options, std::vector<c_nms_keep>* keep);
+
+private:
+    void Greedy(int begin, int end, const c_nms_options& options, std::vector<c_nms_keep>* keep);
+    void Soft(int begin, int end, const c_nms_options& options, std::vector<c_nms_keep>* keep);
+
+    std::vector<int> order_;
+    std::vector<float> x1_, y1_, x2_, y2_, area_, score_;
+    std::vector<int> label_;
+    std::vector<uint64_t> removed_;
+    std::vector<int> cluster_;
+};
+
+// Overlap mask of box b against boxes [j, j+8) of the sorted arrays; bit k is
+// set when iou(b, j+k) exceeds (or with inclusive, reaches) thresh.
+uint32_t nms_overlap_block8(const float* x1, const float* y1, const float* x2, const float* y2,
+    const float* area, int j, float bx1, float by1, float bx2, float by2, float barea,
+    float thresh, bool inclusive);
+
+// Writes the indices of scores[i] >= threshold to out (room for n) and
+// returns how many there were.
+int nms_select_candidates(const float* scores, int n, float threshold, int* out);
+
+// Name of the instruction set nms_overlap_block8 was compiled for.
+const char* nms_engine_isa();
@@ -0,0 +1,235 @@
+#include "output_sink.hpp"
+
+#include <chrono>
+#include <cstring>
+
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/io/path.h"
+#include "tensorflow/core/lib/strings/str_util.h"
+#include "tensorflow/core/platform/logging.h"
+
+#include "cv_process.hpp"
+#include "trace.hpp"
+
+using tensorflow::Status;
+using tensorflow::string;
+
+string encoded_image_path(const string& path, const c_image_encode_options& options) {
+    if (options.format.empty())
+        return path;
+    const string ext = tensorflow::io::Extension(path).ToString();
+    const string stem = ext.empty() ? path : path.substr(0, path.size() - ext.size() - 1);
+    return stem + "." + options.format;
+}
+
+bool encode_image(const cv::Mat& mat, const string& path, const c_image_encode_options& options,
+    std::vector<unsigned char>* out) {
+    const string ext = tensorflow::str_util::Lowercase(tensorflow::io::Extension(path));
+    if (ext == "raw") {
+        const uint32_t header[3] = { (uint32_t)mat.cols, (uint32_t)mat.rows, (uint32_t)mat.channels() };
+        const size_t row_bytes = mat.cols * mat.elemSize();
+        out->resize(sizeof(header) + row_bytes * mat.rows);
+        memcpy(out->data(), header, sizeof(header));
+        for (int y = 0; y < mat.rows; ++y)
+            memcpy(out->data() + sizeof(header) + y * row_bytes, mat.ptr(y), row_bytes);
+        return true;
+    }
+    std::vector<int> params;
+    if (ext == "png")
+        params = { IMWRITE_PNG_COMPRESSION, options.png_level };
+    else if (ext == "jpg" || ext == "jpeg")
+        params = { IMWRITE_JPEG_QUALITY, options.jpeg_quality };
+    return cv::imencode("." + ext, mat, *out, params);
+}
+
+static void append_json_string(const string& text, string* out) {
+    out->push_back('"');
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out->push_back('\\');
+            out->push_back(c);
+        }
+        else if ((unsigned char)c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out->append(buf);
+        }
+        else {
+            out->push_back(c);
+        }
+    }
+    out->push_back('"');
+}
+
+Status DetectionSink::New(const c_sink_options& options, std::unique_ptr<DetectionSink>* sink) {
+    FILE* records = nullptr;
+    if (options.records_format == "jsonl" || options.records_format == "binary") {
+        if (options.records_path == "-") {
+            records = stdout;
+        }
+        else {
+            records = fopen(options.records_path.c_str(), options.records_format == "binary" ? "wb" : "w");
+            if (records == nullptr)
+                return tensorflow::errors::Unavailable("cannot write ", options.records_path);
+        }
+    }
+    else if (!options.records_format.empty()) {
+        return tensorflow::errors::InvalidArgument("unknown records format ", options.records_format);
+    }
+    if (!options.encode.format.empty() && options.encode.format != "png" && options.encode.format != "jpg" &&
+        options.encode.format != "raw")
+        return tensorflow::errors::InvalidArgument("unknown image format ", options.encode.format);
+    sink->reset(new DetectionSink(options, records));
+    return Status::OK();
+}
+
+DetectionSink::DetectionSink(const c_sink_options& options, FILE* records)
+    : options_(options), records_(records) {
+    thread_ = std::thread([this] { Loop(); });
+}
+
+DetectionSink::~DetectionSink() {
+    Close();
+}
+
+void DetectionSink::Write(const string& name, const std::vector<c_tf_detect_result>& dets, const cv::Mat* image,
+    const string& render_path, float render_scale) {
+    // Formatting buffers are per thread so steady state writes do not
+    // allocate.
+    thread_local string record;
+    thread_local string body;
+    if (records_ != nullptr) {
+        record.clear();
+        if (options_.records_format == "jsonl") {
+            detections_to_json(dets, &body);
+            record.append("{\"image\":");
+            append_json_string(name, &record);
+            record.push_back(',');
+            record.append(body, 1, string::npos);
+            record.push_back('\n');
+        }
+        else {
+            const uint32_t length = name.size();
+            record.append((const char*)&length, sizeof(length));
+            record.append(name);
+            detections_to_binary(dets, &body);
+            record.append(body);
+        }
+    }
+
+    bool render = image != nullptr && !render_path.empty() && options_.render_every > 0 &&
+        render_calls_++ % options_.render_every == 0;
+    if (render) {
+        // A queue slot is taken before the copy, so a skipped render costs
+        // nothing.
+        std::unique_lock<std::mutex> lock(mu_);
+        auto has_room = [this] {
+            return (int)renders_.size() + render_reserved_ + render_in_flight_ < options_.render_queue;
+        };
+        if (!has_room()) {
+            if (options_.skip_renders || options_.render_every > 1) {
+                ++render_skipped_;
+                render = false;
+            }
+            else {
+                TRACE_SCOPE("render_wait");
+                render_space_.wait(lock, [&] { return has_room() || closed_; });
+            }
+        }
+        if (render)
+            ++render_reserved_;
+    }
+
+    c_render_job job;
+    if (render) {
+        // The caller reuses its image buffer, so the renderer needs a copy.
+        TRACE_SCOPE("render_copy");
+        job.path = encoded_image_path(render_path, options_.encode);
+        job.image = image->clone();
+        job.dets = dets;
+        job.scale = render_scale;
+    }
+
+    std::unique_lock<std::mutex> lock(mu_);
+    if (records_ != nullptr) {
+        pending_.append(record);
+        ++records_written_;
+    }
+    if (render) {
+        --render_reserved_;
+        renders_.push_back(std::move(job));
+    }
+    if (pending_.size() >= options_.flush_bytes || render)
+        wake_.notify_one();
+}
+
+void DetectionSink::Loop() {
+    std::vector<unsigned char> encoded;
+    std::unique_lock<std::mutex> lock(mu_);
+    for (;;) {
+        wake_.wait_for(lock, std::chrono::milliseconds(options_.flush_ms), [this] {
+            return closed_ || !renders_.empty() || pending_.size() >= options_.flush_bytes;
+        });
+        writing_.clear();
+        writing_.swap(pending_);
+        std::deque<c_render_job> jobs;
+        jobs.swap(renders_);
+        render_in_flight_ = jobs.size();
+        const bool done = closed_;
+        lock.unlock();
+
+        if (!writing_.empty()) {
+            fwrite(writing_.data(), 1, writing_.size(), records_);
+            fflush(records_);
+        }
+        long long rendered = 0, failed = 0;
+        for (c_render_job& job : jobs) {
+            TRACE_SCOPE("render");
+            draw_detections(job.image, job.dets, job.scale);
+            FILE* file = nullptr;
+            bool ok = encode_image(job.image, job.path, options_.encode, &encoded) &&
+                (file = fopen(job.path.c_str(), "wb")) != nullptr;
+            if (file != nullptr) {
+                ok = fwrite(encoded.data(), 1, encoded.size(), file) == encoded.size();
+                ok = fclose(file) == 0 && ok;
+            }
+            if (ok) {
+                ++rendered;
+            }
+            else {
+                LOG(ERROR) << "Failed to write " << job.path;
+                ++failed;
+            }
+            // The slot frees once the copy is gone, not when the job is
+            // taken off the queue.
+            job.image.release();
+            lock.lock();
+            --render_in_flight_;
+            lock.unlock();
+            render_space_.notify_one();
+        }
+
+        lock.lock();
+        bytes_written_ += writing_.size();
+        rendered_ += rendered;
+        render_failed_ += failed;
+        if (done && pending_.empty() && renders_.empty())
+            break;
+    }
+}
+
+void DetectionSink::Close() {
+    {
+        std::unique_lock<std::mutex> lock(mu_);
+        if (closed_)
+            return;
+        closed_ = true;
+    }
+    wake_.notify_one();
+    render_space_.notify_all();
+    thread_.join();
+    if (records_ != nullptr && records_ != stdout)
+        fclose(records_);
+    LOG(INFO) << "Output: " << records_written_ << " records (" << bytes_written_ << " bytes), " << rendered_
+        << " images rendered, " << render_skipped_ << " renders skipped, " << render_failed_ << " failed";
+}
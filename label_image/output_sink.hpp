@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tensorflow/core/lib/core/status.h"
+
+#include "tf_detect.hpp"
+
+// How rendered images are encoded.
+struct c_image_encode_options {
+    // png, jpg or raw; empty encodes by the extension of the output path.
+    // raw is a 12 byte header (uint32 width, height, channels, little-endian)
+    // followed by the BGR pixels.
+    tensorflow::string format;
+    int png_level = 3;  // 0 (fastest) .. 9
+    int jpeg_quality = 95;
+};
+
+// Output path for a rendered image: path with its extension replaced by
+// options.format when one is set.
+tensorflow::string encoded_image_path(const tensorflow::string& path, const c_image_encode_options& options);
+
+// Encodes mat as the extension of path says (png, jpg/jpeg or raw).
+bool encode_image(const cv::Mat& mat, const tensorflow::string& path, const c_image_encode_options& options,
+    std::vector<unsigned char>* out);
+
+struct c_sink_options {
+    // Per image records, "jsonl" or "binary"; empty for none.
+    //   jsonl:  {"image":"<name>","detections":[...]} as detections_to_json
+    //   binary: uint32 name length, name, then detections_to_binary
+    tensorflow::string records_format;
+    // Where records go, "-" for stdout.
+    tensorflow::string records_path = "-";
+    // Render one image in every render_every, 0 for none.
+    int render_every = 1;
+    c_image_encode_options encode;
+    // Image copies held for rendering, queued or being encoded, so at most
+    // this many are alive at once. When full, the caller waits for
+    // room, unless renders are sampled (render_every > 1) or skip_renders is
+    // set; then the render is skipped rather than holding up the caller.
+    int render_queue = 16;
+    bool skip_renders = false;
+    // Buffered records are written once this many bytes are waiting, and at
+    // least every flush_ms.
+    size_t flush_bytes = 64 << 10;
+    int flush_ms = 200;
+};
+
+// Where detections go. Write only formats into memory; a writer thread does
+// all file I/O, drawing and encoding, so inference threads never wait on
+// output.
+class DetectionSink {
+public:
+    static tensorflow::Status New(const c_sink_options& options, std::unique_ptr<DetectionSink>* sink);
+    ~DetectionSink();
+
+    // Thread safe. image is copied only when this call is sampled for
+    // rendering; an empty render_path never renders. render_scale is as for
+    // render_detections.
+    void Write(const tensorflow::string& name, const std::vector<c_tf_detect_result>& dets, const cv::Mat* image,
+        const tensorflow::string& render_path, float render_scale = 1.f);
+
+    // Writes what is buffered, finishes queued renders and stops the writer.
+    void Close();
+
+private:
+    struct c_render_job {
+        tensorflow::string path;
+        cv::Mat image;
+        std::vector<c_tf_detect_result> dets;
+        float scale = 1.f;
+    };
+
+    DetectionSink(const c_sink_options& options, FILE* records);
+    void Loop();
+
+    const c_sink_options options_;
+    FILE* records_;
+    std::mutex mu_;
+    std::condition_variable wake_;
+    std::condition_variable render_space_;
+    tensorflow::string pending_;  // formatted records not yet written
+    tensorflow::string writing_;  // swapped with pending_ by the writer
+    std::deque<c_render_job> renders_;
+    // Queue slots taken by callers still copying their image.
+    int render_reserved_ = 0;
+    // Jobs the writer took off renders_ and has not encoded yet; their
+    // images are still held, so they count against render_queue too.
+    int render_in_flight_ = 0;
+    bool closed_ = false;
+    std::atomic<long long> render_calls_{ 0 };
+    long long records_written_ = 0;
+    long long rendered_ = 0;
+    long long render_skipped_ = 0;
+    long long render_failed_ = 0;
+    long long bytes_written_ = 0;
+    std::thread thread_;
+};
@@ -0,0 +1,323 @@
+#include "pipeline.hpp"
+
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <memory>
+
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/lib/io/path.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/logging.h"
+
+#include "arena.hpp"
+#include "cv_process.hpp"
+#include "shape_buckets.hpp"
+#include "tf_detect.hpp"
+#include "trace.hpp"
+
+using tensorflow::Status;
+using tensorflow::Tensor;
+using tensorflow::string;
+
+namespace {
+
+struct c_pipeline_item {
+    size_t index = 0;
+    cv::Mat mat;      // decoded source image, kept for rendering
+    cv::Size original;  // full resolution size, larger than mat after a reduced decode
+    Tensor input;     // preprocessed {1,H,W,3} network input
+    c_image_transform transform;
+    tensorflow::uint64 cache_key = 0;
+};
+
+struct c_pipeline_batch {
+    std::vector<c_pipeline_item> items;
+    std::vector<Tensor> outputs;
+};
+
+struct c_stage_stats {
+    explicit c_stage_stats(const char* n) : name(n) {}
+    const char* name;
+    std::atomic<long long> items{ 0 };
+    std::atomic<long long> busy_ns{ 0 };
+};
+
+// Adds the lifetime of the scope to a stage's busy time.
+class StageTimer {
+public:
+    explicit StageTimer(c_stage_stats* stats)
+        : stats_(stats), start_(std::chrono::steady_clock::now()) {}
+    ~StageTimer() {
+        stats_->busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_).count();
+    }
+private:
+    c_stage_stats* stats_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Keeps the first error and tears the pipeline down so every stage drains.
+class PipelineState {
+public:
+    void Fail(const Status& s, const std::vector<std::function<void()>>& closers) {
+        {
+            std::unique_lock<std::mutex> lock(mu_);
+            if (status_.ok())
+                status_ = s;
+        }
+        for (auto& close : closers)
+            close();
+    }
+    Status status() {
+        std::unique_lock<std::mutex> lock(mu_);
+        return status_;
+    }
+private:
+    std::mutex mu_;
+    Status status_;
+};
+
+void log_stage(const c_stage_stats& stats, int threads, double wall_ms,
+    double input_stall_ms, double output_stall_ms) {
+    const double busy_ms = stats.busy_ns / 1e6;
+    LOG(INFO) << "stage " << stats.name << ": threads=" << threads
+        << " items=" << stats.items
+        << " busy=" << busy_ms << "ms"
+        << " utilization=" << (wall_ms > 0 ? 100.0 * busy_ms / (wall_ms * threads) : 0) << "%"
+        << " input_stall=" << input_stall_ms << "ms"
+        << " output_stall=" << output_stall_ms << "ms";
+}
+
+template <typename T>
+void log_queue(const char* name, const BoundedQueue<T>& q) {
+    LOG(INFO) << "queue " << name << ": capacity=" << q.capacity()
+        << " max_depth=" << q.max_depth()
+        << " mean_depth=" << q.mean_depth();
+}
+
+}  // namespace
+
+Status RunPipeline(tensorflow::Session* session, const std::vector<string>& paths,
+    const c_pipeline_options& options) {
+    BoundedQueue<c_pipeline_item> decoded(options.queue_capacity);
+    BoundedQueue<c_pipeline_item> prepared(options.queue_capacity);
+    BoundedQueue<c_pipeline_batch> inferred(options.queue_capacity);
+
+    c_stage_stats decode_stats("decode");
+    c_stage_stats preprocess_stats("preprocess");
+    c_stage_stats infer_stats("infer");
+    c_stage_stats postprocess_stats("postprocess");
+
+    std::atomic<size_t> next_path{ 0 };
+    std::atomic<int> decoders_left{ options.decode_threads };
+    std::atomic<int> preprocessors_left{ options.preprocess_threads };
+    std::atomic<int> inferers_left{ options.infer_threads };
+    std::atomic<long long> cached_images{ 0 };
+
+    PipelineState state;
+    const std::vector<std::function<void()>> close_all = {
+        [&] { next_path = paths.size(); },
+        [&] { decoded.Close(); },
+        [&] { prepared.Close(); },
+        [&] { inferred.Close(); },
+    };
+
+    TraceGauge decoded_depth("queue_depth{queue=\"decoded\"}", [&] { return (double)decoded.depth(); });
+    TraceGauge prepared_depth("queue_depth{queue=\"prepared\"}", [&] { return (double)prepared.depth(); });
+    TraceGauge inferred_depth("queue_depth{queue=\"inferred\"}", [&] { return (double)inferred.depth(); });
+
+    const auto wall_start = std::chrono::steady_clock::now();
+    {
+        tensorflow::Env* env = tensorflow::Env::Default();
+        tensorflow::thread::ThreadPool decode_pool(env, "decode", options.decode_threads);
+        tensorflow::thread::ThreadPool preprocess_pool(env, "preprocess", options.preprocess_threads);
+        tensorflow::thread::ThreadPool infer_pool(env, "infer", options.infer_threads);
+        tensorflow::thread::ThreadPool postprocess_pool(env, "postprocess", options.postprocess_threads);
+
+        for (int t = 0; t < options.decode_threads; ++t) {
+            decode_pool.Schedule([&] {
+                const c_preprocess_options& pre = options.preprocess;
+                const cv::Size reduce = reduced_decode_size(pre);
+                std::vector<unsigned char> file_buffer;
+                std::vector<c_tf_detect_result> dets;
+                cv::Mat scratch;
+                for (size_t i = next_path++; i < paths.size(); i = next_path++) {
+                    c_pipeline_item item;
+                    item.index = i;
+                    bool read, cached = false;
+                    {
+                        StageTimer timer(&decode_stats);
+                        TRACE_SCOPE("decode");
+                        read = read_file_into(paths[i], &file_buffer);
+                        if (read && options.cache != nullptr) {
+                            item.cache_key = options.cache->Key(file_buffer);
+                            cached = options.cache->Lookup(item.cache_key, &dets);
+                        }
+                        if (read && !cached) {
+                            read = cvprocess::decodeForInput(file_buffer, reduce.width, reduce.height, item.mat,
+                                &item.original) && apply_image_ops(pre, &item.mat, &scratch);
+                        }
+                    }
+                    if (!read) {
+                        LOG(ERROR) << "Failed to read image " << paths[i];
+                        continue;
+                    }
+                    if (cached) {
+                        LOG(INFO) << paths[i] << ": " << dets.size() << " detections (cached)";
+                        if (options.sink != nullptr)
+                            options.sink->Write(paths[i], dets, nullptr, string());
+                        ++cached_images;
+                        trace_count("images", 1);
+                        continue;
+                    }
+                    ++decode_stats.items;
+                    if (!decoded.Push(std::move(item)))
+                        break;
+                }
+                if (--decoders_left == 0)
+                    decoded.Close();
+            });
+        }
+
+        for (int t = 0; t < options.preprocess_threads; ++t) {
+            preprocess_pool.Schedule([&] {
+                const c_preprocess_options& pre = options.preprocess;
+                c_pipeline_item item;
+                cv::Mat scratch;
+                while (decoded.Pop(&item)) {
+                    bool ok;
+                    {
+                        StageTimer timer(&preprocess_stats);
+                        TRACE_SCOPE("preprocess");
+                        const cv::Size shape = pick_input_shape(pre, item.original);
+                        item.input = Tensor(input_tensor_allocator(), tensorflow::DT_FLOAT,
+                            tensorflow::TensorShape({ 1, shape.height, shape.width, 3 }));
+                        ok = preprocess_into_tensor(item.mat, pre, 0, &item.input, &scratch, &item.transform,
+                            item.original);
+                    }
+                    if (!ok) {
+                        LOG(ERROR) << "Failed to preprocess image " << paths[item.index];
+                        continue;
+                    }
+                    ++preprocess_stats.items;
+                    if (!prepared.Push(std::move(item)))
+                        break;
+                }
+                if (--preprocessors_left == 0)
+                    prepared.Close();
+            });
+        }
+
+        for (int t = 0; t < options.infer_threads; ++t) {
+            infer_pool.Schedule([&] {
+                c_pipeline_item item;
+                std::vector<c_pipeline_item> waiting;
+                bool stop = false;
+                while (!stop && prepared.Pop(&item)) {
+                    // Block for the first image only, then fill the batch with
+                    // whatever is already waiting so a slow trickle is not held back.
+                    waiting.clear();
+                    waiting.push_back(std::move(item));
+                    while ((int)waiting.size() < options.batch_size && prepared.TryPop(&item))
+                        waiting.push_back(std::move(item));
+
+                    // Images in different shape buckets cannot share a run.
+                    while (!stop && !waiting.empty()) {
+                        c_pipeline_batch batch;
+                        const tensorflow::TensorShape shape = waiting[0].input.shape();
+                        size_t kept = 0;
+                        for (c_pipeline_item& w : waiting) {
+                            if (w.input.shape() == shape)
+                                batch.items.push_back(std::move(w));
+                            else
+                                waiting[kept++] = std::move(w);
+                        }
+                        waiting.resize(kept);
+
+                        Status run_status;
+                        {
+                            StageTimer timer(&infer_stats);
+                            TRACE_SCOPE("infer");
+                            const int n = batch.items.size();
+                            Tensor input = batch.items[0].input;
+                            if (n > 1) {
+                                const tensorflow::int64 slot = shape.num_elements();
+                                input = Tensor(input_tensor_allocator(), tensorflow::DT_FLOAT,
+                                    tensorflow::TensorShape({ n, shape.dim_size(1), shape.dim_size(2), 3 }));
+                                for (int b = 0; b < n; ++b) {
+                                    memcpy(input.flat<float>().data() + b * slot,
+                                        batch.items[b].input.flat<float>().data(), slot * sizeof(float));
+                                }
+                            }
+                            run_status = TracedRun(session, { {options.input_layer, input} },
+                                options.output_layers, &batch.outputs);
+                        }
+                        if (!run_status.ok()) {
+                            LOG(ERROR) << "Running model failed: " << run_status;
+                            state.Fail(run_status, close_all);
+                            stop = true;
+                            break;
+                        }
+                        note_inference_done();
+                        infer_stats.items += batch.items.size();
+                        if (!inferred.Push(std::move(batch)))
+                            stop = true;
+                    }
+                }
+                if (--inferers_left == 0)
+                    inferred.Close();
+            });
+        }
+
+        for (int t = 0; t < options.postprocess_threads; ++t) {
+            postprocess_pool.Schedule([&] {
+                c_pipeline_batch batch;
+                DetectionDecoder decoder(options.top_k);
+                std::vector<c_tf_detect_result> dst;
+                while (inferred.Pop(&batch)) {
+                    StageTimer timer(&postprocess_stats);
+                    TRACE_SCOPE("postprocess");
+                    for (size_t b = 0; b < batch.items.size(); ++b) {
+                        c_pipeline_item& item = batch.items[b];
+
+                        decoder.Decode(batch.outputs[0], batch.outputs[1], batch.outputs[2], b,
+                            item.transform, options.threshold);
+                        decoder.Suppress(options.nms, &dst);
+                        if (options.cache != nullptr)
+                            options.cache->Insert(item.cache_key, dst);
+
+                        LOG(INFO) << paths[item.index] << ": " << dst.size() << " detections";
+                        if (options.sink != nullptr) {
+                            const string& path = paths[item.index];
+                            options.sink->Write(path, dst, &item.mat, options.out_dir.empty() ? string() :
+                                tensorflow::io::JoinPath(options.out_dir, tensorflow::io::Basename(path)),
+                                (float)item.mat.cols / item.original.width);
+                        }
+                        ++postprocess_stats.items;
+                        trace_count("images", 1);
+                    }
+                }
+            });
+        }
+        // The pools join their workers on destruction.
+    }
+    const double wall_ms = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - wall_start).count();
+
+    // A stage's input stall is time its workers sat on an empty queue
+    // (starved), its output stall is time they sat on a full one (backpressure).
+    log_stage(decode_stats, options.decode_threads, wall_ms, 0, decoded.push_stall_ms());
+    log_stage(preprocess_stats, options.preprocess_threads, wall_ms, decoded.pop_stall_ms(), prepared.push_stall_ms());
+    log_stage(infer_stats, options.infer_threads, wall_ms, prepared.pop_stall_ms(), inferred.push_stall_ms());
+    log_stage(postprocess_stats, options.postprocess_threads, wall_ms, inferred.pop_stall_ms(), 0);
+    log_queue("decoded", decoded);
+    log_queue("prepared", prepared);
+    log_queue("inferred", inferred);
+    const long long images = postprocess_stats.items + cached_images;
+    LOG(INFO) << "pipeline: " << images << " images (" << cached_images << " cached) in " << wall_ms << "ms ("
+        << (wall_ms > 0 ? images * 1000.0 / wall_ms : 0) << " images/sec)";
+
+    return state.status();
+}
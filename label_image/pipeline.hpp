@@ -0,0 +1,184 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/public/session.h"
+
+#include "output_sink.hpp"
+#include "result_cache.hpp"
+#include "tf_detect.hpp"
+
+// Blocking FIFO with a fixed capacity. Push waits while the queue is full and
+// Pop waits while it is empty, so a slow consumer throttles its producers.
+// Time spent blocked on either side is accumulated for backpressure reports.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity_(capacity ? capacity : 1) {}
+
+    // Returns false if the queue was closed before the item could be added.
+    bool Push(T item) {
+        std::unique_lock<std::mutex> lock(mu_);
+        if (items_.size() >= capacity_ && !closed_) {
+            auto start = std::chrono::steady_clock::now();
+            not_full_.wait(lock, [this] { return items_.size() < capacity_ || closed_; });
+            push_stall_ += std::chrono::steady_clock::now() - start;
+        }
+        if (closed_)
+            return false;
+        items_.push_back(std::move(item));
+        depth_sum_ += items_.size();
+        ++pushes_;
+        if (items_.size() > max_depth_)
+            max_depth_ = items_.size();
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // Returns false once the queue is closed and drained.
+    bool Pop(T* item) {
+        std::unique_lock<std::mutex> lock(mu_);
+        if (items_.empty() && !closed_) {
+            auto start = std::chrono::steady_clock::now();
+            not_empty_.wait(lock, [this] { return !items_.empty() || closed_; });
+            pop_stall_ += std::chrono::steady_clock::now() - start;
+        }
+        if (items_.empty())
+            return false;
+        *item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    // Non-blocking Push; returns false if the queue is full or closed.
+    bool TryPush(T item) {
+        std::unique_lock<std::mutex> lock(mu_);
+        if (closed_ || items_.size() >= capacity_)
+            return false;
+        items_.push_back(std::move(item));
+        depth_sum_ += items_.size();
+        ++pushes_;
+        if (items_.size() > max_depth_)
+            max_depth_ = items_.size();
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // Push that never blocks: a full queue drops its oldest item to make
+    // room, and *dropped_oldest says whether it had to. Returns false if
+    // the queue is closed.
+    bool PushDropOldest(T item, bool* dropped_oldest) {
+        std::unique_lock<std::mutex> lock(mu_);
+        *dropped_oldest = false;
+        if (closed_)
+            return false;
+        if (items_.size() >= capacity_) {
+            items_.pop_front();
+            *dropped_oldest = true;
+        }
+        items_.push_back(std::move(item));
+        depth_sum_ += items_.size();
+        ++pushes_;
+        if (items_.size() > max_depth_)
+            max_depth_ = items_.size();
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // Non-blocking variant used to top up a batch with what is already queued.
+    bool TryPop(T* item) {
+        std::unique_lock<std::mutex> lock(mu_);
+        if (items_.empty())
+            return false;
+        *item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    // Pop that gives up at deadline; false on timeout or once closed and
+    // drained. Used to hold a batch open for late arrivals.
+    bool PopUntil(T* item, std::chrono::steady_clock::time_point deadline) {
+        std::unique_lock<std::mutex> lock(mu_);
+        if (!not_empty_.wait_until(lock, deadline, [this] { return !items_.empty() || closed_; }) ||
+            items_.empty())
+            return false;
+        *item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    // Wakes all waiters; pending items can still be popped.
+    void Close() {
+        std::unique_lock<std::mutex> lock(mu_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+    size_t capacity() const { return capacity_; }
+    size_t depth() const { std::unique_lock<std::mutex> lock(mu_); return items_.size(); }
+    size_t max_depth() const { std::unique_lock<std::mutex> lock(mu_); return max_depth_; }
+    double mean_depth() const {
+        std::unique_lock<std::mutex> lock(mu_);
+        return pushes_ ? (double)depth_sum_ / pushes_ : 0.0;
+    }
+    double push_stall_ms() const {
+        std::unique_lock<std::mutex> lock(mu_);
+        return std::chrono::duration<double, std::milli>(push_stall_).count();
+    }
+    double pop_stall_ms() const {
+        std::unique_lock<std::mutex> lock(mu_);
+        return std::chrono::duration<double, std::milli>(pop_stall_).count();
+    }
+
+private:
+    const size_t capacity_;
+    mutable std::mutex mu_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+    std::deque<T> items_;
+    bool closed_ = false;
+    size_t max_depth_ = 0;
+    size_t depth_sum_ = 0;
+    size_t pushes_ = 0;
+    std::chrono::steady_clock::duration push_stall_{0};
+    std::chrono::steady_clock::duration pop_stall_{0};
+};
+
+struct c_pipeline_options {
+    int decode_threads = 2;
+    int preprocess_threads = 2;
+    int infer_threads = 1;
+    int postprocess_threads = 2;
+    int queue_capacity = 16;
+    int batch_size = 1;
+    c_preprocess_options preprocess;
+    float threshold = 0.6f;
+    c_nms_options nms;
+    int top_k = 0;
+    tensorflow::string input_layer = "image_input";
+    std::vector<tensorflow::string> output_layers;
+    // Rendered images go here, through sink; empty skips rendering.
+    tensorflow::string out_dir;
+    // Receives every image's detections and the renders for out_dir; none
+    // when null.
+    DetectionSink* sink = nullptr;
+    // Images whose detections are cached skip every stage after reading;
+    // they go to sink unrendered. None when null.
+    ResultCache* cache = nullptr;
+};
+
+// Runs decode -> preprocess -> infer -> postprocess over the images, each
+// stage on its own workers joined by bounded queues, and logs per-stage
+// throughput and stall times when done.
+tensorflow::Status RunPipeline(tensorflow::Session* session, const std::vector<tensorflow::string>& paths,
+    const c_pipeline_options& options);
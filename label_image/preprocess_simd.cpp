@@ -0,0 +1,100 @@
+#include "preprocess_simd.hpp"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+
+void normalize_u8c3_ref(const unsigned char* src, int pixels, const float mean[3], const float inv_std[3],
+    bool swap_rb, float* dst) {
+    const int c0 = swap_rb ? 2 : 0;
+    const int c2 = swap_rb ? 0 : 2;
+    for (int i = 0; i < pixels; ++i, src += 3, dst += 3) {
+        dst[0] = (src[c0] - mean[c0]) * inv_std[c0];
+        dst[1] = (src[1] - mean[1]) * inv_std[1];
+        dst[2] = (src[c2] - mean[c2]) * inv_std[c2];
+    }
+}
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+
+namespace {
+
+// Byte shuffle that keeps (or swaps channels 0 and 2 of) four packed pixels
+// in the low 12 bytes of a 16-byte register.
+inline __m128i pixel_shuffle(bool swap_rb) {
+    return swap_rb
+        ? _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, -1, -1, -1, -1)
+        : _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, -1, -1, -1, -1);
+}
+
+}  // namespace
+
+#endif
+
+void normalize_u8c3(const unsigned char* src, int pixels, const float mean[3], const float inv_std[3],
+    bool swap_rb, float* dst) {
+    int i = 0;
+#if defined(__AVX2__) || defined(__SSE4_1__)
+    // Channel constants in output order; a run of 4 (SSE) or 8 (AVX2) pixels
+    // spans 12 or 24 floats, so the per-lane pattern repeats every 3 registers.
+    const float m[3] = { mean[swap_rb ? 2 : 0], mean[1], mean[swap_rb ? 0 : 2] };
+    const float s[3] = { inv_std[swap_rb ? 2 : 0], inv_std[1], inv_std[swap_rb ? 0 : 2] };
+    const __m128i shuffle = pixel_shuffle(swap_rb);
+#if defined(__AVX2__)
+    const __m256 m0 = _mm256_setr_ps(m[0], m[1], m[2], m[0], m[1], m[2], m[0], m[1]);
+    const __m256 m1 = _mm256_setr_ps(m[2], m[0], m[1], m[2], m[0], m[1], m[2], m[0]);
+    const __m256 m2 = _mm256_setr_ps(m[1], m[2], m[0], m[1], m[2], m[0], m[1], m[2]);
+    const __m256 s0 = _mm256_setr_ps(s[0], s[1], s[2], s[0], s[1], s[2], s[0], s[1]);
+    const __m256 s1 = _mm256_setr_ps(s[2], s[0], s[1], s[2], s[0], s[1], s[2], s[0]);
+    const __m256 s2 = _mm256_setr_ps(s[1], s[2], s[0], s[1], s[2], s[0], s[1], s[2]);
+    // 8 pixels per step; the second 16-byte load reaches 28 bytes in, so stop
+    // while 10 pixels are still left.
+    for (; i + 10 <= pixels; i += 8) {
+        const unsigned char* p = src + i * 3;
+        float* o = dst + i * 3;
+        __m128i lo = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p), shuffle);
+        __m128i hi = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 12)), shuffle);
+        __m128i b0 = lo;
+        __m128i b1 = _mm_unpacklo_epi32(_mm_srli_si128(lo, 8), hi);
+        __m128i b2 = _mm_srli_si128(hi, 4);
+        __m256 f0 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(b0));
+        __m256 f1 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(b1));
+        __m256 f2 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(b2));
+        _mm256_storeu_ps(o, _mm256_mul_ps(_mm256_sub_ps(f0, m0), s0));
+        _mm256_storeu_ps(o + 8, _mm256_mul_ps(_mm256_sub_ps(f1, m1), s1));
+        _mm256_storeu_ps(o + 16, _mm256_mul_ps(_mm256_sub_ps(f2, m2), s2));
+    }
+#endif
+    const __m128 n0 = _mm_setr_ps(m[0], m[1], m[2], m[0]);
+    const __m128 n1 = _mm_setr_ps(m[1], m[2], m[0], m[1]);
+    const __m128 n2 = _mm_setr_ps(m[2], m[0], m[1], m[2]);
+    const __m128 t0 = _mm_setr_ps(s[0], s[1], s[2], s[0]);
+    const __m128 t1 = _mm_setr_ps(s[1], s[2], s[0], s[1]);
+    const __m128 t2 = _mm_setr_ps(s[2], s[0], s[1], s[2]);
+    // 4 pixels per step out of a 16-byte load, so stop while 6 are left.
+    for (; i + 6 <= pixels; i += 4) {
+        const unsigned char* p = src + i * 3;
+        float* o = dst + i * 3;
+        __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p), shuffle);
+        __m128 f0 = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(v));
+        __m128 f1 = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(v, 4)));
+        __m128 f2 = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(v, 8)));
+        _mm_storeu_ps(o, _mm_mul_ps(_mm_sub_ps(f0, n0), t0));
+        _mm_storeu_ps(o + 4, _mm_mul_ps(_mm_sub_ps(f1, n1), t1));
+        _mm_storeu_ps(o + 8, _mm_mul_ps(_mm_sub_ps(f2, n2), t2));
+    }
+#endif
+    normalize_u8c3_ref(src + i * 3, pixels - i, mean, inv_std, swap_rb, dst + i * 3);
+}
+
+const char* normalize_u8c3_isa() {
+#if defined(__AVX2__)
+    return "avx2";
+#elif defined(__SSE4_1__)
+    return "sse4.1";
+#else
+    return "scalar";
+#endif
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+// Converts interleaved 3-channel uint8 pixels to float while normalizing,
+// dst[c] = (src[c] - mean[c]) * inv_std[c]. mean and inv_std are given in
+// source channel order; with swap_rb the first and third channels are
+// exchanged on the way out (BGR -> RGB). Uses AVX2 or SSE4.1 when the
+// translation unit is built with them, scalar code otherwise.
+void normalize_u8c3(const unsigned char* src, int pixels, const float mean[3], const float inv_std[3],
+    bool swap_rb, float* dst);
+
+// Plain scalar version of normalize_u8c3, kept as the reference for checks.
+void normalize_u8c3_ref(const unsigned char* src, int pixels, const float mean[3], const float inv_std[3],
+    bool swap_rb, float* dst);
+
+// Name of the instruction set normalize_u8c3 was compiled for.
+const char* normalize_u8c3_isa();
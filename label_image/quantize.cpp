@@ -0,0 +1,241 @@
+#include "quantize.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+
+#include "tensorflow/core/framework/tensor.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/strings/str_util.h"
+#include "tensorflow/core/lib/strings/strcat.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/logging.h"
+#include "tensorflow/core/public/session_options.h"
+#include "tensorflow/tools/graph_transforms/transform_graph.h"
+
+#include "arena.hpp"
+#include "shape_buckets.hpp"
+
+using tensorflow::GraphDef;
+using tensorflow::NodeDef;
+using tensorflow::Status;
+using tensorflow::Tensor;
+using tensorflow::string;
+
+const char* const kQuantizeTransforms =
+    "add_default_attributes "
+    "strip_unused_nodes(type=float) "
+    "remove_nodes(op=Identity, op=CheckNumerics) "
+    "fold_constants(ignore_errors=true) "
+    "fold_batch_norms "
+    "fold_old_batch_norms "
+    "quantize_weights "
+    "quantize_nodes "
+    "strip_unused_nodes "
+    "sort_by_execution_order";
+
+// Decodes path and preprocesses it into a {1,H,W,3} tensor of its shape
+// bucket.
+static bool prepare_input(const string& path, const c_preprocess_options& preprocess,
+    std::vector<unsigned char>* file_buffer, cv::Mat* mat, cv::Mat* scratch, Tensor* input,
+    c_image_transform* transform) {
+    if (!read_image_into(path, file_buffer, mat) || !apply_image_ops(preprocess, mat, scratch))
+        return false;
+    const cv::Size shape = pick_input_shape(preprocess, mat->size());
+    if (input->dims() != 4 || input->dim_size(1) != shape.height || input->dim_size(2) != shape.width)
+        *input = Tensor(tensorflow::DT_FLOAT, { 1, shape.height, shape.width, 3 });
+    return preprocess_into_tensor(*mat, preprocess, 0, input, scratch, transform);
+}
+
+Status FreezeRequantizationRanges(const std::map<string, std::pair<float, float> >& ranges, GraphDef* graph_def) {
+    GraphDef frozen;
+    std::map<string, string> replaced;  // "name:k" of a range output -> constant
+    for (const NodeDef& node : graph_def->node()) {
+        auto range = ranges.find(node.name());
+        if (node.op() != "RequantizationRange" || range == ranges.end()) {
+            *frozen.add_node() = node;
+            continue;
+        }
+        const float values[2] = { range->second.first, range->second.second };
+        for (int k = 0; k < 2; ++k) {
+            NodeDef* constant = frozen.add_node();
+            constant->set_name(node.name() + (k == 0 ? "/frozen_min" : "/frozen_max"));
+            constant->set_op("Const");
+            constant->set_device(node.device());
+            (*constant->mutable_attr())["dtype"].set_type(tensorflow::DT_FLOAT);
+            Tensor value(tensorflow::DT_FLOAT, tensorflow::TensorShape({}));
+            value.scalar<float>()() = values[k];
+            value.AsProtoTensorContent((*constant->mutable_attr())["value"].mutable_tensor());
+            replaced[tensorflow::strings::StrCat(node.name(), ":", k)] = constant->name();
+        }
+        replaced[node.name()] = node.name() + "/frozen_min";
+    }
+    for (NodeDef& node : *frozen.mutable_node()) {
+        for (int i = 0; i < node.input_size(); ++i) {
+            auto it = replaced.find(node.input(i));
+            if (it != replaced.end())
+                node.set_input(i, it->second);
+            else if (node.input(i)[0] == '^' && ranges.count(node.input(i).substr(1)))
+                return tensorflow::errors::Unimplemented("control dependency on ", node.input(i));
+        }
+    }
+    frozen.mutable_versions()->CopyFrom(graph_def->versions());
+    frozen.mutable_library()->CopyFrom(graph_def->library());
+    graph_def->Swap(&frozen);
+    return Status::OK();
+}
+
+Status QuantizeGraph(const string& graph_file_name, const c_quantize_options& options, GraphDef* graph_def) {
+    tensorflow::Env* env = tensorflow::Env::Default();
+    const tensorflow::uint64 start_us = env->NowMicros();
+    if (options.inputs.size() != 1)
+        return tensorflow::errors::InvalidArgument("quantization needs exactly one input");
+    TF_RETURN_IF_ERROR(ReadBinaryProto(env, graph_file_name, graph_def));
+    const int nodes_before = graph_def->node_size();
+
+    tensorflow::graph_transforms::TransformParameters transforms;
+    TF_RETURN_IF_ERROR(tensorflow::graph_transforms::ParseTransformParameters(options.transforms, &transforms));
+    TF_RETURN_IF_ERROR(tensorflow::graph_transforms::TransformGraph(
+        options.inputs, options.outputs, transforms, graph_def));
+
+    std::vector<string> range_outputs;
+    std::map<string, std::pair<float, float> > ranges;
+    int quantized_ops = 0;
+    for (const NodeDef& node : graph_def->node()) {
+        if (node.op() == "RequantizationRange") {
+            range_outputs.push_back(node.name() + ":0");
+            range_outputs.push_back(node.name() + ":1");
+            ranges[node.name()] = std::make_pair(std::numeric_limits<float>::max(),
+                std::numeric_limits<float>::lowest());
+        }
+        if (tensorflow::str_util::StartsWith(node.op(), "Quantized"))
+            ++quantized_ops;
+    }
+    LOG(INFO) << "quantized graph: " << nodes_before << " -> " << graph_def->node_size() << " nodes, "
+        << quantized_ops << " quantized ops, " << ranges.size() << " requantization ranges in "
+        << (env->NowMicros() - start_us) / 1000.0 << "ms";
+    if (options.calibration_images.empty() || ranges.empty())
+        return Status::OK();
+
+    // Fetching only the ranges runs just the part of the graph they need.
+    std::unique_ptr<tensorflow::Session> session(tensorflow::NewSession(tensorflow::SessionOptions()));
+    TF_RETURN_IF_ERROR(session->Create(*graph_def));
+    std::vector<unsigned char> file_buffer;
+    cv::Mat mat, scratch;
+    Tensor input;
+    c_image_transform transform;
+    std::vector<Tensor> outputs;
+    int calibrated = 0;
+    for (const string& path : options.calibration_images) {
+        if (!prepare_input(path, options.preprocess, &file_buffer, &mat, &scratch, &input, &transform)) {
+            LOG(ERROR) << "Failed to read image " << path;
+            continue;
+        }
+        TF_RETURN_IF_ERROR(session->Run({ { options.inputs[0], input } }, range_outputs, {}, &outputs));
+        for (size_t i = 0; i < outputs.size(); i += 2) {
+            std::pair<float, float>& range = ranges[range_outputs[i].substr(0, range_outputs[i].size() - 2)];
+            range.first = std::min(range.first, outputs[i].scalar<float>()());
+            range.second = std::max(range.second, outputs[i + 1].scalar<float>()());
+        }
+        ++calibrated;
+    }
+    session->Close();
+    if (calibrated == 0)
+        return tensorflow::errors::InvalidArgument("no calibration image could be read");
+    TF_RETURN_IF_ERROR(FreezeRequantizationRanges(ranges, graph_def));
+    LOG(INFO) << "froze " << ranges.size() << " requantization ranges over " << calibrated
+        << " calibration images in " << (env->NowMicros() - start_us) / 1000.0 << "ms";
+    return Status::OK();
+}
+
+static float iou(const cv::Rect& a, const cv::Rect& b) {
+    const int inter = (a & b).area();
+    const int uni = a.area() + b.area() - inter;
+    return uni > 0 ? (float)inter / uni : 0.f;
+}
+
+static void flatten(const std::map<int, std::vector<c_tf_detect_result> >& by_class,
+    std::vector<c_tf_detect_result>* dets) {
+    dets->clear();
+    for (const auto& it : by_class)
+        dets->insert(dets->end(), it.second.begin(), it.second.end());
+}
+
+Status CompareGraphs(tensorflow::Session* reference, tensorflow::Session* candidate,
+    const std::vector<string>& paths, const c_preprocess_options& preprocess, float threshold,
+    const c_nms_options& nms, const string& input_layer, const std::vector<string>& output_layers,
+    float match_iou, c_graph_comparison* result) {
+    *result = c_graph_comparison();
+    tensorflow::Session* sessions[2] = { reference, candidate };
+    double* run_s[2] = { &result->reference_run_s, &result->candidate_run_s };
+    std::vector<c_tf_detect_result> dets[2];
+    std::map<int, std::vector<c_tf_detect_result> > candidates, suppressed;
+    std::vector<unsigned char> file_buffer;
+    cv::Mat mat, scratch;
+    Tensor input;
+    c_image_transform transform;
+    std::vector<Tensor> outputs;
+    std::vector<bool> used;
+    bool warm = false;
+    for (const string& path : paths) {
+        if (!prepare_input(path, preprocess, &file_buffer, &mat, &scratch, &input, &transform)) {
+            LOG(ERROR) << "Failed to read image " << path;
+            continue;
+        }
+        for (int s = 0; s < 2; ++s) {
+            if (!warm)
+                TF_RETURN_IF_ERROR(sessions[s]->Run({ { input_layer, input } }, output_layers, {}, &outputs));
+            const auto start = std::chrono::steady_clock::now();
+            TF_RETURN_IF_ERROR(sessions[s]->Run({ { input_layer, input } }, output_layers, {}, &outputs));
+            *run_s[s] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            candidates.clear();
+            suppressed.clear();
+            prepare_tf_detect_result(outputs[0], outputs[1], outputs[2], 0, transform, threshold, candidates);
+            nms_plus(candidates, suppressed, nms);
+            flatten(suppressed, &dets[s]);
+        }
+        warm = true;
+
+        // Greedy matching, best reference boxes first.
+        std::sort(dets[0].begin(), dets[0].end(),
+            [](const c_tf_detect_result& a, const c_tf_detect_result& b) { return a.score > b.score; });
+        used.assign(dets[1].size(), false);
+        for (const c_tf_detect_result& ref : dets[0]) {
+            int best = -1;
+            float best_iou = match_iou;
+            for (size_t j = 0; j < dets[1].size(); ++j) {
+                if (used[j] || dets[1][j].nclass != ref.nclass)
+                    continue;
+                const float overlap = iou(ref.r, dets[1][j].r);
+                if (overlap >= best_iou) {
+                    best = j;
+                    best_iou = overlap;
+                }
+            }
+            if (best < 0)
+                continue;
+            used[best] = true;
+            const float drift = std::fabs(dets[1][best].score - ref.score);
+            ++result->matched;
+            result->iou_sum += best_iou;
+            result->score_drift_sum += drift;
+            result->max_score_drift = std::max(result->max_score_drift, drift);
+        }
+        result->reference_boxes += dets[0].size();
+        result->candidate_boxes += dets[1].size();
+        ++result->images;
+    }
+
+    const long long boxes = result->reference_boxes + result->candidate_boxes;
+    const double matched = std::max(1LL, result->matched);
+    LOG(INFO) << "Compared " << result->images << " images: " << result->reference_boxes << " reference and "
+        << result->candidate_boxes << " candidate boxes, " << result->matched << " matched at iou >= " << match_iou
+        << " (agreement " << (boxes > 0 ? 2.0 * result->matched / boxes : 1.0) << "), mean iou "
+        << result->iou_sum / matched << ", score drift mean " << result->score_drift_sum / matched << " max "
+        << result->max_score_drift;
+    LOG(INFO) << "Session run: reference " << (result->reference_run_s > 0 ? result->images / result->reference_run_s : 0)
+        << " images/s, candidate " << (result->candidate_run_s > 0 ? result->images / result->candidate_run_s : 0)
+        << " images/s";
+    return Status::OK();
+}
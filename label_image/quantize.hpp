@@ -0,0 +1,66 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "tensorflow/core/framework/graph.pb.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/public/session.h"
+
+#include "nms_engine.hpp"
+#include "tf_detect.hpp"
+
+// graph_transforms pipeline producing an eight bit graph: the float graph is
+// folded as for kDefaultGraphTransforms, weights are stored as uint8 and the
+// ops that have quantized kernels run on uint8 activations, converting back
+// to float only where an op has none.
+extern const char* const kQuantizeTransforms;
+
+struct c_quantize_options {
+    std::vector<tensorflow::string> inputs;
+    std::vector<tensorflow::string> outputs;
+    tensorflow::string transforms = kQuantizeTransforms;
+    // Images run through the quantized graph to record the range of every
+    // requantized activation, which then becomes a constant. Empty leaves
+    // the ranges to be measured on every Run, which costs an extra pass over
+    // each activation.
+    std::vector<tensorflow::string> calibration_images;
+    c_preprocess_options preprocess;
+};
+
+// Reads the float graph_file_name and returns it quantized and, with
+// calibration images, with its requantization ranges frozen. The result
+// loads with LoadGraph like any frozen graph.
+tensorflow::Status QuantizeGraph(const tensorflow::string& graph_file_name, const c_quantize_options& options,
+    tensorflow::GraphDef* graph_def);
+
+// Replaces each RequantizationRange node named in ranges by (min, max)
+// constants feeding its Requantize consumers.
+tensorflow::Status FreezeRequantizationRanges(const std::map<tensorflow::string, std::pair<float, float> >& ranges,
+    tensorflow::GraphDef* graph_def);
+
+// How far the detections of a candidate graph (e.g. the quantized one) are
+// from the reference graph on the same images, and how fast each ran.
+struct c_graph_comparison {
+    long long images = 0;
+    long long reference_boxes = 0;
+    long long candidate_boxes = 0;
+    // Candidate boxes of the same class overlapping a reference box by at
+    // least match_iou, each used once.
+    long long matched = 0;
+    double iou_sum = 0;          // over matched pairs
+    double score_drift_sum = 0;  // |candidate - reference| over matched pairs
+    float max_score_drift = 0;
+    double reference_run_s = 0;  // session Run time only
+    double candidate_run_s = 0;
+};
+
+// Runs every image through both sessions, decodes each with
+// prepare_tf_detect_result and nms_plus, and matches the boxes. Logs a
+// summary.
+tensorflow::Status CompareGraphs(tensorflow::Session* reference, tensorflow::Session* candidate,
+    const std::vector<tensorflow::string>& paths, const c_preprocess_options& preprocess, float threshold,
+    const c_nms_options& nms, const tensorflow::string& input_layer,
+    const std::vector<tensorflow::string>& output_layers, float match_iou, c_graph_comparison* result);
@@ -0,0 +1,155 @@
+#include "result_cache.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/hash/hash.h"
+#include "tensorflow/core/lib/io/path.h"
+#include "tensorflow/core/lib/strings/str_util.h"
+#include "tensorflow/core/lib/strings/strcat.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/logging.h"
+
+using tensorflow::string;
+using tensorflow::uint64;
+
+tensorflow::Status model_hash(const string& graph_path, const c_load_options& load, uint64* hash) {
+    string source;
+    TF_RETURN_IF_ERROR(tensorflow::ReadFileToString(tensorflow::Env::Default(), graph_path, &source));
+    const c_graph_optimize_options& optimize = load.optimize;
+    string params = tensorflow::strings::StrCat(load.memmapped, load.xla_jit, "|", optimize.enabled);
+    if (optimize.enabled) {
+        tensorflow::strings::StrAppend(&params, "|", tensorflow::str_util::Join(optimize.inputs, ","), "|",
+            tensorflow::str_util::Join(optimize.outputs, ","), "|", optimize.transforms);
+    }
+    tensorflow::strings::StrAppend(&params, "|", optimize.fold_input_normalization);
+    if (optimize.fold_input_normalization) {
+        for (int c = 0; c < 3; ++c)
+            tensorflow::strings::StrAppend(&params, "|", optimize.means[c], "/", optimize.stds[c]);
+    }
+    *hash = tensorflow::Hash64Combine(tensorflow::Hash64(source), tensorflow::Hash64(params));
+    return tensorflow::Status::OK();
+}
+
+tensorflow::uint64 detection_params_hash(uint64 model, const c_preprocess_options& preprocess,
+    float threshold, const c_nms_options& nms, int top_k) {
+    string params = tensorflow::strings::StrCat(model, "|", preprocess.input_width, "x", preprocess.input_height,
+        "|", preprocess.fused, preprocess.swap_rb, preprocess.letterbox, preprocess.reduced_decode);
+    for (int c = 0; c < 3; ++c)
+        tensorflow::strings::StrAppend(&params, "|", preprocess.means[c], "/", preprocess.stds[c]);
+    for (const cv::Size& bucket : preprocess.buckets)
+        tensorflow::strings::StrAppend(&params, "|", bucket.width, "x", bucket.height);
+    for (const c_image_op& op : preprocess.ops)
+        tensorflow::strings::StrAppend(&params, "|op", (int)op.op, ":", op.param);
+    tensorflow::strings::StrAppend(&params, "|", threshold, "|", (int)nms.mode, ",", nms.iou_threshold, ",",
+        nms.inclusive, ",", nms.soft_sigma, ",", nms.score_threshold, "|", top_k);
+    return tensorflow::Hash64(params);
+}
+
+ResultCache::ResultCache(const c_result_cache_options& options, uint64 params_hash)
+    : options_(options), params_hash_(params_hash),
+    shard_bytes_(options.memory_bytes / std::max(1, options.shards)), shards_(std::max(1, options.shards)) {
+    if (!options_.disk_dir.empty()) {
+        tensorflow::Status status = tensorflow::Env::Default()->RecursivelyCreateDir(options_.disk_dir);
+        if (!status.ok())
+            LOG(WARNING) << "result cache directory: " << status;
+    }
+}
+
+uint64 ResultCache::Key(const void* data, size_t size) const {
+    return tensorflow::Hash64((const char*)data, size, params_hash_);
+}
+
+string ResultCache::DiskPath(uint64 key) const {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.det", (unsigned long long)key);
+    return tensorflow::io::JoinPath(options_.disk_dir, name);
+}
+
+bool ResultCache::Lookup(uint64 key, std::vector<c_tf_detect_result>* dets) {
+    c_shard* shard = ShardOf(key);
+    {
+        std::lock_guard<std::mutex> lock(shard->mu);
+        auto it = shard->index.find(key);
+        if (it != shard->index.end()) {
+            shard->lru.splice(shard->lru.begin(), shard->lru, it->second);
+            *dets = it->second->second;
+            ++hits_;
+            return true;
+        }
+    }
+    if (!options_.disk_dir.empty()) {
+        string data;
+        if (tensorflow::ReadFileToString(tensorflow::Env::Default(), DiskPath(key), &data).ok() &&
+            detections_from_binary(data.data(), data.size(), dets)) {
+            std::lock_guard<std::mutex> lock(shard->mu);
+            if (!shard->index.count(key))
+                InsertMemory(shard, key, *dets);
+            ++hits_;
+            ++disk_hits_;
+            return true;
+        }
+    }
+    ++misses_;
+    return false;
+}
+
+bool ResultCache::InsertMemory(c_shard* shard, uint64 key, const std::vector<c_tf_detect_result>& dets) {
+    // List node, index entry and vector header, roughly.
+    const size_t bytes = 96 + dets.size() * sizeof(c_tf_detect_result);
+    if (bytes > shard_bytes_)
+        return false;
+    while (shard->bytes + bytes > shard_bytes_ && !shard->lru.empty()) {
+        shard->bytes -= 96 + shard->lru.back().second.size() * sizeof(c_tf_detect_result);
+        shard->index.erase(shard->lru.back().first);
+        shard->lru.pop_back();
+        ++evictions_;
+    }
+    shard->lru.emplace_front(key, dets);
+    shard->index[key] = shard->lru.begin();
+    shard->bytes += bytes;
+    return true;
+}
+
+void ResultCache::Insert(uint64 key, const std::vector<c_tf_detect_result>& dets) {
+    c_shard* shard = ShardOf(key);
+    {
+        std::lock_guard<std::mutex> lock(shard->mu);
+        // Two workers may have missed on the same image at once.
+        if (shard->index.count(key))
+            return;
+        InsertMemory(shard, key, dets);
+    }
+    if (!options_.disk_dir.empty()) {
+        // Written under a temporary name first, so a concurrent reader never
+        // sees a partial entry.
+        tensorflow::Env* env = tensorflow::Env::Default();
+        const string path = DiskPath(key);
+        const string tmp_path = path + ".tmp" + std::to_string(env->NowMicros());
+        string data;
+        detections_to_binary(dets, &data);
+        tensorflow::Status status = tensorflow::WriteStringToFile(env, tmp_path, data);
+        if (status.ok())
+            status = env->RenameFile(tmp_path, path);
+        if (status.ok())
+            ++disk_writes_;
+        else
+            LOG(WARNING) << "cannot write result cache entry: " << status;
+    }
+}
+
+void ResultCache::LogStats() const {
+    const long long lookups = hits_ + misses_;
+    size_t bytes = 0, entries = 0;
+    for (const c_shard& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard.mu);
+        bytes += shard.bytes;
+        entries += shard.lru.size();
+    }
+    LOG(INFO) << "Result cache: " << hits_ << " hits (" << disk_hits_ << " from disk), " << misses_ << " misses, "
+        << (lookups > 0 ? 100.0 * hits_ / lookups : 0) << "% hit rate, " << evictions_ << " evictions, "
+        << entries << " entries in " << bytes / 1024 << " KB" << (options_.disk_dir.empty() ? "" : ", ")
+        << (options_.disk_dir.empty() ? string() : std::to_string(disk_writes_) + " written to disk");
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/platform/types.h"
+
+#include "nms_engine.hpp"
+#include "tf_detect.hpp"
+
+struct c_result_cache_options {
+    // Memory budget for cached detection lists, split evenly over the
+    // shards. 0 disables the cache.
+    size_t memory_bytes = 64 << 20;
+    // Independently locked parts; a key always goes to the same shard.
+    int shards = 16;
+    // Second tier: every result is also written here, one file per key,
+    // and memory misses look here before running inference. Empty for
+    // memory only.
+    tensorflow::string disk_dir;
+};
+
+// Hash of the graph file's bytes and of the load options that change what
+// the session computes: graph optimization, the input normalization fold,
+// XLA and memmapped loading. A model rewritten in place, such as a new
+// quantize_out, hashes differently under the same path.
+tensorflow::Status model_hash(const tensorflow::string& graph_path, const c_load_options& load,
+    tensorflow::uint64* hash);
+
+// Hash of everything besides the image bytes that decides the detections:
+// the model_hash, preprocessing, threshold, suppression and top_k. Results
+// cached under one set of parameters are never returned for another.
+tensorflow::uint64 detection_params_hash(tensorflow::uint64 model, const c_preprocess_options& preprocess,
+    float threshold, const c_nms_options& nms, int top_k);
+
+// Final detections by content of the encoded image, so a resubmitted image
+// skips decode, preprocessing, the session run and suppression. Each shard
+// is an LRU list under its own mutex, so concurrent workers only contend
+// when their keys land on the same shard. Thread safe.
+class ResultCache {
+public:
+    ResultCache(const c_result_cache_options& options, tensorflow::uint64 params_hash);
+
+    // 64 bit hash of the encoded bytes mixed with the parameter hash.
+    tensorflow::uint64 Key(const void* data, size_t size) const;
+    tensorflow::uint64 Key(const std::vector<unsigned char>& data) const { return Key(data.data(), data.size()); }
+    tensorflow::uint64 Key(const tensorflow::string& data) const { return Key(data.data(), data.size()); }
+
+    bool Lookup(tensorflow::uint64 key, std::vector<c_tf_detect_result>* dets);
+    void Insert(tensorflow::uint64 key, const std::vector<c_tf_detect_result>& dets);
+
+    long long hits() const { return hits_; }
+    long long misses() const { return misses_; }
+    void LogStats() const;
+
+private:
+    struct c_shard {
+        mutable std::mutex mu;
+        // Most recently used first.
+        std::list<std::pair<tensorflow::uint64, std::vector<c_tf_detect_result> > > lru;
+        std::unordered_map<tensorflow::uint64, decltype(lru)::iterator> index;
+        size_t bytes = 0;
+    };
+
+    c_shard* ShardOf(tensorflow::uint64 key) { return &shards_[key % shards_.size()]; }
+    // Stores into memory only; false if the entry alone exceeds a shard.
+    bool InsertMemory(c_shard* shard, tensorflow::uint64 key, const std::vector<c_tf_detect_result>& dets);
+    tensorflow::string DiskPath(tensorflow::uint64 key) const;
+
+    const c_result_cache_options options_;
+    const tensorflow::uint64 params_hash_;
+    const size_t shard_bytes_;
+    std::vector<c_shard> shards_;
+    std::atomic<long long> hits_{ 0 };
+    std::atomic<long long> disk_hits_{ 0 };
+    std::atomic<long long> misses_{ 0 };
+    std::atomic<long long> evictions_{ 0 };
+    std::atomic<long long> disk_writes_{ 0 };
+};
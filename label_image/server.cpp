@@ -0,0 +1,529 @@
+#include "server.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <set>
+
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/lib/strings/str_util.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/logging.h"
+
+#include "arena.hpp"
+#include "cv_process.hpp"
+#include "pipeline.hpp"
+#include "shape_buckets.hpp"
+#include "trace.hpp"
+
+#if defined(_WIN32)
+
+tensorflow::Status RunServer(tensorflow::Session* session, const c_server_options& options) {
+    return tensorflow::errors::Unimplemented("server mode needs POSIX sockets");
+}
+
+#else
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using tensorflow::Status;
+using tensorflow::Tensor;
+using tensorflow::string;
+
+namespace {
+
+enum { kFormatBinary = 0, kFormatJson = 1 };
+
+struct c_server_reply {
+    int status = 200;
+    string body;
+};
+
+struct c_server_request {
+    std::vector<unsigned char> data;
+    int format = kFormatJson;
+    std::promise<c_server_reply> reply;
+};
+
+typedef std::shared_ptr<c_server_request> RequestPtr;
+
+std::atomic<bool> g_stop{ false };
+int g_wake_pipe[2] = { -1, -1 };
+
+extern "C" void handle_stop_signal(int) {
+    g_stop = true;
+    char c = 0;
+    ssize_t r = write(g_wake_pipe[1], &c, 1);
+    (void)r;
+}
+
+bool read_full(int fd, void* buf, size_t n) {
+    char* p = static_cast<char*>(buf);
+    while (n > 0) {
+        ssize_t r = recv(fd, p, n, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+bool write_full(int fd, const void* buf, size_t n) {
+    const char* p = static_cast<const char*>(buf);
+    while (n > 0) {
+        ssize_t r = send(fd, p, n, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+bool write_http_reply(int fd, const c_server_reply& reply, const char* content_type) {
+    char head[256];
+    int n = snprintf(head, sizeof(head),
+        "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+        reply.status, reply.status == 200 ? "OK" : "Error", content_type, reply.body.size());
+    return write_full(fd, head, n) && write_full(fd, reply.body.data(), reply.body.size());
+}
+
+bool write_unix_reply(int fd, const c_server_reply& reply) {
+    const uint32_t head[2] = { (uint32_t)reply.status, (uint32_t)reply.body.size() };
+    return write_full(fd, head, sizeof(head)) && write_full(fd, reply.body.data(), reply.body.size());
+}
+
+// A client that stops sending or reading mid request would otherwise hold
+// its connection thread forever.
+void set_socket_timeouts(int fd, int timeout_ms) {
+    if (timeout_ms <= 0)
+        return;
+    timeval tv;
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+Status listen_unix(const string& path, int* fd) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+        return tensorflow::errors::InvalidArgument("socket path too long: ", path);
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(path.c_str());
+
+    *fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (*fd < 0 || bind(*fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(*fd, 128) != 0)
+        return tensorflow::errors::Unavailable("cannot listen on ", path, ": ", strerror(errno));
+    return Status::OK();
+}
+
+Status listen_http(int port, int* fd) {
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    *fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    if (*fd >= 0)
+        setsockopt(*fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (*fd < 0 || bind(*fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(*fd, 128) != 0)
+        return tensorflow::errors::Unavailable("cannot listen on 127.0.0.1:", port, ": ", strerror(errno));
+    return Status::OK();
+}
+
+class Server {
+public:
+    Server(tensorflow::Session* session, const c_server_options& options)
+        : session_(session), options_(options), requests_(options.queue_capacity) {}
+
+    Status Run();
+
+private:
+    // Queues a request for the workers and waits for its reply.
+    c_server_reply Submit(RequestPtr req);
+    void ServeUnix(int fd);
+    void ServeHttp(int fd);
+    void Work();
+    void Infer(std::vector<RequestPtr>* batch, DetectionDecoder* decoder, WorkerArena* arena);
+
+    // False once options_.connections clients are being served.
+    bool Track(int fd) {
+        std::unique_lock<std::mutex> lock(mu_);
+        if ((int)clients_.size() >= options_.connections)
+            return false;
+        clients_.insert(fd);
+        return true;
+    }
+    void Untrack(int fd) {
+        std::unique_lock<std::mutex> lock(mu_);
+        clients_.erase(fd);
+        close(fd);
+    }
+
+    tensorflow::Session* session_;
+    const c_server_options& options_;
+    BoundedQueue<RequestPtr> requests_;
+    std::mutex mu_;
+    std::set<int> clients_;
+    std::atomic<long long> served_{ 0 };
+    std::atomic<long long> rejected_{ 0 };
+    std::atomic<long long> failed_{ 0 };
+};
+
+c_server_reply Server::Submit(RequestPtr req) {
+    std::future<c_server_reply> reply = req->reply.get_future();
+    if (g_stop || !requests_.TryPush(req)) {
+        ++rejected_;
+        c_server_reply busy;
+        busy.status = 503;
+        busy.body = "server busy";
+        return busy;
+    }
+    return reply.get();
+}
+
+void Server::ServeUnix(int fd) {
+    for (;;) {
+        unsigned char format;
+        uint32_t length;
+        if (!read_full(fd, &format, 1) || !read_full(fd, &length, sizeof(length)))
+            break;
+        if (length > options_.max_request_bytes) {
+            const uint32_t head[2] = { 413, 0 };
+            write_full(fd, head, sizeof(head));
+            break;
+        }
+        RequestPtr req = std::make_shared<c_server_request>();
+        req->format = format == kFormatBinary ? kFormatBinary : kFormatJson;
+        req->data.resize(length);
+        if (!read_full(fd, req->data.data(), length))
+            break;
+
+        if (!write_unix_reply(fd, Submit(req)))
+            break;
+    }
+    Untrack(fd);
+}
+
+void Server::ServeHttp(int fd) {
+    // Read up to the end of the headers; the body may already be partly in.
+    string buf;
+    size_t header_end = string::npos;
+    char chunk[4096];
+    while ((header_end = buf.find("\r\n\r\n")) == string::npos && buf.size() < 16384) {
+        ssize_t r = recv(fd, chunk, sizeof(chunk), 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            Untrack(fd);
+            return;
+        }
+        buf.append(chunk, r);
+    }
+
+    c_server_reply reply;
+    const char* content_type = "text/plain";
+    if (header_end == string::npos) {
+        reply.status = 431;
+        reply.body = "headers too large";
+    }
+    else {
+        std::vector<string> lines = tensorflow::str_util::Split(buf.substr(0, header_end), "\r\n",
+            tensorflow::str_util::SkipEmpty());
+        std::vector<string> request_line;
+        if (!lines.empty())
+            request_line = tensorflow::str_util::Split(lines[0], ' ');
+        size_t content_length = 0;
+        bool binary = false;
+        for (size_t i = 1; i < lines.size(); ++i) {
+            string lower = tensorflow::str_util::Lowercase(lines[i]);
+            if (tensorflow::str_util::StartsWith(lower, "content-length:"))
+                content_length = strtoull(lower.c_str() + 15, nullptr, 10);
+            else if (tensorflow::str_util::StartsWith(lower, "accept:") &&
+                lower.find("application/octet-stream") != string::npos)
+                binary = true;
+        }
+
+        if (request_line.size() >= 2 && request_line[0] == "GET" && request_line[1] == "/healthz") {
+            reply.body = "ok";
+        }
+        else if (request_line.size() < 2 || request_line[0] != "POST" || request_line[1] != "/detect") {
+            reply.status = 404;
+            reply.body = "use POST /detect";
+        }
+        else if (content_length == 0 || content_length > options_.max_request_bytes) {
+            reply.status = 413;
+            reply.body = "bad Content-Length";
+        }
+        else {
+            RequestPtr req = std::make_shared<c_server_request>();
+            req->format = binary ? kFormatBinary : kFormatJson;
+            req->data.assign(buf.begin() + header_end + 4, buf.end());
+            const size_t have = req->data.size();
+            req->data.resize(content_length);
+            if (have > content_length || !read_full(fd, req->data.data() + have, content_length - have)) {
+                Untrack(fd);
+                return;
+            }
+            reply = Submit(req);
+            if (reply.status == 200)
+                content_type = binary ? "application/octet-stream" : "application/json";
+        }
+    }
+
+    write_http_reply(fd, reply, content_type);
+    Untrack(fd);
+}
+
+void Server::Infer(std::vector<RequestPtr>* batch, DetectionDecoder* decoder, WorkerArena* arena) {
+    const c_preprocess_options& pre = options_.preprocess;
+    const cv::Size reduce = reduced_decode_size(pre);
+    std::vector<RequestPtr> ok;
+    std::vector<cv::Size> originals;
+    std::vector<tensorflow::uint64> keys;
+    std::vector<c_tf_detect_result> dets;
+    for (RequestPtr& req : *batch) {
+        TRACE_SCOPE("decode");
+        tensorflow::uint64 key = 0;
+        if (options_.cache != nullptr) {
+            key = options_.cache->Key(req->data);
+            if (options_.cache->Lookup(key, &dets)) {
+                c_server_reply reply;
+                if (req->format == kFormatBinary)
+                    detections_to_binary(dets, &reply.body);
+                else
+                    detections_to_json(dets, &reply.body);
+                req->reply.set_value(reply);
+                ++served_;
+                trace_count("images", 1);
+                continue;
+            }
+        }
+        cv::Mat* mat = arena->Image(ok.size());
+        cv::Size original;
+        if (!cvprocess::decodeForInput(req->data, reduce.width, reduce.height, *mat, &original) ||
+            !apply_image_ops(pre, mat, arena->Scratch())) {
+            c_server_reply reply;
+            reply.status = 400;
+            reply.body = "cannot decode image";
+            req->reply.set_value(reply);
+            ++failed_;
+            continue;
+        }
+        ok.push_back(req);
+        originals.push_back(original);
+        keys.push_back(key);
+    }
+    if (ok.empty())
+        return;
+
+    // One run per shape bucket present in the batch.
+    const int n = ok.size();
+    std::vector<cv::Size> shapes(n);
+    for (int b = 0; b < n; ++b)
+        shapes[b] = pick_input_shape(pre, originals[b]);
+    std::vector<bool> done(n, false);
+    std::vector<int> group;
+    std::vector<c_image_transform> transforms;
+    std::vector<char> prepared;
+    for (int first = 0; first < n; ++first) {
+        if (done[first])
+            continue;
+        const cv::Size shape = shapes[first];
+        group.clear();
+        for (int b = first; b < n; ++b) {
+            if (!done[b] && shapes[b] == shape) {
+                group.push_back(b);
+                done[b] = true;
+            }
+        }
+
+        const int m = group.size();
+        Tensor* input = arena->Input(m, shape.height, shape.width);
+        transforms.resize(m);
+        prepared.resize(m);
+        {
+            TRACE_SCOPE("preprocess");
+            for (int g = 0; g < m; ++g)
+                prepared[g] = preprocess_into_tensor(*arena->Image(group[g]), pre, g, input, arena->Scratch(),
+                    &transforms[g], originals[group[g]]);
+        }
+
+        std::vector<Tensor>& outputs = *arena->Outputs();
+        Status run_status = TracedRun(session_, { {options_.input_layer, *input} }, options_.output_layers,
+            &outputs);
+        if (run_status.ok())
+            note_inference_done();
+        for (int g = 0; g < m; ++g) {
+            c_server_reply reply;
+            if (!run_status.ok()) {
+                reply.status = 500;
+                reply.body = run_status.ToString();
+                ++failed_;
+            }
+            else if (!prepared[g]) {
+                reply.status = 400;
+                reply.body = "cannot preprocess image";
+                ++failed_;
+            }
+            else {
+                TRACE_SCOPE("postprocess");
+                decoder->Decode(outputs[0], outputs[1], outputs[2], g, transforms[g], options_.threshold);
+                decoder->Suppress(options_.nms, &dets);
+                if (options_.cache != nullptr)
+                    options_.cache->Insert(keys[group[g]], dets);
+                if (ok[group[g]]->format == kFormatBinary)
+                    detections_to_binary(dets, &reply.body);
+                else
+                    detections_to_json(dets, &reply.body);
+                ++served_;
+                trace_count("images", 1);
+            }
+            ok[group[g]]->reply.set_value(reply);
+        }
+    }
+}
+
+void Server::Work() {
+    DetectionDecoder decoder(options_.top_k);
+    WorkerArena arena(options_.preprocess.input_height, options_.preprocess.input_width);
+    RequestPtr req;
+    while (requests_.Pop(&req)) {
+        std::vector<RequestPtr> batch;
+        batch.push_back(std::move(req));
+        while ((int)batch.size() < options_.batch_size && requests_.TryPop(&req))
+            batch.push_back(std::move(req));
+        Infer(&batch, &decoder, &arena);
+    }
+}
+
+Status Server::Run() {
+    std::vector<std::pair<int, bool> > listeners;  // fd, is_http
+    if (!options_.unix_socket.empty()) {
+        int fd;
+        TF_RETURN_IF_ERROR(listen_unix(options_.unix_socket, &fd));
+        listeners.push_back(std::make_pair(fd, false));
+        LOG(INFO) << "serving on unix:" << options_.unix_socket;
+    }
+    if (options_.http_port > 0) {
+        int fd;
+        TF_RETURN_IF_ERROR(listen_http(options_.http_port, &fd));
+        listeners.push_back(std::make_pair(fd, true));
+        LOG(INFO) << "serving on http://127.0.0.1:" << options_.http_port;
+    }
+    if (listeners.empty())
+        return tensorflow::errors::InvalidArgument("no server_socket or server_port given");
+
+    if (pipe(g_wake_pipe) != 0)
+        return tensorflow::errors::Internal("pipe: ", strerror(errno));
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    TraceGauge queue_depth("queue_depth{queue=\"requests\"}", [this] { return (double)requests_.depth(); });
+    tensorflow::Env* env = tensorflow::Env::Default();
+    std::unique_ptr<tensorflow::thread::ThreadPool> workers(
+        new tensorflow::thread::ThreadPool(env, "server_workers", options_.workers));
+    for (int i = 0; i < options_.workers; ++i)
+        workers->Schedule([this] { Work(); });
+    std::unique_ptr<tensorflow::thread::ThreadPool> connections(
+        new tensorflow::thread::ThreadPool(env, "server_connections", options_.connections));
+
+    std::vector<pollfd> fds;
+    for (auto& l : listeners)
+        fds.push_back(pollfd{ l.first, POLLIN, 0 });
+    fds.push_back(pollfd{ g_wake_pipe[0], POLLIN, 0 });
+    while (!g_stop) {
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (size_t i = 0; i < listeners.size(); ++i) {
+            if (!(fds[i].revents & POLLIN))
+                continue;
+            int client = accept(listeners[i].first, nullptr, nullptr);
+            if (client < 0)
+                continue;
+            set_socket_timeouts(client, options_.io_timeout_ms);
+            const bool http = listeners[i].second;
+            // Past the cap, clients would only queue up on the connection
+            // pool with their sockets open; turn them away instead.
+            if (!Track(client)) {
+                ++rejected_;
+                c_server_reply busy;
+                busy.status = 503;
+                busy.body = "too many connections";
+                if (http)
+                    write_http_reply(client, busy, "text/plain");
+                else
+                    write_unix_reply(client, busy);
+                close(client);
+                continue;
+            }
+            connections->Schedule([this, client, http] {
+                if (http)
+                    ServeHttp(client);
+                else
+                    ServeUnix(client);
+            });
+        }
+    }
+
+    // Drain: no new connections, idle clients are woken by a read shutdown,
+    // busy ones get their in-flight reply first. Then the queue is closed
+    // and the workers finish what is left in it.
+    LOG(INFO) << "shutting down, draining requests";
+    for (auto& l : listeners)
+        close(l.first);
+    if (!options_.unix_socket.empty())
+        unlink(options_.unix_socket.c_str());
+    {
+        std::unique_lock<std::mutex> lock(mu_);
+        for (int fd : clients_)
+            shutdown(fd, SHUT_RD);
+    }
+    connections.reset();
+    requests_.Close();
+    workers.reset();
+    close(g_wake_pipe[0]);
+    close(g_wake_pipe[1]);
+
+    LOG(INFO) << "server stopped: served=" << served_ << " rejected=" << rejected_ << " failed=" << failed_
+        << " queue max_depth=" << requests_.max_depth() << " stall=" << requests_.pop_stall_ms() << "ms";
+    return Status::OK();
+}
+
+}  // namespace
+
+Status RunServer(tensorflow::Session* session, const c_server_options& options) {
+    Server server(session, options);
+    return server.Run();
+}
+
+#endif
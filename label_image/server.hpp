@@ -0,0 +1,45 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/public/session.h"
+
+#include "nms_engine.hpp"
+#include "result_cache.hpp"
+#include "tf_detect.hpp"
+
+// Long running detection service around one loaded Session.
+//
+// Unix socket protocol, any number of requests per connection:
+//   request:  uint8 format (0 binary, 1 json), uint32 length, encoded image
+//   response: uint32 status (HTTP style code), uint32 length, payload
+// HTTP on 127.0.0.1: POST /detect with the encoded image as body; the reply is
+// JSON unless the request sends "Accept: application/octet-stream". GET
+// /healthz answers "ok". Binary payloads use detections_to_binary, errors are
+// plain text. All integers are little-endian.
+struct c_server_options {
+    tensorflow::string unix_socket;  // empty to disable
+    int http_port = 0;               // 0 to disable
+    int workers = 1;                 // inference threads
+    int connections = 16;            // concurrently served clients, more get 503
+    int io_timeout_ms = 30000;       // socket send/receive timeout, 0 for none
+    int queue_capacity = 64;         // requests waiting for a worker
+    int batch_size = 1;
+    size_t max_request_bytes = 64 << 20;
+    c_preprocess_options preprocess;
+    float threshold = 0.6f;
+    c_nms_options nms;
+    int top_k = 0;
+    tensorflow::string input_layer = "image_input";
+    std::vector<tensorflow::string> output_layers;
+    // Answers resubmitted images without inference; none when null.
+    ResultCache* cache = nullptr;
+};
+
+// Serves until SIGINT or SIGTERM. Shutdown stops accepting, lets every
+// connection finish the request it is in, drains the queue and returns.
+// Requests that find the queue full, and clients beyond connections, are
+// answered with 503. A client silent for io_timeout_ms is disconnected.
+tensorflow::Status RunServer(tensorflow::Session* session, const c_server_options& options);
@@ -0,0 +1,269 @@
+#include "session_pool.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <map>
+
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/strings/numbers.h"
+#include "tensorflow/core/lib/strings/str_util.h"
+#include "tensorflow/core/lib/strings/strcat.h"
+#include "tensorflow/core/platform/cpu_info.h"
+#include "tensorflow/core/platform/logging.h"
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#endif
+
+using tensorflow::Status;
+using tensorflow::Tensor;
+using tensorflow::string;
+
+bool ParseCpuList(const string& text, std::vector<int>* cpus) {
+    cpus->clear();
+    for (const string& range : tensorflow::str_util::Split(text, ',', tensorflow::str_util::SkipEmpty())) {
+        std::vector<string> ends = tensorflow::str_util::Split(range, '-');
+        tensorflow::int32 lo, hi;
+        if (ends.size() > 2 || !tensorflow::strings::safe_strto32(ends[0], &lo))
+            return false;
+        hi = lo;
+        if (ends.size() == 2 && !tensorflow::strings::safe_strto32(ends[1], &hi))
+            return false;
+        if (lo < 0 || hi < lo)
+            return false;
+        for (int cpu = lo; cpu <= hi; ++cpu)
+            cpus->push_back(cpu);
+    }
+    return !cpus->empty();
+}
+
+// cpu -> NUMA node from /sys; empty when the kernel does not expose nodes.
+static std::map<int, int> numa_nodes_of_cpus() {
+    std::map<int, int> node_of;
+    for (int node = 0; node < 1024; ++node) {
+        std::ifstream file(tensorflow::strings::StrCat("/sys/devices/system/node/node", node, "/cpulist"));
+        if (!file)
+            break;
+        string line;
+        std::getline(file, line);
+        std::vector<int> cpus;
+        if (ParseCpuList(tensorflow::str_util::StripWhitespace(line).ToString(), &cpus)) {
+            for (int cpu : cpus)
+                node_of[cpu] = node;
+        }
+    }
+    return node_of;
+}
+
+static std::vector<int> allowed_cpus() {
+    std::vector<int> cpus;
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
+        }
+    }
+#endif
+    if (cpus.empty()) {
+        for (int cpu = 0; cpu < tensorflow::port::NumSchedulableCPUs(); ++cpu)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+Status CpuPartitions(const c_session_pool_options& options, std::vector<c_cpu_partition>* partitions) {
+    partitions->clear();
+    const std::map<int, int> node_of = numa_nodes_of_cpus();
+
+    if (!options.dev_list.empty()) {
+        for (const string& part : tensorflow::str_util::Split(options.dev_list, ';', tensorflow::str_util::SkipEmpty())) {
+            c_cpu_partition partition;
+            if (!ParseCpuList(part, &partition.cpus))
+                return tensorflow::errors::InvalidArgument("bad cpu list '", part, "' in dev_list");
+            partitions->push_back(partition);
+        }
+    }
+    else {
+        // Order the cpus by node and cut them into equal runs, so a partition
+        // only spans two nodes when the sessions do not divide the nodes.
+        std::vector<int> cpus = allowed_cpus();
+        std::stable_sort(cpus.begin(), cpus.end(), [&node_of](int a, int b) {
+            auto na = node_of.find(a), nb = node_of.find(b);
+            return (na == node_of.end() ? 0 : na->second) < (nb == node_of.end() ? 0 : nb->second);
+        });
+        const int count = std::max(1, std::min<int>(options.sessions, cpus.size()));
+        for (int i = 0; i < count; ++i) {
+            c_cpu_partition partition;
+            partition.cpus.assign(cpus.begin() + cpus.size() * i / count, cpus.begin() + cpus.size() * (i + 1) / count);
+            partitions->push_back(partition);
+        }
+    }
+
+    // A partition belongs to the node most of its cpus sit on.
+    for (c_cpu_partition& partition : *partitions) {
+        std::map<int, int> votes;
+        for (int cpu : partition.cpus) {
+            auto it = node_of.find(cpu);
+            if (it != node_of.end())
+                ++votes[it->second];
+        }
+        int best = 0;
+        for (auto& vote : votes) {
+            if (vote.second > best) {
+                best = vote.second;
+                partition.numa_node = vote.first;
+            }
+        }
+    }
+    return Status::OK();
+}
+
+static void pin_current_thread(const std::vector<int>& cpus) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    }
+    const int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0)
+        LOG(WARNING) << "cannot pin thread: " << strerror(err);
+#endif
+}
+
+tensorflow::Thread* PinnedEnv::StartThread(const tensorflow::ThreadOptions& thread_options,
+    const string& name, std::function<void()> fn) {
+    const std::vector<int> cpus = cpus_;
+    return target()->StartThread(thread_options, name, [cpus, fn]() {
+        pin_current_thread(cpus);
+        fn();
+    });
+}
+
+Status SessionPool::New(const tensorflow::GraphDef& graph_def, const tensorflow::SessionOptions& base,
+    const c_session_pool_options& options, std::unique_ptr<tensorflow::Session>* pool) {
+    std::vector<c_cpu_partition> partitions;
+    TF_RETURN_IF_ERROR(CpuPartitions(options, &partitions));
+    if (partitions.empty())
+        return tensorflow::errors::InvalidArgument("no cpu partitions in dev_list '", options.dev_list, "'");
+    const int sessions = options.sessions > 0 ? options.sessions : partitions.size();
+
+    std::unique_ptr<SessionPool> result(new SessionPool(options.least_loaded));
+    tensorflow::Env* base_env = base.env ? base.env : tensorflow::Env::Default();
+    for (int i = 0; i < sessions; ++i) {
+        const c_cpu_partition& partition = partitions[i % partitions.size()];
+        std::unique_ptr<c_member> member(new c_member);
+
+        tensorflow::SessionOptions session_options = base;
+        tensorflow::ConfigProto& config = session_options.config;
+        config.set_intra_op_parallelism_threads(
+            options.intra_op_threads > 0 ? options.intra_op_threads : partition.cpus.size());
+        config.set_inter_op_parallelism_threads(options.inter_op_threads > 0 ? options.inter_op_threads : 2);
+        config.set_use_per_session_threads(true);
+        if (options.pin) {
+            member->env.reset(new PinnedEnv(base_env, partition.cpus));
+            session_options.env = member->env.get();
+        }
+        member->session.reset(tensorflow::NewSession(session_options));
+        if (!member->session)
+            return tensorflow::errors::Internal("cannot create session ", i);
+
+        // Create on a thread of the partition, so the constants the session
+        // copies out of the graph are first touched on its NUMA node.
+        Status create_status;
+        {
+            tensorflow::Env* env = options.pin ? member->env.get() : base_env;
+            std::unique_ptr<tensorflow::Thread> creator(env->StartThread(tensorflow::ThreadOptions(),
+                "session_create", [&member, &graph_def, &create_status]() {
+                    create_status = member->session->Create(graph_def);
+                }));
+        }
+        TF_RETURN_IF_ERROR(create_status);
+
+        LOG(INFO) << "session " << i << ": " << partition.cpus.size() << " cpus from " << partition.cpus.front()
+            << ", numa node " << partition.numa_node << ", intra " << config.intra_op_parallelism_threads()
+            << " inter " << config.inter_op_parallelism_threads() << (options.pin ? ", pinned" : "");
+        result->members_.push_back(std::move(member));
+    }
+    pool->reset(result.release());
+    return Status::OK();
+}
+
+SessionPool::c_member* SessionPool::Pick() {
+    if (!least_loaded_)
+        return members_[next_++ % members_.size()].get();
+    // Start the scan at a rotating offset so ties do not all land on the
+    // first session.
+    const size_t start = next_++;
+    c_member* best = nullptr;
+    int best_load = std::numeric_limits<int>::max();
+    for (size_t k = 0; k < members_.size(); ++k) {
+        c_member* member = members_[(start + k) % members_.size()].get();
+        const int load = member->in_flight.load();
+        if (load < best_load) {
+            best_load = load;
+            best = member;
+        }
+    }
+    return best;
+}
+
+Status SessionPool::Create(const tensorflow::GraphDef& graph) {
+    return tensorflow::errors::FailedPrecondition("SessionPool is created with its graph");
+}
+
+Status SessionPool::Extend(const tensorflow::GraphDef& graph) {
+    for (auto& member : members_)
+        TF_RETURN_IF_ERROR(member->session->Extend(graph));
+    return Status::OK();
+}
+
+Status SessionPool::Run(const std::vector<std::pair<string, Tensor> >& inputs,
+    const std::vector<string>& output_tensor_names, const std::vector<string>& target_node_names,
+    std::vector<Tensor>* outputs) {
+    c_member* member = Pick();
+    ++member->in_flight;
+    Status status = member->session->Run(inputs, output_tensor_names, target_node_names, outputs);
+    --member->in_flight;
+    ++member->runs;
+    return status;
+}
+
+Status SessionPool::Run(const tensorflow::RunOptions& run_options,
+    const std::vector<std::pair<string, Tensor> >& inputs, const std::vector<string>& output_tensor_names,
+    const std::vector<string>& target_node_names, std::vector<Tensor>* outputs,
+    tensorflow::RunMetadata* run_metadata) {
+    c_member* member = Pick();
+    ++member->in_flight;
+    Status status = member->session->Run(run_options, inputs, output_tensor_names, target_node_names,
+        outputs, run_metadata);
+    --member->in_flight;
+    ++member->runs;
+    return status;
+}
+
+Status SessionPool::ListDevices(std::vector<tensorflow::DeviceAttributes>* response) {
+    return members_.front()->session->ListDevices(response);
+}
+
+Status SessionPool::Close() {
+    Status status;
+    for (auto& member : members_)
+        status.Update(member->session->Close());
+    return status;
+}
+
+std::vector<long long> SessionPool::RunCounts() const {
+    std::vector<long long> counts;
+    for (auto& member : members_)
+        counts.push_back(member->runs.load());
+    return counts;
+}
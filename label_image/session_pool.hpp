@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "tensorflow/core/framework/graph.pb.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/public/session.h"
+#include "tensorflow/core/public/session_options.h"
+
+struct c_session_pool_options {
+    // Sessions sharing the graph; 0 makes one per CPU partition.
+    int sessions = 1;
+    // Per session. 0 uses the partition size for intra-op and 2 for inter-op.
+    int intra_op_threads = 0;
+    int inter_op_threads = 0;
+    // CPU partitions as cpu lists separated by ';', e.g. "0-15;16-31" or
+    // "0-7,32-39;8-15,40-47". Session i uses partition i % count. Empty
+    // splits the CPUs this process may run on evenly, NUMA node by node.
+    tensorflow::string dev_list;
+    // Pin every thread a session starts to its partition.
+    bool pin = true;
+    // Send each Run to the session with the fewest runs in flight instead of
+    // rotating through them.
+    bool least_loaded = false;
+};
+
+struct c_cpu_partition {
+    std::vector<int> cpus;
+    int numa_node = -1;
+};
+
+// Parses "0-3,8,10-11" into a cpu index list.
+bool ParseCpuList(const tensorflow::string& text, std::vector<int>* cpus);
+
+// Works out the partitions for options.dev_list (see above).
+tensorflow::Status CpuPartitions(const c_session_pool_options& options, std::vector<c_cpu_partition>* partitions);
+
+// Env whose threads are pinned to a fixed cpu set before they run; file and
+// time calls pass through to the wrapped env.
+class PinnedEnv : public tensorflow::EnvWrapper {
+public:
+    PinnedEnv(tensorflow::Env* target, const std::vector<int>& cpus)
+        : tensorflow::EnvWrapper(target), cpus_(cpus) {}
+
+    tensorflow::Thread* StartThread(const tensorflow::ThreadOptions& thread_options,
+        const tensorflow::string& name, std::function<void()> fn) override;
+
+private:
+    const std::vector<int> cpus_;
+};
+
+// K sessions over one graph, each with its own thread pools and, optionally,
+// pinned to a CPU partition, presented as a single Session. Run is safe to
+// call from many threads and goes to one of the sessions, so callers scale by
+// running at least as many concurrent Runs as there are sessions.
+//
+// Unless TF_OVERRIDE_GLOBAL_THREADPOOL=1 is in the environment before the
+// process creates its first session, every session shares the process wide
+// Eigen pool sized by whichever came first, and intra-op threads are not
+// pinned. The pool leaves the environment to the program; main sets it.
+class SessionPool : public tensorflow::Session {
+public:
+    // base supplies everything but the thread settings; its env, if set, is
+    // wrapped by each session's PinnedEnv.
+    static tensorflow::Status New(const tensorflow::GraphDef& graph_def,
+        const tensorflow::SessionOptions& base, const c_session_pool_options& options,
+        std::unique_ptr<tensorflow::Session>* pool);
+
+    tensorflow::Status Create(const tensorflow::GraphDef& graph) override;
+    tensorflow::Status Extend(const tensorflow::GraphDef& graph) override;
+    tensorflow::Status Run(const std::vector<std::pair<tensorflow::string, tensorflow::Tensor> >& inputs,
+        const std::vector<tensorflow::string>& output_tensor_names,
+        const std::vector<tensorflow::string>& target_node_names,
+        std::vector<tensorflow::Tensor>* outputs) override;
+    tensorflow::Status Run(const tensorflow::RunOptions& run_options,
+        const std::vector<std::pair<tensorflow::string, tensorflow::Tensor> >& inputs,
+        const std::vector<tensorflow::string>& output_tensor_names,
+        const std::vector<tensorflow::string>& target_node_names,
+        std::vector<tensorflow::Tensor>* outputs, tensorflow::RunMetadata* run_metadata) override;
+    tensorflow::Status ListDevices(std::vector<tensorflow::DeviceAttributes>* response) override;
+    tensorflow::Status Close() override;
+
+    int size() const { return members_.size(); }
+    // Runs each session has served, for balance checks.
+    std::vector<long long> RunCounts() const;
+
+private:
+    struct c_member {
+        std::unique_ptr<tensorflow::Env> env;
+        std::unique_ptr<tensorflow::Session> session;
+        std::atomic<int> in_flight{ 0 };
+        std::atomic<long long> runs{ 0 };
+    };
+
+    explicit SessionPool(bool least_loaded) : least_loaded_(least_loaded) {}
+    c_member* Pick();
+
+    const bool least_loaded_;
+    std::vector<std::unique_ptr<c_member> > members_;
+    std::atomic<unsigned> next_{ 0 };
+};
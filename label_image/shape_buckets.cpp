@@ -0,0 +1,110 @@
+#include "shape_buckets.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/platform/logging.h"
+
+using tensorflow::Status;
+using tensorflow::Tensor;
+using tensorflow::string;
+
+bool parse_shape_buckets(const std::string& spec, std::vector<cv::Size>* buckets) {
+    buckets->clear();
+    size_t begin = 0;
+    while (begin < spec.size()) {
+        size_t end = spec.find(',', begin);
+        if (end == std::string::npos)
+            end = spec.size();
+        const std::string item = spec.substr(begin, end - begin);
+        begin = end + 1;
+        if (item.empty())
+            continue;
+        char* rest = nullptr;
+        const long width = strtol(item.c_str(), &rest, 10);
+        if (*rest != 'x')
+            return false;
+        const char* height_text = rest + 1;
+        const long height = strtol(height_text, &rest, 10);
+        if (rest == height_text || *rest != 0 || width < 1 || height < 1)
+            return false;
+        buckets->push_back(cv::Size(width, height));
+    }
+    return true;
+}
+
+std::vector<cv::Size> input_shapes(const c_preprocess_options& options) {
+    if (options.buckets.empty())
+        return { cv::Size(options.input_width, options.input_height) };
+    return options.buckets;
+}
+
+cv::Size pick_input_shape(const c_preprocess_options& options, const cv::Size& image) {
+    if (options.buckets.empty())
+        return cv::Size(options.input_width, options.input_height);
+    if (image.area() == 0)
+        return options.buckets[0];
+
+    const float aspect = std::log((float)image.width / image.height);
+    auto distance = [aspect](const cv::Size& b) { return std::fabs(std::log((float)b.width / b.height) - aspect); };
+    float best = std::numeric_limits<float>::max();
+    for (const cv::Size& b : options.buckets)
+        best = std::min(best, distance(b));
+
+    // Aspect ratios within about 10% of the best count as equal. Among
+    // those, the smallest bucket the image fits in without upscaling wins,
+    // else the largest.
+    const cv::Size* pick = nullptr;
+    bool pick_covers = false;
+    for (const cv::Size& b : options.buckets) {
+        if (distance(b) > best + 0.1f)
+            continue;
+        const bool covers = b.width >= image.width && b.height >= image.height;
+        const bool better = pick == nullptr ||
+            (pick_covers ? covers && b.area() < pick->area() : covers || b.area() > pick->area());
+        if (better) {
+            pick = &b;
+            pick_covers = covers;
+        }
+    }
+    return *pick;
+}
+
+cv::Size reduced_decode_size(const c_preprocess_options& options) {
+    if (!options.reduced_decode)
+        return cv::Size();
+    cv::Size size;
+    for (const cv::Size& s : input_shapes(options)) {
+        size.width = std::max(size.width, s.width);
+        size.height = std::max(size.height, s.height);
+    }
+    return size;
+}
+
+Status WarmupShapes(tensorflow::Session* session, const c_preprocess_options& options,
+    const std::vector<int>& batch_sizes, const string& input_layer, const std::vector<string>& output_layers,
+    int runs_per_shape) {
+    std::vector<Tensor> outputs;
+    for (const cv::Size& shape : input_shapes(options)) {
+        for (int batch : batch_sizes) {
+            Tensor input(tensorflow::DT_FLOAT, { batch, shape.height, shape.width, 3 });
+            input.flat<float>().setZero();
+            const auto start = std::chrono::steady_clock::now();
+            for (int r = 0; r < runs_per_shape; ++r) {
+                Status status = session->Run({ { input_layer, input } }, output_layers, {}, &outputs);
+                if (!status.ok()) {
+                    return tensorflow::errors::InvalidArgument("input shape ", batch, "x", shape.height, "x",
+                        shape.width, " failed to run: ", status.error_message());
+                }
+            }
+            const double ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start).count();
+            LOG(INFO) << "Warmed up " << batch << "x" << shape.height << "x" << shape.width << " in " << ms
+                << " ms, " << (outputs.empty() || outputs[0].dims() < 2 ? 0 : outputs[0].dim_size(1)) << " anchors";
+        }
+    }
+    return Status::OK();
+}
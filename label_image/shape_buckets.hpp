@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/public/session.h"
+
+#include "tf_detect.hpp"
+
+// Network input shapes chosen per image. With buckets configured in
+// c_preprocess_options, each image goes to the bucket closest to its aspect
+// ratio, and of those the smallest that does not need upscaling, instead
+// of being stretched to one fixed shape. The graph must accept a variable
+// input height and width; anchor counts follow from the output shapes.
+
+// Parses "624x384,384x624,320x320" (width x height).
+bool parse_shape_buckets(const std::string& spec, std::vector<cv::Size>* buckets);
+
+// The buckets, or input_width x input_height when none are set.
+std::vector<cv::Size> input_shapes(const c_preprocess_options& options);
+
+// Network input shape for an image of the given size.
+cv::Size pick_input_shape(const c_preprocess_options& options, const cv::Size& image);
+
+// Decode target for reduced_decode: large enough for every bucket. Empty
+// when reduced_decode is off.
+cv::Size reduced_decode_size(const c_preprocess_options& options);
+
+// Runs every shape at every batch size once per session, so no request pays
+// the first-run cost of a new shape. Logs the time and the anchor count of
+// each shape; a graph that cannot take a shape fails here.
+tensorflow::Status WarmupShapes(tensorflow::Session* session, const c_preprocess_options& options,
+    const std::vector<int>& batch_sizes, const tensorflow::string& input_layer,
+    const std::vector<tensorflow::string>& output_layers, int runs_per_shape);
@@ -0,0 +1,295 @@
+#include "stream.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <thread>
+
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/platform/logging.h"
+
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/video/tracking.hpp>
+
+#include "arena.hpp"
+#include "cv_process.hpp"
+#include "pipeline.hpp"
+#include "shape_buckets.hpp"
+#include "trace.hpp"
+
+using tensorflow::Status;
+using tensorflow::Tensor;
+using tensorflow::string;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+std::atomic<bool> g_stop{ false };
+
+void handle_stop_signal(int) {
+    g_stop = true;
+}
+
+struct c_stream_frame {
+    long long index = 0;
+    double pts_ms = 0;
+    cv::Mat mat;
+    Clock::time_point captured;
+};
+
+// Carries boxes from frame to frame by the median Lucas-Kanade displacement
+// of points seeded inside them at the keyframe. Points failing the
+// forward-backward check are dropped; a box that keeps too few of its
+// points is lost. Works on grey frames downscaled by scale.
+class BoxTracker {
+public:
+    explicit BoxTracker(float min_track_ratio) : min_track_ratio_(min_track_ratio) {}
+
+    void Reset(const cv::Mat& gray, float scale, const std::vector<c_tf_detect_result>& dets) {
+        scale_ = scale;
+        points_.clear();
+        owner_.clear();
+        seeded_.assign(dets.size(), 0);
+        const cv::Rect bounds(0, 0, gray.cols, gray.rows);
+        for (size_t i = 0; i < dets.size(); ++i) {
+            const cv::Rect& r = dets[i].r;
+            const cv::Rect roi = cv::Rect(cvRound(r.x * scale), cvRound(r.y * scale),
+                cvRound(r.width * scale), cvRound(r.height * scale)) & bounds;
+            if (roi.area() == 0)
+                continue;
+            corners_.clear();
+            cv::goodFeaturesToTrack(gray(roi), corners_, 16, 0.01, 2);
+            if (corners_.size() < 4) {
+                // Flat patch: follow a grid instead.
+                corners_.clear();
+                for (int gy = 1; gy <= 3; ++gy) {
+                    for (int gx = 1; gx <= 3; ++gx)
+                        corners_.push_back(cv::Point2f(roi.width * gx / 4.f, roi.height * gy / 4.f));
+                }
+            }
+            for (const cv::Point2f& c : corners_) {
+                points_.push_back(c + cv::Point2f((float)roi.x, (float)roi.y));
+                owner_.push_back(i);
+            }
+            seeded_[i] = corners_.size();
+        }
+    }
+
+    // Moves *dets from prev to gray. Returns false if a box was lost.
+    bool Track(const cv::Mat& prev, const cv::Mat& gray, std::vector<c_tf_detect_result>* dets) {
+        if (points_.empty())
+            return true;
+        const cv::Size window(15, 15);
+        cv::calcOpticalFlowPyrLK(prev, gray, points_, next_, status_, error_, window, 2);
+        cv::calcOpticalFlowPyrLK(gray, prev, next_, back_, back_status_, error_, window, 2);
+
+        dx_.resize(seeded_.size());
+        dy_.resize(seeded_.size());
+        for (size_t i = 0; i < seeded_.size(); ++i) {
+            dx_[i].clear();
+            dy_[i].clear();
+        }
+        size_t kept = 0;
+        for (size_t k = 0; k < points_.size(); ++k) {
+            const cv::Point2f round_trip = back_[k] - points_[k];
+            if (!status_[k] || !back_status_[k] || round_trip.dot(round_trip) > 1.f)
+                continue;
+            dx_[owner_[k]].push_back(next_[k].x - points_[k].x);
+            dy_[owner_[k]].push_back(next_[k].y - points_[k].y);
+            points_[kept] = next_[k];
+            owner_[kept] = owner_[k];
+            ++kept;
+        }
+        points_.resize(kept);
+        owner_.resize(kept);
+
+        bool ok = true;
+        for (size_t i = 0; i < seeded_.size(); ++i) {
+            if (seeded_[i] == 0)
+                continue;
+            if (dx_[i].empty() || dx_[i].size() < min_track_ratio_ * seeded_[i]) {
+                ok = false;
+                continue;
+            }
+            const size_t mid = dx_[i].size() / 2;
+            std::nth_element(dx_[i].begin(), dx_[i].begin() + mid, dx_[i].end());
+            std::nth_element(dy_[i].begin(), dy_[i].begin() + mid, dy_[i].end());
+            (*dets)[i].r.x += cvRound(dx_[i][mid] / scale_);
+            (*dets)[i].r.y += cvRound(dy_[i][mid] / scale_);
+        }
+        return ok;
+    }
+
+private:
+    const float min_track_ratio_;
+    float scale_ = 1.f;
+    std::vector<cv::Point2f> points_, next_, back_, corners_;
+    std::vector<size_t> owner_;   // box index of each point
+    std::vector<size_t> seeded_;  // points per box at the keyframe
+    std::vector<unsigned char> status_, back_status_;
+    std::vector<float> error_;
+    std::vector<std::vector<float> > dx_, dy_;
+};
+
+}  // namespace
+
+Status RunStream(tensorflow::Session* session, const c_stream_options& options) {
+    cv::VideoCapture capture;
+    const bool device = !options.source.empty() &&
+        std::all_of(options.source.begin(), options.source.end(), [](char c) { return c >= '0' && c <= '9'; });
+    if (!(device ? capture.open(std::stoi(options.source)) : capture.open(options.source)))
+        return tensorflow::errors::NotFound("cannot open video source ", options.source);
+
+    FILE* out = nullptr;
+    if (options.out == "-") {
+        out = stdout;
+    }
+    else if (!options.out.empty()) {
+        out = fopen(options.out.c_str(), "w");
+        if (out == nullptr)
+            return tensorflow::errors::Unavailable("cannot write ", options.out);
+    }
+    // A live source does not wait for us; keep only the newest frames.
+    const bool drop = options.drop_frames || device;
+
+    g_stop = false;
+    auto previous_int = std::signal(SIGINT, handle_stop_signal);
+    auto previous_term = std::signal(SIGTERM, handle_stop_signal);
+
+    // Dropping keeps a single slot that each new frame overwrites, so the
+    // detector never works more than one frame behind the source.
+    BoundedQueue<c_stream_frame> frames(drop ? 1 : options.queue_capacity);
+    TraceGauge queue_gauge("stream_queue_depth", [&frames] { return (double)frames.depth(); });
+    std::atomic<long long> dropped{ 0 };
+    std::thread reader([&] {
+        for (long long index = 0; !g_stop; ++index) {
+            c_stream_frame frame;
+            {
+                TRACE_SCOPE("stream_decode");
+                if (!capture.read(frame.mat) || frame.mat.empty())
+                    break;
+            }
+            frame.index = index;
+            frame.pts_ms = capture.get(cv::CAP_PROP_POS_MSEC);
+            frame.captured = Clock::now();
+            if (drop) {
+                bool dropped_oldest;
+                if (!frames.PushDropOldest(std::move(frame), &dropped_oldest))
+                    break;
+                if (dropped_oldest)
+                    ++dropped;
+            }
+            else if (!frames.Push(std::move(frame))) {
+                break;
+            }
+        }
+        frames.Close();
+    });
+
+    const c_preprocess_options& pre = options.preprocess;
+    WorkerArena arena(pre.input_height, pre.input_width);
+    DetectionDecoder decoder(options.top_k);
+    BoxTracker tracker(options.min_track_ratio);
+    std::vector<c_tf_detect_result> dets;
+    cv::Mat small, gray, prev_gray, diff;
+    // Streams run for hours; histograms keep the memory flat.
+    LatencyHistogram detect_latency, frame_latency;
+    long long processed = 0, keyframes = 0, motion_detects = 0, lost_detects = 0;
+    int since_detect = 0;
+    string json;
+    char head[128];
+    Status status;
+    const Clock::time_point start = Clock::now();
+
+    c_stream_frame frame;
+    while (frames.Pop(&frame)) {
+        if (!apply_image_ops(pre, &frame.mat, arena.Scratch()))
+            continue;
+        float scale;
+        bool keyframe = prev_gray.empty() || since_detect >= options.detect_every;
+        {
+            TRACE_SCOPE("track");
+            scale = std::min(1.f, (float)options.track_width / frame.mat.cols);
+            cv::resize(frame.mat, small, cv::Size(), scale, scale, cv::INTER_AREA);
+            cv::cvtColor(small, gray, CV_BGR2GRAY);
+            if (!keyframe && gray.size() != prev_gray.size()) {
+                keyframe = true;
+            }
+            else if (!keyframe) {
+                cv::absdiff(prev_gray, gray, diff);
+                if (cv::mean(diff)[0] > options.max_motion) {
+                    keyframe = true;
+                    ++motion_detects;
+                }
+                else if (!tracker.Track(prev_gray, gray, &dets)) {
+                    keyframe = true;
+                    ++lost_detects;
+                }
+            }
+        }
+
+        if (keyframe) {
+            const cv::Size shape = pick_input_shape(pre, frame.mat.size());
+            Tensor* input = arena.Input(1, shape.height, shape.width);
+            c_image_transform transform;
+            {
+                TRACE_SCOPE("preprocess");
+                if (!preprocess_into_tensor(frame.mat, pre, 0, input, arena.Scratch(), &transform)) {
+                    status = tensorflow::errors::InvalidArgument("cannot preprocess frame ", frame.index);
+                    break;
+                }
+            }
+            status = TracedRun(session, { {options.input_layer, *input} }, options.output_layers, arena.Outputs());
+            if (!status.ok())
+                break;
+            note_inference_done();
+            {
+                TRACE_SCOPE("postprocess");
+                const std::vector<Tensor>& outputs = *arena.Outputs();
+                decoder.Decode(outputs[0], outputs[1], outputs[2], 0, transform, options.threshold);
+                decoder.Suppress(options.nms, &dets);
+                tracker.Reset(gray, scale, dets);
+            }
+            since_detect = 0;
+            ++keyframes;
+        }
+        ++since_detect;
+        std::swap(prev_gray, gray);
+
+        if (out) {
+            detections_to_json(dets, &json);
+            snprintf(head, sizeof(head), "{\"frame\":%lld,\"ms\":%.1f,\"keyframe\":%s,", frame.index, frame.pts_ms,
+                keyframe ? "true" : "false");
+            fputs(head, out);
+            fputs(json.c_str() + 1, out);
+            fputc('\n', out);
+            fflush(out);
+        }
+        const double latency_ms = std::chrono::duration<double, std::milli>(Clock::now() - frame.captured).count();
+        frame_latency.Add(latency_ms);
+        if (keyframe)
+            detect_latency.Add(latency_ms);
+        ++processed;
+        trace_count("frames", 1);
+    }
+
+    g_stop = true;
+    frames.Close();
+    reader.join();
+    std::signal(SIGINT, previous_int);
+    std::signal(SIGTERM, previous_term);
+    if (out != nullptr && out != stdout)
+        fclose(out);
+
+    const double wall_s = std::chrono::duration<double>(Clock::now() - start).count();
+    LOG(INFO) << "Stream: " << processed << " frames in " << wall_s << " s, "
+        << (wall_s > 0 ? processed / wall_s : 0) << " fps effective, " << keyframes << " keyframes ("
+        << motion_detects << " on motion, " << lost_detects << " on lost tracks), " << dropped << " frames dropped";
+    LOG(INFO) << "Latency from capture: keyframes p50 " << detect_latency.Percentile(0.5) << " ms, p95 "
+        << detect_latency.Percentile(0.95) << " ms; all frames p50 " << frame_latency.Percentile(0.5)
+        << " ms, p95 " << frame_latency.Percentile(0.95) << " ms";
+    return status;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/public/session.h"
+
+#include "nms_engine.hpp"
+#include "tf_detect.hpp"
+
+// Detection over a video file, capture device or stream URL. Frames are
+// decoded on their own thread. The detector runs on keyframes only: every
+// detect_every-th frame, and earlier when the scene moves too much or the
+// tracker loses a box. In between, boxes are carried forward by sparse
+// optical flow on a downscaled grey frame.
+//
+// One JSON line per frame goes to out:
+//   {"frame":N,"ms":pts,"keyframe":true|false,"detections":[...]}
+// with detections as in detections_to_json. Nothing is rendered.
+struct c_stream_options {
+    // Video file or URL; a plain number opens that capture device.
+    tensorflow::string source;
+    // "-" for stdout, empty to only log the summary.
+    tensorflow::string out = "-";
+    int detect_every = 5;
+    int queue_capacity = 8;
+    // Drop frames instead of stalling the capture when detection falls
+    // behind: only the newest frame waits, queue_capacity does not apply.
+    // On by default for capture devices.
+    bool drop_frames = false;
+    // Width of the grey frames the tracker and motion check work on.
+    int track_width = 320;
+    // Re-detect when fewer than this share of a box's points can be followed.
+    float min_track_ratio = 0.5f;
+    // Re-detect when the mean absolute grey level change between
+    // consecutive frames exceeds this (0..255).
+    float max_motion = 20.f;
+    c_preprocess_options preprocess;
+    float threshold = 0.6f;
+    c_nms_options nms;
+    int top_k = 0;
+    tensorflow::string input_layer = "image_input";
+    std::vector<tensorflow::string> output_layers;
+};
+
+// Runs until the source ends or SIGINT/SIGTERM, then logs effective FPS,
+// keyframe share and detection latency.
+tensorflow::Status RunStream(tensorflow::Session* session, const c_stream_options& options);
@@ -0,0 +1,234 @@
+#include "tensor_dataset.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "tensorflow/core/framework/allocator.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/hash/hash.h"
+#include "tensorflow/core/lib/strings/strcat.h"
+#include "tensorflow/core/platform/logging.h"
+
+#include "arena.hpp"
+#include "shape_buckets.hpp"
+
+using tensorflow::Status;
+using tensorflow::Tensor;
+using tensorflow::string;
+using tensorflow::uint64;
+
+static const char kMagic[8] = { 'L', 'I', 'T', 'E', 'N', 'S', 'O', 'R' };
+static const tensorflow::uint32 kVersion = 1;
+static const size_t kDataAlignment = 4096;
+// Larger than any network input, small enough that record sizes cannot
+// overflow.
+static const int kMaxSide = 1 << 16;
+
+static uint64 round_up(uint64 value, uint64 alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+uint64 preprocess_hash(const c_preprocess_options& preprocess) {
+    string params = tensorflow::strings::StrCat(preprocess.input_width, "x", preprocess.input_height, "|",
+        preprocess.fused, preprocess.swap_rb, preprocess.letterbox, preprocess.reduced_decode);
+    for (int c = 0; c < 3; ++c)
+        tensorflow::strings::StrAppend(&params, "|", preprocess.means[c], "/", preprocess.stds[c]);
+    for (const c_image_op& op : preprocess.ops)
+        tensorflow::strings::StrAppend(&params, "|op", (int)op.op, ":", op.param);
+    return tensorflow::Hash64(params);
+}
+
+Status WriteTensorDataset(const string& path, const std::vector<string>& image_paths,
+    const c_preprocess_options& preprocess, size_t* written) {
+    if (!preprocess.buckets.empty())
+        return tensorflow::errors::InvalidArgument("tensor datasets hold one input shape; drop input_shapes");
+
+    c_tensor_dataset_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.dtype = tensorflow::DT_FLOAT;
+    header.height = preprocess.input_height;
+    header.width = preprocess.input_width;
+    header.channels = 3;
+    for (int c = 0; c < 3; ++c) {
+        header.means[c] = preprocess.means[c];
+        header.stds[c] = preprocess.stds[c];
+    }
+    header.fused = preprocess.fused;
+    header.swap_rb = preprocess.swap_rb;
+    header.letterbox = preprocess.letterbox;
+    header.preprocess_hash = preprocess_hash(preprocess);
+    header.record_bytes = (uint64)header.height * header.width * header.channels * sizeof(float);
+    header.data_offset = round_up(sizeof(header), kDataAlignment);
+
+    // Written under a temporary name, so an interrupted conversion never
+    // leaves a file that looks complete.
+    const string tmp_path = path + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (file == nullptr)
+        return tensorflow::errors::Unavailable("cannot create ", tmp_path);
+    std::vector<char> padding(header.data_offset, 0);
+    bool ok = fwrite(padding.data(), 1, padding.size(), file) == padding.size();
+
+    std::vector<c_tensor_dataset_record> records;
+    string names;
+    std::vector<unsigned char> file_buffer;
+    cv::Mat mat, scratch;
+    cv::Size original;
+    const cv::Size reduce = reduced_decode_size(preprocess);
+    Tensor input(tensorflow::DT_FLOAT, { 1, header.height, header.width, 3 });
+    for (size_t i = 0; ok && i < image_paths.size(); ++i) {
+        c_tensor_dataset_record record;
+        memset(&record, 0, sizeof(record));
+        if (!read_image_into(image_paths[i], &file_buffer, &mat, reduce.width, reduce.height, &original) ||
+            !apply_image_ops(preprocess, &mat, &scratch) ||
+            !preprocess_into_tensor(mat, preprocess, 0, &input, &scratch, &record.transform, original)) {
+            LOG(WARNING) << "Failed to read image " << image_paths[i] << ", left out of the dataset";
+            continue;
+        }
+        record.original_width = original.width;
+        record.original_height = original.height;
+        record.name_offset = names.size();
+        record.name_length = image_paths[i].size();
+        names += image_paths[i];
+        records.push_back(record);
+        ok = fwrite(input.tensor_data().data(), 1, header.record_bytes, file) == header.record_bytes;
+    }
+
+    header.count = records.size();
+    header.index_offset = round_up(header.data_offset + header.count * header.record_bytes, 8);
+    header.names_offset = header.index_offset + header.count * sizeof(c_tensor_dataset_record);
+    header.names_bytes = names.size();
+    const size_t index_padding = header.index_offset - (header.data_offset + header.count * header.record_bytes);
+    ok = ok && fwrite(padding.data(), 1, index_padding, file) == index_padding &&
+        fwrite(records.data(), sizeof(c_tensor_dataset_record), records.size(), file) == records.size() &&
+        fwrite(names.data(), 1, names.size(), file) == names.size() &&
+        fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        remove(tmp_path.c_str());
+        return tensorflow::errors::DataLoss("cannot write ", path);
+    }
+    *written = header.count;
+    return Status::OK();
+}
+
+namespace {
+
+// Hands a slice of the mapping to exactly one Tensor: allocation returns the
+// slice, deallocation drops the reference on the mapping and the allocator.
+class MappedSliceAllocator : public tensorflow::Allocator {
+public:
+    MappedSliceAllocator(std::shared_ptr<tensorflow::ReadOnlyMemoryRegion> region, const void* data)
+        : region_(std::move(region)), data_(data) {}
+
+    string Name() override { return "tensor_dataset_mmap"; }
+    void* AllocateRaw(size_t alignment, size_t num_bytes) override { return const_cast<void*>(data_); }
+    void DeallocateRaw(void* ptr) override { delete this; }
+
+private:
+    std::shared_ptr<tensorflow::ReadOnlyMemoryRegion> region_;
+    const void* data_;
+};
+
+}  // namespace
+
+Status TensorDataset::Open(const string& path, const c_preprocess_options& expected,
+    std::unique_ptr<TensorDataset>* dataset) {
+    std::unique_ptr<tensorflow::ReadOnlyMemoryRegion> region;
+    TF_RETURN_IF_ERROR(tensorflow::Env::Default()->NewReadOnlyMemoryRegionFromFile(path, &region));
+    std::unique_ptr<TensorDataset> d(new TensorDataset);
+    const uint64 length = region->length();
+    const char* base = (const char*)region->data();
+    if (length < sizeof(c_tensor_dataset_header))
+        return tensorflow::errors::DataLoss(path, " is too short for a tensor dataset");
+    c_tensor_dataset_header& h = d->header_;
+    memcpy(&h, base, sizeof(h));
+    if (memcmp(h.magic, kMagic, sizeof(kMagic)) != 0 || h.version != kVersion)
+        return tensorflow::errors::InvalidArgument(path, " is not a version ", kVersion, " tensor dataset");
+    // count and the offsets come from the file; each is bounded by the
+    // file length before it takes part in any sum or product.
+    if (h.dtype != tensorflow::DT_FLOAT || h.channels != 3 || h.height <= 0 || h.width <= 0 ||
+        h.height > kMaxSide || h.width > kMaxSide ||
+        h.record_bytes != (uint64)h.height * h.width * h.channels * sizeof(float) ||
+        h.data_offset < sizeof(h) || h.data_offset % kDataAlignment != 0 || h.data_offset > length ||
+        h.count > (length - h.data_offset) / h.record_bytes ||
+        h.index_offset % 8 != 0 || h.index_offset < h.data_offset + h.count * h.record_bytes ||
+        h.index_offset > length ||
+        h.count > (length - h.index_offset) / sizeof(c_tensor_dataset_record) ||
+        h.names_offset != h.index_offset + h.count * sizeof(c_tensor_dataset_record) ||
+        h.names_bytes != length - h.names_offset)
+        return tensorflow::errors::DataLoss(path, " has an inconsistent header");
+
+    if (h.preprocess_hash != preprocess_hash(expected)) {
+        return tensorflow::errors::FailedPrecondition(path, " was preprocessed differently (", h.width, "x",
+            h.height, ", means ", h.means[0], ",", h.means[1], ",", h.means[2], ", stds ", h.stds[0], ",",
+            h.stds[1], ",", h.stds[2], ", fused ", h.fused, ", swap_rb ", h.swap_rb, ", letterbox ",
+            h.letterbox, "); rewrite it with write_dataset");
+    }
+
+    d->records_ = (const c_tensor_dataset_record*)(base + h.index_offset);
+    d->names_ = base + h.names_offset;
+    for (size_t i = 0; i < h.count; ++i) {
+        const c_tensor_dataset_record& record = d->records_[i];
+        if (record.name_length > h.names_bytes || record.name_offset > h.names_bytes - record.name_length)
+            return tensorflow::errors::DataLoss(path, " has a bad name for record ", i);
+    }
+    d->region_ = std::move(region);
+#ifdef __linux__
+    posix_madvise((void*)(base + h.data_offset), h.count * h.record_bytes, POSIX_MADV_SEQUENTIAL);
+#endif
+    *dataset = std::move(d);
+    return Status::OK();
+}
+
+string TensorDataset::name(size_t i) const {
+    return string(names_ + records_[i].name_offset, records_[i].name_length);
+}
+
+bool TensorDataset::InMapping(const void* p) const {
+    const char* base = (const char*)region_->data();
+    return (const char*)p >= base && (const char*)p < base + region_->length();
+}
+
+void TensorDataset::Readahead(size_t offset, size_t bytes) const {
+#ifdef __linux__
+    static const size_t page = sysconf(_SC_PAGESIZE);
+    const size_t begin = offset / page * page;
+    posix_madvise((char*)region_->data() + begin, offset + bytes - begin, POSIX_MADV_WILLNEED);
+#endif
+}
+
+Status TensorDataset::Batch(size_t begin, int n, Tensor* out) {
+    if (n < 1 || begin + n > header_.count)
+        return tensorflow::errors::OutOfRange("records ", begin, "..", begin + n, " of ", header_.count);
+    const size_t offset = header_.data_offset + begin * header_.record_bytes;
+    const char* data = (const char*)region_->data() + offset;
+    const tensorflow::TensorShape shape({ n, header_.height, header_.width, 3 });
+    // Eigen maps tensor buffers as aligned; a slice starting elsewhere would
+    // break vectorized kernels, so it is copied.
+    if ((uintptr_t)data % tensorflow::Allocator::kAllocatorAlignment == 0) {
+        *out = Tensor(new MappedSliceAllocator(region_, data), tensorflow::DT_FLOAT, shape);
+        ++mapped_batches_;
+    }
+    else {
+        // Never copy into a tensor that still points at the read only mapping.
+        if (!out->IsInitialized() || out->dtype() != tensorflow::DT_FLOAT || out->shape() != shape ||
+            InMapping(out->tensor_data().data()))
+            *out = Tensor(tensorflow::DT_FLOAT, shape);
+        memcpy(out->flat<float>().data(), data, n * header_.record_bytes);
+        ++copied_batches_;
+    }
+    const size_t next = begin + n;
+    if (next < header_.count)
+        Readahead(offset + n * header_.record_bytes, std::min<size_t>(n, header_.count - next) * header_.record_bytes);
+    return Status::OK();
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "tensorflow/core/framework/tensor.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/platform/env.h"
+
+#include "tf_detect.hpp"
+
+// Preprocessed evaluation sets. WriteTensorDataset decodes and preprocesses
+// a list of images once; every later run maps the file and feeds slices of
+// it straight to the session, skipping JPEG decode and resize.
+//
+// File layout, native byte order:
+//   c_tensor_dataset_header                     at 0
+//   count records of height*width*3 floats      at data_offset (page aligned)
+//   count c_tensor_dataset_record               at index_offset
+//   image names, not terminated                 at names_offset
+// Records are back to back, so records [i, i+n) are one {n,h,w,3} tensor.
+struct c_tensor_dataset_header {
+    char magic[8];
+    tensorflow::uint32 version;
+    // tensorflow::DataType of the records, DT_FLOAT.
+    tensorflow::uint32 dtype;
+    tensorflow::uint64 count;
+    tensorflow::int32 height;
+    tensorflow::int32 width;
+    tensorflow::int32 channels;
+    // Preprocessing the records were made with, for the log and for
+    // mismatch errors; preprocess_hash decides.
+    float means[3];
+    float stds[3];
+    tensorflow::uint32 fused;
+    tensorflow::uint32 swap_rb;
+    tensorflow::uint32 letterbox;
+    tensorflow::uint64 preprocess_hash;
+    tensorflow::uint64 record_bytes;
+    tensorflow::uint64 data_offset;
+    tensorflow::uint64 index_offset;
+    tensorflow::uint64 names_offset;
+    tensorflow::uint64 names_bytes;
+};
+
+struct c_tensor_dataset_record {
+    // Maps boxes on the record back to the source image.
+    c_image_transform transform;
+    tensorflow::int32 original_width;
+    tensorflow::int32 original_height;
+    tensorflow::uint64 name_offset;
+    tensorflow::uint64 name_length;
+};
+
+// Hash of everything that changes the preprocessed pixels: input size,
+// normalization, channel order, letterbox, fused, reduced decode and ops.
+tensorflow::uint64 preprocess_hash(const c_preprocess_options& preprocess);
+
+// Preprocesses image_paths at input_width x input_height into path, the way
+// the batch loop does. Unreadable images are skipped with a warning; written
+// receives how many made it. Shape buckets are not supported.
+tensorflow::Status WriteTensorDataset(const tensorflow::string& path, const std::vector<tensorflow::string>& image_paths,
+    const c_preprocess_options& preprocess, size_t* written);
+
+// A mapped dataset file. Thread safe; tensors from Batch keep the mapping
+// alive and may outlive the dataset.
+class TensorDataset {
+public:
+    // Fails unless the file was written with preprocessing equal to
+    // expected, so a stale dataset cannot silently feed the wrong pixels.
+    static tensorflow::Status Open(const tensorflow::string& path, const c_preprocess_options& expected,
+        std::unique_ptr<TensorDataset>* dataset);
+
+    size_t size() const { return header_.count; }
+    int height() const { return header_.height; }
+    int width() const { return header_.width; }
+    tensorflow::string name(size_t i) const;
+    const c_image_transform& transform(size_t i) const { return records_[i].transform; }
+    cv::Size original(size_t i) const { return cv::Size(records_[i].original_width, records_[i].original_height); }
+
+    // Records [begin, begin + n) as a {n,h,w,3} float tensor. When the slice
+    // is aligned the way TensorFlow needs, the tensor points into the read
+    // only mapping; the caller must hold on to it while it is being run, so
+    // no op ever takes over its buffer to write in place. Otherwise the slice
+    // is copied into *out, reusing its buffer when the shape repeats. The
+    // pages of the following slice are requested ahead.
+    tensorflow::Status Batch(size_t begin, int n, tensorflow::Tensor* out);
+
+    long long mapped_batches() const { return mapped_batches_; }
+    long long copied_batches() const { return copied_batches_; }
+
+private:
+    TensorDataset() = default;
+    // Asks the kernel to start reading [offset, offset + bytes) of the file.
+    void Readahead(size_t offset, size_t bytes) const;
+    bool InMapping(const void* p) const;
+
+    std::shared_ptr<tensorflow::ReadOnlyMemoryRegion> region_;
+    c_tensor_dataset_header header_;
+    const c_tensor_dataset_record* records_ = nullptr;
+    const char* names_ = nullptr;
+    std::atomic<long long> mapped_batches_{ 0 };
+    std::atomic<long long> copied_batches_{ 0 };
+};
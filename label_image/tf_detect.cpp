@@ -0,0 +1,437 @@
+#include "tf_detect.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/io/path.h"
+#include "tensorflow/core/lib/strings/str_util.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/logging.h"
+
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/imgproc/imgproc_c.h>
+
+#include "cv_process.hpp"
+
+using tensorflow::Status;
+using tensorflow::Tensor;
+using tensorflow::TTypes;
+using tensorflow::string;
+
+Status LoadGraph(const string& graph_file_name, const string& gpu_list,
+    std::unique_ptr<tensorflow::Session>* session, tensorflow::GraphDef& graph_def,
+    const c_load_options& load_options, std::unique_ptr<tensorflow::MemmappedEnv>* mmap_env) {
+    tensorflow::Env* env = tensorflow::Env::Default();
+    const tensorflow::uint64 start_us = env->NowMicros();
+
+    tensorflow::SessionOptions options_;
+    //   tensorflow::GPUOptions g_option;
+    //   g_option.set_visible_device_list(gpu_list);
+    options_.config.set_allow_soft_placement(true);
+    //   options_.config.set_allocated_gpu_options(&g_option);
+
+    Status load_graph_status;
+    if (load_options.memmapped && load_options.optimize.enabled) {
+        return tensorflow::errors::InvalidArgument("memmapped models are optimized before conversion, "
+            "see generate_inception_v4_pb.txt");
+    }
+    if (load_options.memmapped) {
+        if (mmap_env == nullptr)
+            return tensorflow::errors::InvalidArgument("memmapped model needs an env to own the mapping");
+        mmap_env->reset(new tensorflow::MemmappedEnv(env));
+        load_graph_status = (*mmap_env)->InitializeFromFile(graph_file_name);
+        if (load_graph_status.ok())
+            load_graph_status = ReadBinaryProto(mmap_env->get(),
+                tensorflow::MemmappedFileSystem::kMemmappedPackageDefaultGraphDef, &graph_def);
+        // ImmutableConst tensors point into the mapping; constant folding at
+        // L1 would copy them onto the heap and lose the sharing.
+        options_.env = mmap_env->get();
+        options_.config.mutable_graph_options()->mutable_optimizer_options()->set_opt_level(
+            tensorflow::OptimizerOptions::L0);
+    }
+    else if (load_options.optimize.enabled) {
+        load_graph_status = LoadOptimizedGraph(graph_file_name, load_options.optimize, &graph_def);
+    }
+    else {
+        load_graph_status = ReadBinaryProto(env, graph_file_name, &graph_def);
+    }
+    if (!load_graph_status.ok()) {
+        return tensorflow::errors::NotFound("Failed to load compute graph at '",
+            graph_file_name, "': ", load_graph_status.error_message());
+    }
+    if (load_options.xla_jit) {
+        // ImmutableConst tensors cannot be compiled in as constants.
+        if (load_options.memmapped)
+            return tensorflow::errors::InvalidArgument("xla_jit does not work with memmapped models");
+        // Global JIT clusters CPU ops only with this flag, and TF reads
+        // TF_XLA_FLAGS once, when the first session is created. Added once,
+        // however many XLA sessions are loaded.
+        const char* flags = getenv("TF_XLA_FLAGS");
+        const string xla_flags = flags ? flags : "";
+        if (xla_flags.find("--tf_xla_cpu_global_jit") == string::npos)
+            setenv("TF_XLA_FLAGS", (xla_flags + " --tf_xla_cpu_global_jit").c_str(), 1);
+        options_.config.mutable_graph_options()->mutable_optimizer_options()->set_global_jit_level(
+            tensorflow::OptimizerOptions::ON_1);
+    }
+    const tensorflow::uint64 read_us = env->NowMicros();
+
+    if (!load_options.dump_text_graph.empty()) {
+        Status dump_status = WriteTextProto(env, load_options.dump_text_graph, graph_def);
+        if (!dump_status.ok())
+            LOG(WARNING) << "graph dump failed: " << dump_status;
+    }
+
+    const c_session_pool_options& pool = load_options.pool;
+    if (pool.sessions != 1 || !pool.dev_list.empty()) {
+        TF_RETURN_IF_ERROR(SessionPool::New(graph_def, options_, pool, session));
+    }
+    else {
+        if (pool.intra_op_threads > 0)
+            options_.config.set_intra_op_parallelism_threads(pool.intra_op_threads);
+        if (pool.inter_op_threads > 0)
+            options_.config.set_inter_op_parallelism_threads(pool.inter_op_threads);
+        session->reset(tensorflow::NewSession(options_));
+        Status session_create_status = (*session)->Create(graph_def);
+        if (!session_create_status.ok()) {
+            return session_create_status;
+        }
+    }
+    // Eight bit graphs from QuantizeGraph load like any other; say so.
+    int quantized_ops = 0;
+    for (const tensorflow::NodeDef& node : graph_def.node()) {
+        if (tensorflow::str_util::StartsWith(node.op(), "Quantized"))
+            ++quantized_ops;
+    }
+    LOG(INFO) << "loaded " << graph_file_name << (load_options.memmapped ? " (memmapped)" : "")
+        << (load_options.xla_jit ? " (xla jit)" : "")
+        << (quantized_ops > 0 ? " (" + std::to_string(quantized_ops) + " quantized ops)" : string())
+        << ": read " << (read_us - start_us) / 1000.0 << "ms, session create "
+        << (env->NowMicros() - read_us) / 1000.0 << "ms";
+    return Status::OK();
+}
+
+static std::atomic<tensorflow::uint64> startup_us{ 0 };
+static std::atomic<bool> first_inference_seen{ false };
+
+void mark_startup() {
+    startup_us = tensorflow::Env::Default()->NowMicros();
+}
+
+void note_inference_done() {
+    if (first_inference_seen.exchange(true))
+        return;
+    const tensorflow::uint64 now = tensorflow::Env::Default()->NowMicros();
+    LOG(INFO) << "time to first inference: " << (now - startup_us) / 1000.0 << "ms";
+}
+
+static bool is_image_file(const string& name) {
+    string lower = tensorflow::str_util::Lowercase(name);
+    for (const char* ext : { ".jpg", ".jpeg", ".png", ".bmp" }) {
+        if (tensorflow::str_util::EndsWith(lower, ext))
+            return true;
+    }
+    return false;
+}
+
+Status ListImages(const string& image_dir, const string& image_list, std::vector<string>* paths) {
+    paths->clear();
+    if (!image_dir.empty()) {
+        std::vector<string> children;
+        TF_RETURN_IF_ERROR(tensorflow::Env::Default()->GetChildren(image_dir, &children));
+        std::sort(children.begin(), children.end());
+        for (const string& child : children) {
+            if (is_image_file(child))
+                paths->push_back(tensorflow::io::JoinPath(image_dir, child));
+        }
+    }
+    if (!image_list.empty()) {
+        std::ifstream file(image_list);
+        if (!file) {
+            return tensorflow::errors::NotFound("Image list ", image_list, " not found.");
+        }
+        string line;
+        while (std::getline(file, line)) {
+            line = tensorflow::str_util::StripWhitespace(line).ToString();
+            if (!line.empty())
+                paths->push_back(line);
+        }
+    }
+    return Status::OK();
+}
+
+void fill_input_tensor(const cv::Mat& img, int batch_index, Tensor* batch) {
+    const int input_height = batch->dim_size(1);
+    const int input_width = batch->dim_size(2);
+    const size_t row_floats = (size_t)input_width * 3;
+    float* slot = batch->flat<float>().data() + batch_index * input_height * row_floats;
+    //Copy all the data over, a row at a time
+    for (int y = 0; y < input_height; ++y) {
+        memcpy(slot + y * row_floats, img.ptr<float>(y), row_floats * sizeof(float));
+    }
+}
+
+bool apply_image_ops(const c_preprocess_options& options, cv::Mat* mat, cv::Mat* scratch) {
+    if (options.ops.empty())
+        return true;
+    if (!cvprocess::applyOps(*mat, options.ops, *scratch))
+        return false;
+    if (mat->channels() == 1) {
+        cv::cvtColor(*mat, *scratch, CV_GRAY2BGR);
+        std::swap(*mat, *scratch);
+    }
+    return true;
+}
+
+bool preprocess_into_tensor(const cv::Mat& mat, const c_preprocess_options& options, int batch_index,
+    Tensor* batch, cv::Mat* scratch, c_image_transform* transform, const cv::Size& original) {
+    if (mat.data == nullptr || mat.type() != CV_8UC3)
+        return false;
+    *transform = c_image_transform();
+    const int source_width = original.width > 0 ? original.width : mat.cols;
+    const int source_height = original.height > 0 ? original.height : mat.rows;
+    // The batch tensor decides the network size, so one set of options
+    // serves every shape bucket.
+    const int input_height = batch->dim_size(1);
+    const int input_width = batch->dim_size(2);
+    if (options.fused) {
+        const size_t slot_floats = (size_t)input_height * input_width * 3;
+        float* slot = batch->flat<float>().data() + batch_index * slot_floats;
+        cv::Rect content;
+        if (!cvprocess::preprocessInto(mat, options.means, options.stds, input_width, input_height,
+                options.swap_rb, options.letterbox, slot, *scratch, &content))
+            return false;
+        transform->scale_factor_w = (float)content.width / source_width;
+        transform->scale_factor_h = (float)content.height / source_height;
+        transform->pad_x = content.x;
+        transform->pad_y = content.y;
+        return true;
+    }
+
+    cv::Mat src = mat;
+    if (!cvprocess::resizeImage(src, options.means[0], options.means[1], options.means[2],
+            input_width, input_height, *scratch))
+        return false;
+    fill_input_tensor(*scratch, batch_index, batch);
+    transform->scale_factor_w = (float)scratch->cols / source_width;
+    transform->scale_factor_h = (float)scratch->rows / source_height;
+    return true;
+}
+
+void DetectionDecoder::Decode(const Tensor& boxes, const Tensor& classes, const Tensor& scores,
+    int batch_index, const c_image_transform& transform, float threshold, bool append) {
+    // scores/classes are laid out {N,anchors}, so each image owns a
+    // contiguous run of the flattened outputs.
+    const int anchors = boxes.dim_size(1);
+    const int offset = batch_index * anchors;
+    const float* score = scores.flat<float>().data() + offset;
+    const long long* nclass = classes.flat<long long>().data() + offset;
+    const float* box = boxes.flat<float>().data() + (size_t)offset * 4;
+
+    if ((int)selected_.size() < anchors)
+        selected_.resize(anchors);
+    int count = nms_select_candidates(score, anchors, threshold, selected_.data());
+    if (top_k_ > 0 && count > top_k_) {
+        std::nth_element(selected_.begin(), selected_.begin() + top_k_, selected_.begin() + count,
+            [score](int a, int b) { return score[a] > score[b]; });
+        count = top_k_;
+    }
+
+    const float inv_w = 1.f / transform.scale_factor_w;
+    const float inv_h = 1.f / transform.scale_factor_h;
+    const float ox = transform.offset_x;
+    const float oy = transform.offset_y;
+    if (!append)
+        boxes_.clear();
+    for (int k = 0; k < count; ++k) {
+        const int i = selected_[k];
+        const float* b = box + i * 4;
+        const float half_w = std::fabs(b[2]) * 0.5f;
+        const float half_h = std::fabs(b[3]) * 0.5f;
+        boxes_.push_back((b[0] - half_w - transform.pad_x) * inv_w + ox, (b[1] - half_h - transform.pad_y) * inv_h + oy,
+            (b[0] + half_w - transform.pad_x) * inv_w + ox, (b[1] + half_h - transform.pad_y) * inv_h + oy,
+            score[i], (int)nclass[i]);
+    }
+}
+
+void DetectionDecoder::Suppress(const c_nms_options& options, std::vector<c_tf_detect_result>* dst) {
+    engine_.Run(boxes_, options, &keep_);
+    dst->clear();
+    for (const c_nms_keep& k : keep_) {
+        c_tf_detect_result res;
+        res.nclass = boxes_.label[k.index];
+        res.score = k.score;
+        res.r = cv::Rect(cv::Point(cvRound(k.x1), cvRound(k.y1)), cv::Point(cvRound(k.x2), cvRound(k.y2)));
+        dst->push_back(res);
+    }
+}
+
+void prepare_tf_detect_result(const Tensor& boxes, const Tensor& classes, const Tensor& scores,
+    int batch_index, const c_image_transform& transform, float threshold,
+    std::map<int, std::vector<c_tf_detect_result> > & dst) {
+    thread_local DetectionDecoder decoder;
+    decoder.Decode(boxes, classes, scores, batch_index, transform, threshold);
+    const NmsBoxes& cand = decoder.candidates();
+    dst.clear();
+    for (size_t i = 0; i < cand.size(); ++i) {
+        c_tf_detect_result nr;
+        nr.nclass = cand.label[i];
+        nr.score = cand.score[i];
+        nr.r = cv::Rect(cv::Point(cvRound(cand.x1[i]), cvRound(cand.y1[i])),
+            cv::Point(cvRound(cand.x2[i]), cvRound(cand.y2[i])));
+        dst[nr.nclass].push_back(nr);
+    }
+}
+
+void nms_plus(std::map<int, std::vector<c_tf_detect_result> >& input,
+    std::map<int, std::vector<c_tf_detect_result> >& output, const c_nms_options& options) {
+    output.clear();
+
+    // All classes go through the engine in one pass; it only lets boxes of
+    // the same label suppress each other.
+    thread_local NmsBoxes boxes;
+    thread_local NmsEngine engine;
+    thread_local std::vector<c_nms_keep> keep;
+    thread_local std::vector<const c_tf_detect_result*> refs;
+    boxes.clear();
+    refs.clear();
+    for (auto iter = input.begin(); iter != input.end(); ++iter) {
+        for (const c_tf_detect_result& det : iter->second) {
+            boxes.push_back(det.r.x, det.r.y, det.r.x + det.r.width, det.r.y + det.r.height,
+                det.score, iter->first);
+            refs.push_back(&det);
+        }
+    }
+
+    engine.Run(boxes, options, &keep);
+    for (const c_nms_keep& k : keep) {
+        c_tf_detect_result res = *refs[k.index];
+        res.score = k.score;
+        if (options.mode == NmsMode::ScoreWeighted) {
+            res.r = cv::Rect(cv::Point(cvRound(k.x1), cvRound(k.y1)), cv::Point(cvRound(k.x2), cvRound(k.y2)));
+        }
+        output[res.nclass].push_back(res);
+    }
+}
+
+void nms_plus(std::map<int, std::vector<c_tf_detect_result> >& input,
+    std::map<int, std::vector<c_tf_detect_result> >& output, float thresh) {
+    c_nms_options options;
+    options.iou_threshold = thresh;
+    options.inclusive = true;
+    nms_plus(input, output, options);
+}
+
+void nms_plus_ref(const std::map<int, std::vector<c_tf_detect_result> >& input,
+    std::map<int, std::vector<c_tf_detect_result> >& output, float thresh, bool inclusive) {
+    output.clear();
+
+    for (auto iter = input.begin(); iter != input.end(); ++iter) {
+        // Stable, so equal scores are taken latest input first, as the
+        // engine does.
+        std::vector<c_tf_detect_result> src = iter->second;
+        std::stable_sort(src.begin(), src.end(),
+            [](const c_tf_detect_result& c1, const c_tf_detect_result& c2) { return c1.score < c2.score; });
+
+        std::vector<c_tf_detect_result> dst;
+        while (src.size() > 0) {
+            // grab the last rectangle
+            c_tf_detect_result last = src.back();
+            const cv::Rect& rect1 = last.r;
+            src.pop_back();
+
+            for (auto pos = std::begin(src); pos != std::end(src); ) {
+                const cv::Rect& rect2 = pos->r;
+                float intArea = (rect1 & rect2).area();
+                float unionArea = rect1.area() + rect2.area() - intArea;
+                float overlap = intArea / unionArea;
+
+                // if there is sufficient overlap, suppress the current bounding box
+                if (inclusive ? overlap >= thresh : overlap > thresh)
+                    pos = src.erase(pos);
+                else
+                    ++pos;
+            }
+            dst.push_back(last);
+        }
+        output.insert(std::make_pair(iter->first, dst));
+    }
+}
+
+void detections_to_json(const std::vector<c_tf_detect_result>& dets, string* out) {
+    out->clear();
+    out->append("{\"detections\":[");
+    char buf[160];
+    for (size_t i = 0; i < dets.size(); ++i) {
+        const c_tf_detect_result& d = dets[i];
+        snprintf(buf, sizeof(buf), "%s{\"class\":%d,\"score\":%.6g,\"x\":%d,\"y\":%d,\"w\":%d,\"h\":%d}",
+            i ? "," : "", d.nclass, d.score, d.r.x, d.r.y, d.r.width, d.r.height);
+        out->append(buf);
+    }
+    out->append("]}");
+}
+
+void detections_to_binary(const std::vector<c_tf_detect_result>& dets, string* out) {
+    // The record layout is fixed little-endian; x86 and ARM hosts write it
+    // as-is.
+    const uint32_t count = dets.size();
+    out->resize(sizeof(count) + dets.size() * 6 * 4);
+    char* p = &(*out)[0];
+    memcpy(p, &count, sizeof(count));
+    p += sizeof(count);
+    for (const c_tf_detect_result& d : dets) {
+        const int32_t rec[6] = { d.nclass, 0, d.r.x, d.r.y, d.r.width, d.r.height };
+        memcpy(p, rec, sizeof(rec));
+        memcpy(p + 4, &d.score, 4);
+        p += sizeof(rec);
+    }
+}
+
+bool detections_from_binary(const char* data, size_t size, std::vector<c_tf_detect_result>* dets) {
+    uint32_t count;
+    if (size < sizeof(count))
+        return false;
+    memcpy(&count, data, sizeof(count));
+    if (size != sizeof(count) + (size_t)count * 6 * 4)
+        return false;
+    dets->resize(count);
+    const char* p = data + sizeof(count);
+    for (c_tf_detect_result& d : *dets) {
+        int32_t rec[6];
+        memcpy(rec, p, sizeof(rec));
+        d.nclass = rec[0];
+        memcpy(&d.score, p + 4, 4);
+        d.r = cv::Rect(rec[2], rec[3], rec[4], rec[5]);
+        p += sizeof(rec);
+    }
+    return true;
+}
+
+void draw_detections(cv::Mat& mat, const std::vector<c_tf_detect_result>& dst, float scale) {
+    char text[16];
+    for (auto iter = dst.begin(); iter != dst.end(); ++iter) {
+        int x1 = cvRound(iter->r.x * scale);
+        int y1 = cvRound(iter->r.y * scale);
+        int x2 = cvRound((iter->r.x + iter->r.width) * scale);
+        int y2 = cvRound((iter->r.y + iter->r.height) * scale);
+        cv::rectangle(mat, cv::Point(x1, y1), cv::Point(x2, y2), cv::Scalar(255, 0, 0), 2);
+        snprintf(text, sizeof(text), "%.3f", iter->score);
+        cv::putText(mat, text
+            , cv::Point(x1, y1)
+            , CV_FONT_HERSHEY_COMPLEX
+            , 0.8
+            , cv::Scalar(0, 0, 255));
+    }
+}
+
+void render_detections(cv::Mat& mat, const std::vector<c_tf_detect_result>& dst,
+    const string& out_path, float scale) {
+    draw_detections(mat, dst, scale);
+    cv::imwrite(out_path, mat);
+}
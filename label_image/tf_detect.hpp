@@ -0,0 +1,214 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "tensorflow/core/framework/graph.pb.h"
+#include "tensorflow/core/framework/tensor.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/public/session.h"
+#include "tensorflow/core/util/memmapped_file_system.h"
+
+#include <opencv2/core/core.hpp>
+
+#include "graph_optimize.hpp"
+#include "image_ops.hpp"
+#include "nms_engine.hpp"
+#include "session_pool.hpp"
+
+struct c_tf_detect_result {
+    int nclass;
+    float score;
+    cv::Rect r;
+};
+
+// Maps network-input coordinates back onto the source image:
+// src = (net - pad) / scale_factor + offset. offset is where a tile starts in
+// the source image.
+struct c_image_transform {
+    float scale_factor_w = 1.f;
+    float scale_factor_h = 1.f;
+    float pad_x = 0.f;
+    float pad_y = 0.f;
+    float offset_x = 0.f;
+    float offset_y = 0.f;
+};
+
+struct c_preprocess_options {
+    int input_width = 299;
+    int input_height = 299;
+    float means[3] = { 103.939f, 116.779f, 123.68f };  // BGR
+    float stds[3] = { 1.f, 1.f, 1.f };
+    // Use cvprocess::preprocessInto instead of resizeImage + fill_input_tensor.
+    bool fused = false;
+    // Fused path only.
+    bool swap_rb = false;
+    bool letterbox = false;
+    // Let libjpeg decode at 1/2, 1/4 or 1/8 scale when that still covers the
+    // input size (cvprocess::decodeForInput). Boxes are still reported in
+    // full resolution coordinates.
+    bool reduced_decode = false;
+    // Applied to every decoded image before preprocessing and rendering, see
+    // cvprocess::applyOps.
+    std::vector<c_image_op> ops;
+    // Input shapes (width x height) to choose from per image, see
+    // shape_buckets.hpp. Empty uses input_width x input_height for all.
+    std::vector<cv::Size> buckets;
+};
+
+struct c_load_options {
+    // The graph file was written by convert_graphdef_memmapped_format: weights
+    // are ImmutableConst regions of the file, paged in on first use and shared
+    // with every other process mapping the same file.
+    bool memmapped = false;
+    // Write the loaded GraphDef as text here, for debugging. Empty skips it.
+    tensorflow::string dump_text_graph;
+    // Load-time graph optimization, not available for memmapped models.
+    c_graph_optimize_options optimize;
+    // More than one session, or any dev_list, loads a SessionPool; the
+    // thread counts apply to a single session as well.
+    c_session_pool_options pool;
+    // Compile the graph with the XLA JIT on CPU: clusters of ops become fused
+    // native code specialized to the input shape, instead of one kernel
+    // dispatch and intermediate buffer per op. Each new input shape compiles
+    // once on its first Run. Needs TensorFlow built with XLA. TensorFlow
+    // reads the CPU JIT flag only when the process creates its first
+    // session, so an XLA graph must be loaded before any other; otherwise
+    // set TF_XLA_FLAGS=--tf_xla_cpu_global_jit before starting.
+    bool xla_jit = false;
+};
+
+// Reads a model graph definition from disk, and creates a session object you
+// can use to run it. A memmapped model needs mmap_env, which keeps the file
+// mapped and has to outlive the session.
+tensorflow::Status LoadGraph(const tensorflow::string& graph_file_name, const tensorflow::string& gpu_list,
+    std::unique_ptr<tensorflow::Session>* session, tensorflow::GraphDef& graph_def,
+    const c_load_options& options = c_load_options(),
+    std::unique_ptr<tensorflow::MemmappedEnv>* mmap_env = nullptr);
+
+// Cold start accounting. mark_startup() goes first thing in main; every
+// inference path calls note_inference_done() after session->Run, and the
+// first call logs the time since startup.
+void mark_startup();
+void note_inference_done();
+
+// Collects the image files to process. A directory is scanned for image
+// extensions (sorted by name), a list file holds one path per line.
+tensorflow::Status ListImages(const tensorflow::string& image_dir, const tensorflow::string& image_list,
+    std::vector<tensorflow::string>* paths);
+
+// Copies a preprocessed CV_32FC3 image into slot batch_index of a
+// {N,H,W,3} float tensor.
+void fill_input_tensor(const cv::Mat& img, int batch_index, tensorflow::Tensor* batch);
+
+// Applies options.ops to a decoded image and brings the result back to 8-bit
+// BGR for the network. Nothing to do without ops.
+bool apply_image_ops(const c_preprocess_options& options, cv::Mat* mat, cv::Mat* scratch);
+
+// Preprocesses a decoded BGR image into slot batch_index of a {N,H,W,3} float
+// tensor; transform receives how to map boxes back. scratch is reused across
+// calls. When mat was decoded at reduced size, original is the full size and
+// boxes map back onto that instead. Returns false, leaving the slot as it was,
+// unless mat is a non empty CV_8UC3 image.
+bool preprocess_into_tensor(const cv::Mat& mat, const c_preprocess_options& options, int batch_index,
+    tensorflow::Tensor* batch, cv::Mat* scratch, c_image_transform* transform,
+    const cv::Size& original = cv::Size());
+
+// Decodes one image of the batched boxes {N,anchors,4} (cx,cy,w,h), classes
+// {N,anchors} and scores {N,anchors} outputs. Candidates at or above the
+// threshold are found with a vectorized pass over the scores, cut down to the
+// top_k best, and kept as float boxes in source image coordinates in flat
+// per-label arrays. All storage is reused, so once warm, decoding and
+// suppression do not allocate. Use one decoder per thread.
+class DetectionDecoder {
+public:
+    // top_k <= 0 keeps every candidate above the threshold.
+    explicit DetectionDecoder(int top_k = 0) : top_k_(top_k) {}
+
+    void set_top_k(int top_k) { top_k_ = top_k; }
+
+    // append keeps the candidates of earlier calls, so the tiles of one image
+    // are merged by a single Suppress.
+    void Decode(const tensorflow::Tensor& boxes, const tensorflow::Tensor& classes,
+        const tensorflow::Tensor& scores, int batch_index,
+        const c_image_transform& transform, float threshold, bool append = false);
+
+    // Candidates from the last Decode, labelled with their class.
+    const NmsBoxes& candidates() const { return boxes_; }
+
+    // Drops the candidates from index begin on for which
+    // remove(x1, y1, x2, y2) is true, keeping the order of the rest.
+    template <typename Pred>
+    void RemoveCandidates(size_t begin, Pred remove) {
+        size_t kept = begin;
+        for (size_t i = begin; i < boxes_.size(); ++i) {
+            if (remove(boxes_.x1[i], boxes_.y1[i], boxes_.x2[i], boxes_.y2[i]))
+                continue;
+            boxes_.x1[kept] = boxes_.x1[i];
+            boxes_.y1[kept] = boxes_.y1[i];
+            boxes_.x2[kept] = boxes_.x2[i];
+            boxes_.y2[kept] = boxes_.y2[i];
+            boxes_.area[kept] = boxes_.area[i];
+            boxes_.score[kept] = boxes_.score[i];
+            boxes_.label[kept] = boxes_.label[i];
+            ++kept;
+        }
+        for (auto* v : { &boxes_.x1, &boxes_.y1, &boxes_.x2, &boxes_.y2, &boxes_.area, &boxes_.score })
+            v->resize(kept);
+        boxes_.label.resize(kept);
+    }
+
+    // Suppresses the candidates and replaces dst with the survivors, grouped
+    // by class with the best score first. Boxes are rounded only here.
+    void Suppress(const c_nms_options& options, std::vector<c_tf_detect_result>* dst);
+
+private:
+    int top_k_;
+    std::vector<int> selected_;
+    NmsBoxes boxes_;
+    NmsEngine engine_;
+    std::vector<c_nms_keep> keep_;
+};
+
+// Decodes the detections of image batch_index from the batched
+// boxes {N,anchors,4}, classes {N,anchors} and scores {N,anchors} outputs.
+void prepare_tf_detect_result(const tensorflow::Tensor& boxes, const tensorflow::Tensor& classes,
+    const tensorflow::Tensor& scores, int batch_index,
+    const c_image_transform& transform, float threshold,
+    std::map<int, std::vector<c_tf_detect_result> > & dst);
+
+// Per-class suppression of prepare_tf_detect_result output with NmsEngine.
+void nms_plus(std::map<int, std::vector<c_tf_detect_result> >& input,
+    std::map<int, std::vector<c_tf_detect_result> >& output, const c_nms_options& options);
+
+// Hard suppression at iou >= thresh.
+void nms_plus(std::map<int, std::vector<c_tf_detect_result> >& input,
+    std::map<int, std::vector<c_tf_detect_result> >& output, float thresh);
+
+// The per-class sort and erase suppression nms_plus had before NmsEngine,
+// kept as the reference for checks. Hard mode only; inclusive as in
+// c_nms_options.
+void nms_plus_ref(const std::map<int, std::vector<c_tf_detect_result> >& input,
+    std::map<int, std::vector<c_tf_detect_result> >& output, float thresh, bool inclusive);
+
+// Serializes detections as {"detections":[{"class":..,"score":..,"x":..,
+// "y":..,"w":..,"h":..},...]}.
+void detections_to_json(const std::vector<c_tf_detect_result>& dets, tensorflow::string* out);
+
+// Serializes detections as a little-endian uint32 count followed by one
+// {int32 class, float32 score, int32 x, y, w, h} record per detection.
+void detections_to_binary(const std::vector<c_tf_detect_result>& dets, tensorflow::string* out);
+
+// Parses detections_to_binary output; false if size does not match.
+bool detections_from_binary(const char* data, size_t size, std::vector<c_tf_detect_result>* dets);
+
+// Draws boxes and scores onto the decoded image. Boxes are multiplied by
+// scale first, for images decoded at reduced size.
+void draw_detections(cv::Mat& mat, const std::vector<c_tf_detect_result>& dst, float scale = 1.f);
+
+// draw_detections, then writes the image to out_path. DetectionSink does the
+// same off the inference thread.
+void render_detections(cv::Mat& mat, const std::vector<c_tf_detect_result>& dst,
+    const tensorflow::string& out_path, float scale = 1.f);
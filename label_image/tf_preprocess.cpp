@@ -0,0 +1,107 @@
+#include "tf_preprocess.hpp"
+
+#include "tensorflow/cc/framework/scope.h"
+#include "tensorflow/cc/ops/array_ops.h"
+#include "tensorflow/cc/ops/const_op.h"
+#include "tensorflow/cc/ops/image_ops.h"
+#include "tensorflow/cc/ops/math_ops.h"
+#include "tensorflow/core/framework/graph.pb.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/strings/strcat.h"
+
+using tensorflow::Status;
+using tensorflow::Tensor;
+using tensorflow::string;
+
+TfPreprocessor::TfPreprocessor(const c_preprocess_options& options,
+    const tensorflow::SessionOptions& session_options)
+    : options_(options), session_(tensorflow::NewSession(session_options)) {}
+
+Status TfPreprocessor::Prepare(Format format, int width, int height, c_graph* graph) {
+    std::lock_guard<std::mutex> lock(mu_);
+    const auto key = std::make_tuple((int)format, width, height);
+    auto it = graphs_.find(key);
+    if (it != graphs_.end()) {
+        *graph = it->second;
+        return Status::OK();
+    }
+
+    using namespace ::tensorflow::ops;  // NOLINT(build/namespaces)
+    static const char* const kFormatNames[] = { "jpeg", "png", "gif" };
+    const string prefix = tensorflow::strings::StrCat("preprocess_", kFormatNames[format], "_", width, "x", height);
+    tensorflow::Scope root = tensorflow::Scope::NewRootScope().NewSubScope(prefix);
+    auto encoded = Placeholder(root.WithOpName("encoded"), tensorflow::DT_STRING);
+    tensorflow::Output decoded;
+    if (format == kPng)
+        decoded = DecodePng(root, encoded, DecodePng::Channels(3));
+    else if (format == kGif)
+        // DecodeGif returns {frames,h,w,3}; only single frame images squeeze.
+        decoded = Squeeze(root, DecodeGif(root, encoded), Squeeze::Axis({ 0 }));
+    else
+        decoded = DecodeJpeg(root, encoded, DecodeJpeg::Channels(3));
+    auto shape = Shape(root.WithOpName("shape"), decoded);
+    // ResizeBilinear takes the uint8 image and returns float, so no separate
+    // cast pass over the full resolution pixels.
+    auto resized = ResizeBilinear(root, ExpandDims(root, decoded, 0), Const(root, { height, width }));
+    // Decoded pixels are RGB; the options are BGR.
+    const float* m = options_.means;
+    const float* s = options_.stds;
+    tensorflow::Output normalized = Mul(root, Sub(root, resized, { m[2], m[1], m[0] }),
+        { 1.f / s[2], 1.f / s[1], 1.f / s[0] });
+    if (!options_.swap_rb)
+        normalized = ReverseV2(root, normalized, { 3 });
+    Identity(root.WithOpName("normalized"), normalized);
+
+    tensorflow::GraphDef graph_def;
+    TF_RETURN_IF_ERROR(root.ToGraphDef(&graph_def));
+    TF_RETURN_IF_ERROR(created_ ? session_->Extend(graph_def) : session_->Create(graph_def));
+    created_ = true;
+
+    c_graph& added = graphs_[key];
+    added.input = prefix + "/encoded";
+    added.output = prefix + "/normalized";
+    added.shape = prefix + "/shape";
+    *graph = added;
+    return Status::OK();
+}
+
+Status TfPreprocessor::Preprocess(const string& encoded, int width, int height, Tensor* out,
+    cv::Size* original) {
+    const unsigned char* bytes = (const unsigned char*)encoded.data();
+    Format format;
+    if (encoded.size() >= 3 && bytes[0] == 0xFF && bytes[1] == 0xD8 && bytes[2] == 0xFF)
+        format = kJpeg;
+    else if (encoded.size() >= 8 && encoded.compare(0, 8, "\x89PNG\r\n\x1a\n") == 0)
+        format = kPng;
+    else if (encoded.size() >= 6 && (encoded.compare(0, 6, "GIF87a") == 0 || encoded.compare(0, 6, "GIF89a") == 0))
+        format = kGif;
+    else
+        return tensorflow::errors::InvalidArgument("not a JPEG, PNG or GIF image");
+
+    c_graph graph;
+    TF_RETURN_IF_ERROR(Prepare(format, width, height, &graph));
+    Tensor input(tensorflow::DT_STRING, tensorflow::TensorShape());
+    input.scalar<string>()() = encoded;
+    std::vector<Tensor> outputs;
+    TF_RETURN_IF_ERROR(session_->Run({ { graph.input, input } }, { graph.output, graph.shape }, {}, &outputs));
+    *out = outputs[0];
+    if (original != nullptr) {
+        auto dims = outputs[1].flat<tensorflow::int32>();
+        *original = cv::Size(dims(1), dims(0));
+    }
+    return Status::OK();
+}
+
+Status TfPreprocessor::Preprocess(const string& encoded, Tensor* out, c_image_transform* transform) {
+    cv::Size original;
+    TF_RETURN_IF_ERROR(Preprocess(encoded, options_.input_width, options_.input_height, out, &original));
+    *transform = c_image_transform();
+    transform->scale_factor_w = (float)options_.input_width / original.width;
+    transform->scale_factor_h = (float)options_.input_height / original.height;
+    return Status::OK();
+}
+
+size_t TfPreprocessor::graphs() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return graphs_.size();
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+
+#include "tensorflow/core/framework/tensor.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/public/session.h"
+
+#include "tf_detect.hpp"
+
+// TensorFlow native preprocessing: encoded bytes are fed to a
+// DecodeJpeg/DecodePng/DecodeGif -> ResizeBilinear -> normalize graph, the
+// same steps ReadTensorFromImageFile1 in main.cc1 builds from scratch, with a
+// new session, for every image. Here each (format, input shape) graph is
+// built once, on first use, into one long-lived session and then only fed,
+// so the per image cost is the Run alone.
+//
+// Means and stds come from the preprocess options in BGR order, like the
+// OpenCV paths; the decoded RGB is flipped unless swap_rb asks for RGB.
+// Resizing stretches, letterbox and ops are not supported. Thread safe.
+class TfPreprocessor {
+public:
+    explicit TfPreprocessor(const c_preprocess_options& options,
+        const tensorflow::SessionOptions& session_options = tensorflow::SessionOptions());
+
+    // Decodes JPEG, PNG or single frame GIF bytes, told apart by their
+    // signature, into a {1,height,width,3} float tensor. original receives
+    // the decoded size, for c_image_transform.
+    tensorflow::Status Preprocess(const tensorflow::string& encoded, int width, int height,
+        tensorflow::Tensor* out, cv::Size* original = nullptr);
+    // At the options' input size; returns how to map boxes back in transform.
+    tensorflow::Status Preprocess(const tensorflow::string& encoded, tensorflow::Tensor* out,
+        c_image_transform* transform);
+
+    // Graphs built so far, one per format and shape seen.
+    size_t graphs() const;
+
+private:
+    enum Format { kJpeg, kPng, kGif };
+    struct c_graph {
+        tensorflow::string input;
+        tensorflow::string output;
+        tensorflow::string shape;
+    };
+
+    // Adds the graph for format at width x height to the session if it is
+    // not there yet.
+    tensorflow::Status Prepare(Format format, int width, int height, c_graph* graph);
+
+    const c_preprocess_options options_;
+    std::unique_ptr<tensorflow::Session> session_;
+    mutable std::mutex mu_;
+    bool created_ = false;
+    std::map<std::tuple<int, int, int>, c_graph> graphs_;
+};
@@ -0,0 +1,113 @@
+#include "tiling.hpp"
+
+#include <algorithm>
+
+#include "tensorflow/core/lib/core/errors.h"
+
+#include "trace.hpp"
+
+using tensorflow::Status;
+using tensorflow::Tensor;
+using tensorflow::string;
+
+void plan_tiles(const cv::Size& size, int tile_width, int tile_height, int overlap, std::vector<cv::Rect>* tiles) {
+    tiles->clear();
+    tile_width = std::min(tile_width, size.width);
+    tile_height = std::min(tile_height, size.height);
+    if (tile_width <= 0 || tile_height <= 0)
+        return;
+    const int step_x = std::max(1, tile_width - overlap);
+    const int step_y = std::max(1, tile_height - overlap);
+    for (int y = 0;; y += step_y) {
+        y = std::min(y, size.height - tile_height);
+        for (int x = 0;; x += step_x) {
+            x = std::min(x, size.width - tile_width);
+            tiles->push_back(cv::Rect(x, y, tile_width, tile_height));
+            if (x + tile_width >= size.width)
+                break;
+        }
+        if (y + tile_height >= size.height)
+            break;
+    }
+}
+
+TiledDetector::TiledDetector(tensorflow::Session* session, const c_tile_options& tile,
+    const c_preprocess_options& preprocess, float threshold, const c_nms_options& nms, int top_k,
+    const string& input_layer, const std::vector<string>& output_layers)
+    : session_(session), tile_(tile), preprocess_(preprocess), threshold_(threshold), nms_(nms),
+    input_layer_(input_layer), output_layers_(output_layers),
+    arena_(preprocess.input_height, preprocess.input_width), decoder_(top_k) {}
+
+Status TiledDetector::Detect(const cv::Mat& mat, std::vector<c_tf_detect_result>* dst) {
+    if (mat.empty())
+        return tensorflow::errors::InvalidArgument("empty image");
+    const int tile_width = tile_.tile_width > 0 ? tile_.tile_width : preprocess_.input_width;
+    const int tile_height = tile_.tile_height > 0 ? tile_.tile_height : preprocess_.input_height;
+    plan_tiles(mat.size(), tile_width, tile_height, tile_.overlap, &tiles_);
+    // The whole image goes last, as one more slot.
+    const int tiles = tiles_.size();
+    const int slots = tiles + (tile_.full_image && tiles > 1 ? 1 : 0);
+    const int per_run = tile_.max_batch > 0 ? std::min(tile_.max_batch, slots) : slots;
+    transforms_.resize(per_run);
+    last_tiles_ = slots;
+    last_runs_ = 0;
+
+    // A box touching an inner tile edge that reaches no further than the
+    // overlap lies wholly inside the neighbour across that edge; that tile's
+    // box wins and this cut one is dropped.
+    const float margin = 2.f;
+    const float overlap = tile_.overlap;
+    for (int begin = 0; begin < slots; begin += per_run) {
+        const int n = std::min(per_run, slots - begin);
+        Tensor* input = arena_.Input(n);
+        {
+            TRACE_SCOPE("preprocess");
+            for (int b = 0; b < n; ++b) {
+                const int slot = begin + b;
+                if (slot < tiles) {
+                    const cv::Rect& r = tiles_[slot];
+                    if (!preprocess_into_tensor(mat(r), preprocess_, b, input, arena_.Scratch(), &transforms_[b]))
+                        return tensorflow::errors::InvalidArgument("cannot preprocess tile ", slot);
+                    transforms_[b].offset_x = r.x;
+                    transforms_[b].offset_y = r.y;
+                }
+                else {
+                    if (!preprocess_into_tensor(mat, preprocess_, b, input, arena_.Scratch(), &transforms_[b]))
+                        return tensorflow::errors::InvalidArgument("cannot preprocess image");
+                }
+            }
+        }
+
+        Status run_status = TracedRun(session_, { {input_layer_, *input} }, output_layers_, arena_.Outputs());
+        if (!run_status.ok())
+            return run_status;
+        note_inference_done();
+        ++last_runs_;
+
+        TRACE_SCOPE("postprocess");
+        const std::vector<Tensor>& outputs = *arena_.Outputs();
+        for (int b = 0; b < n; ++b) {
+            const int slot = begin + b;
+            const size_t first = slot == 0 ? 0 : decoder_.candidates().size();
+            decoder_.Decode(outputs[0], outputs[1], outputs[2], b, transforms_[b], threshold_, slot > 0);
+            if (slot >= tiles)
+                continue;
+            const float left = tiles_[slot].x;
+            const float top = tiles_[slot].y;
+            const float right = tiles_[slot].x + tiles_[slot].width;
+            const float bottom = tiles_[slot].y + tiles_[slot].height;
+            const bool inner_left = left > 0;
+            const bool inner_top = top > 0;
+            const bool inner_right = right < mat.cols;
+            const bool inner_bottom = bottom < mat.rows;
+            decoder_.RemoveCandidates(first, [&](float x1, float y1, float x2, float y2) {
+                return (inner_left && x1 <= left + margin && x2 <= left + overlap) ||
+                    (inner_top && y1 <= top + margin && y2 <= top + overlap) ||
+                    (inner_right && x2 >= right - margin && x1 >= right - overlap) ||
+                    (inner_bottom && y2 >= bottom - margin && y1 >= bottom - overlap);
+            });
+        }
+    }
+    decoder_.Suppress(nms_, dst);
+    return Status::OK();
+}
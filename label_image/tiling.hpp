@@ -0,0 +1,70 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/public/session.h"
+
+#include "arena.hpp"
+#include "nms_engine.hpp"
+#include "tf_detect.hpp"
+
+// Tiled detection for images much larger than the network input, where a
+// plain downscale loses small objects. The image is cut into overlapping
+// tiles, each preprocessed like a whole image, and the tiles go through
+// batched session runs. Boxes are mapped back by their tile's offset and
+// merged by one NMS over the whole image.
+struct c_tile_options {
+    // Tile size in source pixels. 0 uses the network input size, so tiles
+    // are fed at full resolution.
+    int tile_width = 0;
+    int tile_height = 0;
+    // Pixels shared by neighbouring tiles. An object no larger than this is
+    // seen whole by at least one tile; a box cut by a tile edge within the
+    // overlap is dropped in favour of that tile's.
+    int overlap = 64;
+    // Most tiles per session run, 0 for all tiles of an image in one run.
+    int max_batch = 0;
+    // Also detect on the whole image downscaled, for objects larger than a
+    // tile.
+    bool full_image = true;
+};
+
+// Tiles of tile_width x tile_height covering size in row-major order,
+// neighbours sharing at least overlap pixels. The last row and column are
+// moved in to end on the border. Tiles are clipped to images smaller than
+// a tile.
+void plan_tiles(const cv::Size& size, int tile_width, int tile_height, int overlap, std::vector<cv::Rect>* tiles);
+
+// Runs tiled detection on one image at a time. Buffers are kept between
+// images; use one per thread.
+class TiledDetector {
+public:
+    TiledDetector(tensorflow::Session* session, const c_tile_options& tile, const c_preprocess_options& preprocess,
+        float threshold, const c_nms_options& nms, int top_k, const tensorflow::string& input_layer,
+        const std::vector<tensorflow::string>& output_layers);
+
+    // Replaces dst with the detections on mat, in mat coordinates.
+    tensorflow::Status Detect(const cv::Mat& mat, std::vector<c_tf_detect_result>* dst);
+
+    // Tiles, including the whole image pass, and session runs of the last
+    // Detect.
+    int last_tiles() const { return last_tiles_; }
+    int last_runs() const { return last_runs_; }
+
+private:
+    tensorflow::Session* session_;
+    const c_tile_options tile_;
+    const c_preprocess_options preprocess_;
+    const float threshold_;
+    const c_nms_options nms_;
+    const tensorflow::string input_layer_;
+    const std::vector<tensorflow::string> output_layers_;
+    WorkerArena arena_;
+    DetectionDecoder decoder_;
+    std::vector<cv::Rect> tiles_;
+    std::vector<c_image_transform> transforms_;
+    int last_tiles_ = 0;
+    int last_runs_ = 0;
+};
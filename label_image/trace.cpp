@@ -0,0 +1,372 @@
+#include "trace.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "tensorflow/core/framework/step_stats.pb.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/strings/strcat.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/logging.h"
+#include "tensorflow/core/protobuf/config.pb.h"
+
+using tensorflow::Status;
+using tensorflow::string;
+using tensorflow::uint64;
+
+std::atomic<bool> g_tracing{ false };
+
+namespace {
+
+// Per-thread span storage is capped so a long trace cannot eat the heap.
+const size_t kMaxSpansPerThread = 1 << 20;
+
+struct c_span {
+    const char* name;
+    uint64 start_us;
+    uint64 dur_us;
+};
+
+struct c_stage_total {
+    long long count = 0;
+    double total_us = 0;
+    double max_us = 0;
+
+    void Add(double us) {
+        ++count;
+        total_us += us;
+        max_us = std::max(max_us, us);
+    }
+};
+
+// Spans only ever come from their own thread; the mutex is uncontended
+// except while a writer collects them.
+struct c_thread_buffer {
+    std::mutex mu;
+    int tid = 0;
+    std::vector<c_span> spans;
+    // Keyed by text, the same literal may have several addresses.
+    std::map<string, c_stage_total> stages;
+    long long dropped = 0;
+};
+
+struct c_op_event {
+    string name;
+    string op;
+    int device;
+    uint64 start_us;
+    uint64 dur_us;
+};
+
+struct c_trace_state {
+    std::mutex mu;
+    c_trace_options options;
+    uint64 start_us = 0;
+    std::vector<std::shared_ptr<c_thread_buffer> > buffers;
+    std::map<string, long long> counters;
+    std::map<string, long long> last_counters;
+    uint64 last_write_us = 0;
+    std::map<int, std::pair<string, std::function<double()> > > gauges;
+    int next_gauge = 0;
+    std::vector<string> devices;
+    std::vector<c_op_event> op_events;
+    std::map<string, c_stage_total> op_totals;
+    std::map<string, long long> peak_bytes;
+
+    std::unique_ptr<tensorflow::Thread> metrics_thread;
+    std::condition_variable wake;
+    bool stop = false;
+};
+
+std::atomic<int> g_full_trace_every{ 0 };
+std::atomic<long long> g_run_calls{ 0 };
+
+c_trace_state& state() {
+    static c_trace_state* s = new c_trace_state;
+    return *s;
+}
+
+c_thread_buffer* thread_buffer() {
+    thread_local std::shared_ptr<c_thread_buffer> buffer;
+    if (!buffer) {
+        buffer = std::make_shared<c_thread_buffer>();
+        c_trace_state& s = state();
+        std::unique_lock<std::mutex> lock(s.mu);
+        buffer->tid = s.buffers.size() + 1;
+        s.buffers.push_back(buffer);
+    }
+    return buffer.get();
+}
+
+string json_escape(const string& text) {
+    string out;
+    for (char c : text) {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        if ((unsigned char)c < 0x20)
+            continue;
+        out += c;
+    }
+    return out;
+}
+
+// "conv1/Conv2D = Conv2D(input, weights)" -> "Conv2D"
+string op_type(const tensorflow::NodeExecStats& node) {
+    const string& label = node.timeline_label();
+    const size_t eq = label.find(" = ");
+    if (eq == string::npos)
+        return node.node_name();
+    const size_t paren = label.find('(', eq);
+    return label.substr(eq + 3, paren == string::npos ? string::npos : paren - eq - 3);
+}
+
+void record_step_stats(const tensorflow::StepStats& step_stats) {
+    c_trace_state& s = state();
+    std::unique_lock<std::mutex> lock(s.mu);
+    const bool keep_events = !s.options.chrome_trace.empty();
+    for (const tensorflow::DeviceStepStats& dev : step_stats.dev_stats()) {
+        auto found = std::find(s.devices.begin(), s.devices.end(), dev.device());
+        const int device = found - s.devices.begin();
+        if (found == s.devices.end())
+            s.devices.push_back(dev.device());
+        for (const tensorflow::NodeExecStats& node : dev.node_stats()) {
+            const uint64 dur = node.all_end_rel_micros() ? node.all_end_rel_micros() : node.op_end_rel_micros();
+            const string op = op_type(node);
+            s.op_totals[op].Add(dur);
+            for (const tensorflow::AllocatorMemoryUsed& memory : node.memory()) {
+                long long& peak = s.peak_bytes[memory.allocator_name()];
+                peak = std::max<long long>(peak, memory.peak_bytes());
+            }
+            if (keep_events && s.op_events.size() < kMaxSpansPerThread)
+                s.op_events.push_back(c_op_event{ node.node_name(), op, device, node.all_start_micros(), dur });
+        }
+    }
+}
+
+string metrics_text(c_trace_state& s, uint64 now_us) {
+    string out = tensorflow::strings::StrCat("# label_image metrics\nlabel_image_uptime_seconds ",
+        (now_us - s.start_us) / 1e6, "\n");
+
+    std::map<string, c_stage_total> stages;
+    long long dropped = 0;
+    for (auto& buffer : s.buffers) {
+        std::unique_lock<std::mutex> lock(buffer->mu);
+        for (auto& stage : buffer->stages) {
+            c_stage_total& total = stages[stage.first];
+            total.count += stage.second.count;
+            total.total_us += stage.second.total_us;
+            total.max_us = std::max(total.max_us, stage.second.max_us);
+        }
+        dropped += buffer->dropped;
+    }
+    for (auto& stage : stages) {
+        tensorflow::strings::StrAppend(&out,
+            "label_image_stage_calls_total{stage=\"", stage.first, "\"} ", stage.second.count, "\n",
+            "label_image_stage_seconds_total{stage=\"", stage.first, "\"} ", stage.second.total_us / 1e6, "\n",
+            "label_image_stage_max_seconds{stage=\"", stage.first, "\"} ", stage.second.max_us / 1e6, "\n");
+    }
+
+    // Rates are over the interval since the previous write.
+    const double interval_s = s.last_write_us ? (now_us - s.last_write_us) / 1e6 : (now_us - s.start_us) / 1e6;
+    for (auto& counter : s.counters) {
+        const double rate = interval_s > 0 ? (counter.second - s.last_counters[counter.first]) / interval_s : 0;
+        tensorflow::strings::StrAppend(&out,
+            "label_image_", counter.first, "_total ", counter.second, "\n",
+            "label_image_", counter.first, "_per_second ", rate, "\n");
+    }
+    s.last_counters = s.counters;
+    s.last_write_us = now_us;
+
+    for (auto& gauge : s.gauges) {
+        tensorflow::strings::StrAppend(&out, "label_image_", gauge.second.first, " ", gauge.second.second(), "\n");
+    }
+    for (auto& op : s.op_totals) {
+        tensorflow::strings::StrAppend(&out,
+            "label_image_op_seconds_total{op=\"", op.first, "\"} ", op.second.total_us / 1e6, "\n",
+            "label_image_op_calls_total{op=\"", op.first, "\"} ", op.second.count, "\n");
+    }
+    for (auto& peak : s.peak_bytes) {
+        tensorflow::strings::StrAppend(&out,
+            "label_image_peak_allocator_bytes{allocator=\"", peak.first, "\"} ", peak.second, "\n");
+    }
+    tensorflow::strings::StrAppend(&out, "label_image_trace_dropped_spans_total ", dropped, "\n");
+    return out;
+}
+
+// Replaces the file in one rename so a scraper never reads half of it.
+Status write_metrics(c_trace_state& s) {
+    string text;
+    {
+        std::unique_lock<std::mutex> lock(s.mu);
+        text = metrics_text(s, trace_now_us());
+    }
+    tensorflow::Env* env = tensorflow::Env::Default();
+    const string tmp = s.options.metrics_file + ".tmp";
+    TF_RETURN_IF_ERROR(tensorflow::WriteStringToFile(env, tmp, text));
+    return env->RenameFile(tmp, s.options.metrics_file);
+}
+
+Status write_chrome_trace(c_trace_state& s) {
+    string out = "{\"traceEvents\":[\n";
+    tensorflow::strings::StrAppend(&out,
+        "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"label_image\"}}");
+    std::unique_lock<std::mutex> lock(s.mu);
+    for (auto& buffer : s.buffers) {
+        std::unique_lock<std::mutex> buffer_lock(buffer->mu);
+        for (const c_span& span : buffer->spans) {
+            tensorflow::strings::StrAppend(&out, ",\n{\"name\":\"", span.name, "\",\"cat\":\"stage\",\"ph\":\"X\",\"ts\":",
+                span.start_us, ",\"dur\":", span.dur_us, ",\"pid\":0,\"tid\":", buffer->tid, "}");
+        }
+    }
+    for (size_t d = 0; d < s.devices.size(); ++d) {
+        tensorflow::strings::StrAppend(&out, ",\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":", d + 1,
+            ",\"args\":{\"name\":\"", json_escape(s.devices[d]), "\"}}");
+    }
+    for (const c_op_event& e : s.op_events) {
+        tensorflow::strings::StrAppend(&out, ",\n{\"name\":\"", json_escape(e.op), "\",\"cat\":\"op\",\"ph\":\"X\",\"ts\":",
+            e.start_us, ",\"dur\":", e.dur_us, ",\"pid\":", e.device + 1, ",\"tid\":0,\"args\":{\"node\":\"",
+            json_escape(e.name), "\"}}");
+    }
+    out += "\n]}\n";
+    return tensorflow::WriteStringToFile(tensorflow::Env::Default(), s.options.chrome_trace, out);
+}
+
+}  // namespace
+
+uint64 trace_now_us() {
+    return tensorflow::Env::Default()->NowMicros();
+}
+
+void trace_span(const char* name, uint64 start_us, uint64 end_us) {
+    c_thread_buffer* buffer = thread_buffer();
+    std::unique_lock<std::mutex> lock(buffer->mu);
+    buffer->stages[name].Add(end_us - start_us);
+    if (buffer->spans.size() < kMaxSpansPerThread)
+        buffer->spans.push_back(c_span{ name, start_us, end_us - start_us });
+    else
+        ++buffer->dropped;
+}
+
+void trace_count(const char* name, long long delta) {
+    if (!tracing())
+        return;
+    c_trace_state& s = state();
+    std::unique_lock<std::mutex> lock(s.mu);
+    s.counters[name] += delta;
+}
+
+TraceGauge::TraceGauge(const string& name, std::function<double()> sample) {
+    c_trace_state& s = state();
+    std::unique_lock<std::mutex> lock(s.mu);
+    id_ = s.next_gauge++;
+    s.gauges[id_] = std::make_pair(name, std::move(sample));
+}
+
+TraceGauge::~TraceGauge() {
+    c_trace_state& s = state();
+    std::unique_lock<std::mutex> lock(s.mu);
+    s.gauges.erase(id_);
+}
+
+Status StartTracing(const c_trace_options& options) {
+    c_trace_state& s = state();
+    {
+        std::unique_lock<std::mutex> lock(s.mu);
+        if (s.metrics_thread)
+            return tensorflow::errors::FailedPrecondition("tracing already started");
+        s.options = options;
+        s.start_us = trace_now_us();
+        s.stop = false;
+    }
+    g_full_trace_every = options.full_trace_every;
+    g_tracing = true;
+
+    if (!options.metrics_file.empty()) {
+        const int interval_s = std::max(1, options.metrics_interval_s);
+        s.metrics_thread.reset(tensorflow::Env::Default()->StartThread(tensorflow::ThreadOptions(),
+            "trace_metrics", [&s, interval_s]() {
+                std::unique_lock<std::mutex> lock(s.mu);
+                while (!s.wake.wait_for(lock, std::chrono::seconds(interval_s), [&s] { return s.stop; })) {
+                    lock.unlock();
+                    Status status = write_metrics(s);
+                    if (!status.ok())
+                        LOG(WARNING) << "metrics: " << status;
+                    lock.lock();
+                }
+            }));
+    }
+    return Status::OK();
+}
+
+Status StopTracing() {
+    if (!tracing())
+        return Status::OK();
+    g_tracing = false;
+    g_full_trace_every = 0;
+    c_trace_state& s = state();
+    {
+        std::unique_lock<std::mutex> lock(s.mu);
+        s.stop = true;
+    }
+    s.wake.notify_all();
+    s.metrics_thread.reset();
+
+    Status status;
+    if (!s.options.metrics_file.empty())
+        status.Update(write_metrics(s));
+    if (!s.options.chrome_trace.empty()) {
+        status.Update(write_chrome_trace(s));
+        LOG(INFO) << "trace written to " << s.options.chrome_trace;
+    }
+    return status;
+}
+
+TracingScope::~TracingScope() {
+    Status status = StopTracing();
+    if (!status.ok())
+        LOG(WARNING) << "tracing: " << status;
+}
+
+Status TracedRun(tensorflow::Session* session, const std::vector<std::pair<string, tensorflow::Tensor> >& inputs,
+    const std::vector<string>& output_names, std::vector<tensorflow::Tensor>* outputs) {
+    TRACE_SCOPE("session_run");
+    const int every = g_full_trace_every.load(std::memory_order_relaxed);
+    if (every <= 0 || !tracing() || ++g_run_calls % every != 0)
+        return session->Run(inputs, output_names, {}, outputs);
+
+    tensorflow::RunOptions run_options;
+    run_options.set_trace_level(tensorflow::RunOptions::FULL_TRACE);
+    tensorflow::RunMetadata metadata;
+    Status status = session->Run(run_options, inputs, output_names, {}, outputs, &metadata);
+    if (status.ok())
+        record_step_stats(metadata.step_stats());
+    return status;
+}
+
+static const double kHistogramMinMs = 0.01;
+
+void LatencyHistogram::Add(double ms) {
+    int bucket = 0;
+    if (ms > kHistogramMinMs)
+        bucket = std::min(kBuckets - 1, (int)std::ceil(4 * std::log2(ms / kHistogramMinMs)));
+    ++buckets_[bucket];
+    ++count_;
+    sum_ms_ += ms;
+    max_ms_ = std::max(max_ms_, ms);
+}
+
+double LatencyHistogram::Percentile(double p) const {
+    if (count_ == 0)
+        return 0;
+    const long long rank = std::max(1LL, (long long)std::ceil(p * count_));
+    long long seen = 0;
+    int bucket = 0;
+    while (bucket < kBuckets - 1 && (seen += buckets_[bucket]) < rank)
+        ++bucket;
+    return std::min(max_ms_, kHistogramMinMs * std::exp2(bucket / 4.0));
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "tensorflow/core/framework/tensor.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/public/session.h"
+
+// Stage timers, session step stats and periodic counters for the inference
+// path. Nothing is recorded until StartTracing; until then a TRACE_SCOPE
+// costs one relaxed atomic load.
+struct c_trace_options {
+    // Chrome trace / Perfetto JSON timeline written by StopTracing.
+    tensorflow::string chrome_trace;
+    // Counters in Prometheus text format, rewritten every metrics_interval_s.
+    tensorflow::string metrics_file;
+    int metrics_interval_s = 10;
+    // Run every Nth TracedRun with FULL_TRACE and fold its step stats into
+    // the timeline and the per-op counters. 0 disables.
+    int full_trace_every = 0;
+};
+
+extern std::atomic<bool> g_tracing;
+
+inline bool tracing() { return g_tracing.load(std::memory_order_relaxed); }
+
+tensorflow::Status StartTracing(const c_trace_options& options);
+// Stops the metrics thread and writes the final metrics and the timeline.
+tensorflow::Status StopTracing();
+
+// Stops tracing when it goes out of scope, so every exit path of main
+// flushes the timeline and the metrics.
+class TracingScope {
+public:
+    TracingScope() = default;
+    TracingScope(const TracingScope&) = delete;
+    TracingScope& operator=(const TracingScope&) = delete;
+    ~TracingScope();
+};
+
+tensorflow::uint64 trace_now_us();
+// Records a finished span on the calling thread; name must be a literal.
+void trace_span(const char* name, tensorflow::uint64 start_us, tensorflow::uint64 end_us);
+// Adds to a monotonically increasing counter.
+void trace_count(const char* name, long long delta);
+
+// Times the enclosing scope as a span named after the stage.
+class ScopedTrace {
+public:
+    explicit ScopedTrace(const char* name) : name_(tracing() ? name : nullptr) {
+        if (name_)
+            start_us_ = trace_now_us();
+    }
+    ~ScopedTrace() {
+        if (name_)
+            trace_span(name_, start_us_, trace_now_us());
+    }
+
+private:
+    const char* name_;
+    tensorflow::uint64 start_us_ = 0;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) ScopedTrace TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+// Publishes a value sampled whenever metrics are written, e.g. a queue depth,
+// for as long as the object lives.
+class TraceGauge {
+public:
+    TraceGauge(const tensorflow::string& name, std::function<double()> sample);
+    ~TraceGauge();
+
+private:
+    int id_;
+};
+
+// session->Run that, while tracing with full_trace_every set, periodically
+// asks for FULL_TRACE step stats and records them.
+tensorflow::Status TracedRun(tensorflow::Session* session,
+    const std::vector<std::pair<tensorflow::string, tensorflow::Tensor> >& inputs,
+    const std::vector<tensorflow::string>& output_names, std::vector<tensorflow::Tensor>* outputs);
+
+// Latency distribution in fixed buckets, four per doubling from 0.01 ms to
+// about 20 minutes, so recording never allocates and the memory stays the
+// same however long a run goes. Percentiles are exact to a bucket, within
+// 19%. Not thread safe.
+class LatencyHistogram {
+public:
+    void Add(double ms);
+
+    long long count() const { return count_; }
+    double mean() const { return count_ > 0 ? sum_ms_ / count_ : 0; }
+    // Upper bound of the bucket holding quantile p, at most the largest
+    // value added; 0 when empty.
+    double Percentile(double p) const;
+
+private:
+    static const int kBuckets = 4 * 27;
+
+    std::array<long long, kBuckets> buckets_{};
+    long long count_ = 0;
+    double sum_ms_ = 0;
+    double max_ms_ = 0;
+};